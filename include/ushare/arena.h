@@ -0,0 +1,43 @@
+/*
+ * arena.h : GeeXboX uShare bump allocator for long-lived small objects header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* Objects are carved out of big slabs and can't be freed one by one,
+   the whole arena is released at once. Not thread-safe. */
+struct arena_t;
+
+struct arena_t *arena_new (size_t slab_size);
+void arena_free (struct arena_t *arena);
+
+#ifdef _MSC_VER
+void *arena_alloc (struct arena_t *arena, size_t size);
+#else
+void *arena_alloc (struct arena_t *arena, size_t size)
+    __attribute__ ((malloc));
+#endif
+char *arena_strdup (struct arena_t *arena, const char *str);
+
+/* Bytes currently held by the arena */
+size_t arena_size (const struct arena_t *arena);
+
+#endif /* _ARENA_H_ */
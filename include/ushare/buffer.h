@@ -21,12 +21,19 @@
 #ifndef _STRING_BUFFER_H_
 #define _STRING_BUFFER_H_
 
+/* NUL terminated string, appended to at its end */
 struct buffer_t {
   char *buf;
   size_t len;
   size_t capacity;
 };
 
+/* Some characters to append, not NUL terminated */
+struct buffer_chunk_t {
+  const char *data;
+  size_t len;
+};
+
 #ifdef _MSC_VER
 struct buffer_t *buffer_new (void);
 #else
@@ -35,7 +42,13 @@ struct buffer_t *buffer_new (void)
 #endif
 void buffer_free (struct buffer_t *buffer);
 
+bool buffer_reserve (struct buffer_t *buffer, size_t n);
 void buffer_append (struct buffer_t *buffer, const char *str);
+void buffer_appendn (struct buffer_t *buffer, const char *str, size_t n);
+void buffer_appendv (struct buffer_t *buffer,
+                     const struct buffer_chunk_t *chunks, int n);
+void buffer_append_int (struct buffer_t *buffer, long long value);
+void buffer_append_xml (struct buffer_t *buffer, const char *str);
 
 #ifdef _MSC_VER
 void buffer_appendf (struct buffer_t *buffer, const char *format, ...);
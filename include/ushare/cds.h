@@ -22,6 +22,8 @@
 #ifndef CDS_H_
 #define CDS_H_
 
+#include <upnp/upnp.h>
+
 #define CDS_DESCRIPTION \
 "<?xml version=\"1.0\" encoding=\"utf-8\"?>" \
 "<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">" \
@@ -159,6 +161,10 @@
 "      <name>SystemUpdateID</name>" \
 "      <dataType>ui4</dataType>" \
 "    </stateVariable>" \
+"    <stateVariable sendEvents=\"yes\">" \
+"      <name>ContainerUpdateIDs</name>" \
+"      <dataType>string</dataType>" \
+"    </stateVariable>" \
 "    <stateVariable sendEvents=\"no\">" \
 "      <name>A_ARG_TYPE_Count</name>" \
 "      <dataType>ui4</dataType>" \
@@ -209,4 +215,13 @@
 #define CDS_SERVICE_ID "urn:upnp-org:serviceId:ContentDirectory"
 #define CDS_SERVICE_TYPE "urn:schemas-upnp-org:service:ContentDirectory:1"
 
+struct metadata_list_t;
+
+void cds_subscribe (UpnpSubscriptionRequest *request);
+void cds_notify_update (struct metadata_list_t *list);
+
+void cds_browse_cache_stats (unsigned long *hits, unsigned long *misses,
+                             int *answers, size_t *size);
+void cds_browse_cache_free (void);
+
 #endif /* CDS_H_ */
@@ -27,12 +27,17 @@
 #define USHARE_IFACE              "USHARE_IFACE"
 #define USHARE_PORT               "USHARE_PORT"
 #define USHARE_TELNET_PORT        "USHARE_TELNET_PORT"
+#define USHARE_STREAM_PORT        "USHARE_STREAM_PORT"
 #define USHARE_DIR                "USHARE_DIR"
 #define USHARE_OVERRIDE_ICONV_ERR "USHARE_OVERRIDE_ICONV_ERR"
 #define USHARE_ENABLE_WEB         "USHARE_ENABLE_WEB"
 #define USHARE_ENABLE_TELNET      "USHARE_ENABLE_TELNET"
 #define USHARE_ENABLE_XBOX        "USHARE_ENABLE_XBOX"
 #define USHARE_ENABLE_DLNA        "USHARE_ENABLE_DLNA"
+#define USHARE_SCAN_THREADS       "USHARE_SCAN_THREADS"
+#define USHARE_INDEX_FILE         "USHARE_INDEX_FILE"
+#define USHARE_PREFETCH_SIZE      "USHARE_PREFETCH_SIZE"
+#define USHARE_PREFETCH_MAX       "USHARE_PREFETCH_MAX"
 
 #define USHARE_CONFIG_FILE        "ushare.cfg"
 #define DEFAULT_USHARE_NAME       "uShare"
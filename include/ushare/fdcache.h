@@ -0,0 +1,43 @@
+/*
+ * fdcache.h : GeeXboX uShare media file descriptor cache header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+/* A media file is opened once for all of the requests reading it at the
+   same time, which then only ever use pread () and never the position
+   of the descriptor. Once the last of them is done, the descriptor is
+   kept for the next range request of the renderer : at most
+   FDCACHE_MAX_IDLE of them, each for FDCACHE_IDLE_TIME seconds. It is
+   only shared while the path still leads to the file it was opened on,
+   with the same mtime. */
+#define FDCACHE_MAX_IDLE 16
+#define FDCACHE_IDLE_TIME 10
+
+#ifndef _WIN32
+
+int fdcache_start (void);
+void fdcache_stop (void);
+int fdcache_open (int id, const char *path);
+void fdcache_release (int fd);
+void fdcache_flush (void);
+
+#endif /* _WIN32 */
+
+#endif /* _FDCACHE_H_ */
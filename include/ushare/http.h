@@ -25,7 +25,10 @@
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 
+struct upnp_entry_t;
+
 void http_setcallbaks();
+char *http_get_protocol (struct upnp_entry_t *entry);
 
 #ifdef _WIN32
 bool httpGetDataFile_char(IN char const * const strFilename, OUT wchar_t const **const wstrFilePath);
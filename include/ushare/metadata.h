@@ -35,24 +35,83 @@
 
 struct upnp_entry_t {
   int id;
-  char *fullpath;
+  char *name; /* base name, or full path for a content directory */
 #ifdef HAVE_DLNA
   dlna_profile_t *dlna_profile;
 #endif /* HAVE_DLNA */
   struct upnp_entry_t *parent;
   int child_count;
+  int child_capacity; /* allocated slots in childs, NULL included */
+  bool linked; /* already in the childs list of its parent */
   struct upnp_entry_t **childs;
   struct mime_type_t *mime_type;
   char *title;
   char *url;
   ssize_t size;
+  time_t mtime;
+  unsigned int update_id; /* SystemUpdateID its children last changed in */
   int cover_id;
   int fd;
+  struct didl_fragment_t *didl; /* rendered on first Browse, see cds.c */
+  struct http_info_t *http_info; /* served to HTTP requests, see http.c */
+  struct upnp_sort_t *sorts; /* children in other orders, see cds.c */
 #ifdef HAVE_FAM
   struct ufam_entry_t *ufam_entry;
 #endif /* HAVE_FAM */
 };
 
+/* Children of a container sorted on some criteria, built on demand */
+struct upnp_sort_t {
+  int criteria;
+  struct upnp_entry_t **childs; /* the list it was sorted from */
+  int count;
+  struct upnp_sort_t *next;
+  struct upnp_entry_t *sorted[1]; /* NULL terminated */
+};
+
+/* IDs are handed out densely from ut->starting_id, so entries are found
+   by direct indexing into fixed size chunks. Anything out of range goes
+   to the RB tree instead. */
+#define METADATA_IDS_CHUNK_BITS 12
+#define METADATA_IDS_CHUNK_SIZE (1 << METADATA_IDS_CHUNK_BITS)
+#define METADATA_IDS_MAX_CHUNKS 4096
+
+struct metadata_ids_t {
+  int base; /* ID of the very first slot */
+  struct upnp_entry_t **chunks[METADATA_IDS_MAX_CHUNKS];
+};
+
+/* Memory a writer has unlinked but readers may still be looking at */
+struct metadata_garbage_t {
+  void (*free_fn) (void *data);
+  void *data;
+  struct metadata_garbage_t *next;
+};
+
+/*
+ * One published version of the media list. Readers pin it with
+ * metadata_list_get () and release it with metadata_list_put (); a
+ * rebuild publishes a new version, the previous ones are freed once
+ * the last reader is gone.
+ */
+struct metadata_list_t {
+  struct upnp_entry_t *root_entry;
+  struct metadata_ids_t *ids;
+  struct rbtree *rb; /* sparse IDs only */
+  struct arena_t *arena; /* entries and their strings */
+  size_t dead; /* arena bytes of the entries rescans have removed */
+  int nr_entries;
+  unsigned int generation;
+  unsigned int update_id; /* SystemUpdateID */
+  int *updated; /* IDs of the containers that have changed in this version */
+  int nr_updated;
+  int refcount;
+  bool owns_tree; /* false once the tree is shared with a newer version */
+  struct metadata_garbage_t *garbage; /* freed along with this version */
+  struct search_index_t *search_index; /* built on demand, see searchindex.c */
+  struct metadata_list_t *next; /* next retired version */
+};
+
 typedef struct xml_convert_s {
   char charac;
   char *xml;
@@ -60,9 +119,22 @@ typedef struct xml_convert_s {
 
 void free_metadata_list (struct ushare_t *ut);
 void build_metadata_list (struct ushare_t *ut);
-struct upnp_entry_t *upnp_get_entry (struct ushare_t *ut, int id);
-void upnp_entry_free (struct ushare_t *ut, struct upnp_entry_t *entry);
+int metadata_rescan_containers (struct ushare_t *ut,
+                                const int *ids, int count);
+int metadata_rescan_all (struct ushare_t *ut);
+void metadata_save_index (struct ushare_t *ut);
+
+struct metadata_list_t *metadata_list_get (struct ushare_t *ut);
+void metadata_list_put (struct ushare_t *ut, struct metadata_list_t *list);
+
+struct upnp_entry_t *upnp_get_entry (struct metadata_list_t *list, int id);
+struct upnp_entry_t **upnp_entry_get_childs (const struct upnp_entry_t *entry,
+                                             int *count);
+int upnp_entry_get_path (const struct upnp_entry_t *entry,
+                         char *buf, size_t size);
+const char *upnp_entry_class (const struct upnp_entry_t *entry);
 int rb_compare (const void *pa, const void *pb, const void *config);
+char *convert_xml (const char *title);
 
 
 
@@ -0,0 +1,88 @@
+/*
+ * metaindex.h : GeeXboX uShare persistent metadata index header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _METAINDEX_H_
+#define _METAINDEX_H_
+
+#ifndef _WIN32
+#include <stdint.h>
+#endif
+
+#include "scanner.h"
+
+#define METAINDEX_MAGIC "USHAREIX"
+#define METAINDEX_VERSION 1
+
+#define METAINDEX_FLAG_DIR 0x1
+
+/*
+ * On-disk layout, all in host byte order :
+ *   struct metaindex_header_t
+ *   struct metaindex_record_t [nr_records]
+ *   string table [strings_len]
+ * Content directories come first, then the children of every directory
+ * are stored contiguously, in scandir() order.
+ */
+struct metaindex_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t nr_records;
+  uint32_t strings_len;
+  int32_t starting_id;
+  int32_t next_id;
+  uint32_t nr_roots;
+};
+
+struct metaindex_record_t {
+  long long size;
+  long long mtime;
+  int32_t id;
+  int32_t parent;       /* record index of parent directory, -1 if none */
+  uint32_t first_child; /* record index of first child */
+  uint32_t nr_childs;
+  uint32_t name;        /* offset in string table (full path for roots) */
+  uint32_t flags;
+};
+
+struct metaindex_t;
+struct upnp_entry_t;
+
+struct metaindex_t *metaindex_load (const char *filename, int starting_id);
+void metaindex_free (struct metaindex_t *index);
+
+int metaindex_next_id (const struct metaindex_t *index);
+const char *metaindex_name (const struct metaindex_t *index,
+                            const struct metaindex_record_t *record);
+const struct metaindex_record_t *
+metaindex_child (const struct metaindex_t *index,
+                 const struct metaindex_record_t *record, uint32_t n);
+
+/* Look for an entry named name in the directory parent (NULL to look for
+   a content directory by its full path) */
+const struct metaindex_record_t *
+metaindex_find (const struct metaindex_t *index,
+                const struct metaindex_record_t *parent, const char *name);
+
+int metaindex_save (const char *filename, struct scan_dir_t **dirs,
+                    int nr_dirs, int starting_id, int next_id);
+int metaindex_save_entries (const char *filename,
+                            const struct upnp_entry_t *root,
+                            int starting_id, int next_id);
+
+#endif /* _METAINDEX_H_ */
@@ -0,0 +1,51 @@
+/*
+ * prefetch.h : GeeXboX uShare media prefetcher header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+/* Streams are read from disk in chunks of PREFETCH_CHUNK_SIZE bytes, at
+   offsets multiple of it, by a pool of PREFETCH_THREADS threads. Each
+   stream keeps a ring of such chunks read ahead of its position, as
+   many as fit in its budget (USHARE_PREFETCH_SIZE), while all of the
+   rings together stay below USHARE_PREFETCH_MAX. A stream that doesn't
+   get at least PREFETCH_MIN_CHUNKS is read directly instead. */
+#define PREFETCH_CHUNK_SIZE (512 * 1024)
+#define PREFETCH_MIN_CHUNKS 2
+#define PREFETCH_THREADS 2
+#define PREFETCH_DEFAULT_SIZE 4096 /* KB per stream */
+#define PREFETCH_DEFAULT_MAX 65536 /* KB for all the streams */
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+
+struct prefetch_t;
+
+int prefetch_start (int size, int max);
+void prefetch_stop (void);
+
+struct prefetch_t *prefetch_new (int fd);
+ssize_t prefetch_read (struct prefetch_t *prefetch, off_t pos,
+                       char *buf, size_t len);
+void prefetch_free (struct prefetch_t *prefetch);
+
+#endif /* _WIN32 */
+
+#endif /* _PREFETCH_H_ */
@@ -0,0 +1,59 @@
+/*
+ * reader.h : GeeXboX uShare media file reader header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _READER_H_
+#define _READER_H_
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+
+#include "prefetch.h"
+
+/* The read-ahead window of a stream covers READER_AHEAD_TIME seconds at
+   the rate it is being read, within [READER_MIN_WINDOW, READER_MAX_WINDOW],
+   and is renewed once half of it has been consumed. */
+#define READER_AHEAD_TIME 8
+#define READER_MIN_WINDOW (256 * 1024)
+#define READER_MAX_WINDOW (16 * 1024 * 1024)
+
+/* A media file read from start to end, or from wherever it was last
+   seeked to. What comes next is fetched in large sequential reads rather
+   than on demand : by the prefetch pool when it has room for the stream,
+   else by the kernel, as told to. The descriptor comes from the fdcache
+   and may be shared with other readers of the file. */
+struct reader_t {
+  int fd;
+  struct prefetch_t *prefetch;
+  bool direct; /* no room for a prefetch ring */
+  off_t pos;
+  off_t ahead; /* end of the window the kernel was asked to read */
+  off_t start_pos; /* where the rate is measured from */
+  long long start_time; /* ms */
+};
+
+int reader_open (struct reader_t *reader, int id, const char *path);
+ssize_t reader_read (struct reader_t *reader, char *buf, size_t len);
+int reader_seek (struct reader_t *reader, off_t pos);
+void reader_advance (struct reader_t *reader, off_t pos);
+void reader_close (struct reader_t *reader);
+
+#endif /* _WIN32 */
+
+#endif /* _READER_H_ */
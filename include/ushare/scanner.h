@@ -0,0 +1,65 @@
+/*
+ * scanner.h : GeeXboX uShare parallel content directory scanner header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SCANNER_H_
+#define _SCANNER_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "ushare.h"
+
+#define SCANNER_DEFAULT_THREADS 4
+#define SCANNER_MAX_THREADS 64
+
+struct metaindex_t;
+struct metaindex_record_t;
+
+/* One directory listing entry, as returned by scandir() + stat() */
+struct scan_file_t {
+  char *name;
+  bool dir;
+  ssize_t size;
+  time_t mtime;
+  int id; /* entry ID of a file, -1 if not known yet */
+  struct scan_dir_t *subdir; /* listing of this entry if it's a directory */
+};
+
+/* Listing of a whole directory, filled by one of the scanner threads */
+struct scan_dir_t {
+  char *path;
+  time_t mtime;
+  int id; /* entry ID of the directory, -1 if not known yet */
+  const struct metaindex_record_t *cached; /* previous listing, if any */
+  struct scan_file_t *files;
+  int nr_files;
+};
+
+struct scan_dir_t *scan_dir_new (const char *path);
+void scan_dir_free (struct scan_dir_t *dir);
+
+/* Scan all given directories (and their subdirectories) using nr_threads
+ * worker threads. Listings are kept in scandir() order so that walking the
+ * result depth-first gives the very same order as a serial scan.
+ * Directories whose mtime matches the one recorded in index are not
+ * read again, their previous listing is used instead. */
+int scanner_run (struct scan_dir_t **dirs, int nr_dirs, int nr_threads,
+                 const struct metaindex_t *index);
+
+#endif /* _SCANNER_H_ */
@@ -0,0 +1,79 @@
+/*
+ * searchindex.h : GeeXboX uShare search index header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SEARCHINDEX_H_
+#define _SEARCHINDEX_H_
+
+#include "metadata.h"
+
+/* Entries of the index are ranked in tree order, parents before their
+   children, so that the entries below a container have adjacent ranks.
+   A set of entries is a sorted list of such ranks. */
+struct search_set_t {
+  int *ranks;
+  int count;
+  bool owned; /* malloc'd, else it belongs to the index */
+};
+
+/* Entries below a container that match a Search criteria, in the order
+   of a SortCriteria, cached so that the next pages don't have to look for
+   them again */
+struct search_matches_t {
+  char *criteria;
+  int id; /* of the container */
+  int sort; /* packed sort criteria, 0 for tree order */
+  int *ranks;
+  int count;
+  int refcount;
+  bool cached;
+  unsigned int last_used;
+};
+
+struct search_index_t;
+
+struct search_index_t *search_index_get (struct metadata_list_t *list);
+void search_index_free (struct search_index_t *index);
+
+struct upnp_entry_t *search_index_entry (const struct search_index_t *index,
+                                         int rank);
+bool search_index_range (const struct search_index_t *index,
+                         const struct upnp_entry_t *container,
+                         int *first, int *end);
+int search_index_nr_classes (const struct search_index_t *index);
+const char *search_index_class (const struct search_index_t *index, int n,
+                                struct search_set_t *set);
+bool search_index_title (const struct search_index_t *index,
+                         const char *value, size_t len,
+                         struct search_set_t *set);
+
+struct search_matches_t *search_index_lookup (struct search_index_t *index,
+                                              const char *criteria, int id,
+                                              int sort);
+struct search_matches_t *search_index_store (struct search_index_t *index,
+                                             const char *criteria, int id,
+                                             int sort, int *ranks, int count);
+void search_index_release (struct search_index_t *index,
+                           struct search_matches_t *matches);
+
+void search_set_free (struct search_set_t *set);
+void search_set_and (struct search_set_t *set, struct search_set_t *other);
+bool search_set_or (struct search_set_t *set, struct search_set_t *other);
+int search_set_find (const struct search_set_t *set, int rank);
+
+#endif /* _SEARCHINDEX_H_ */
@@ -0,0 +1,43 @@
+/*
+ * stream.h : GeeXboX uShare media streaming header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "ushare.h"
+
+#define STREAM_BACKLOG 16
+#define STREAM_MAX_CLIENTS 32
+#define STREAM_HEADER_SIZE 8192
+#define STREAM_IDLE_TIMEOUT 15 /* seconds a kept-alive connection may idle */
+#define STREAM_CHUNK_SIZE (1024 * 1024) /* bytes per sendfile () call */
+
+/* Media files are sent from their own HTTP server, straight from the file
+   to the socket with sendfile (), instead of being copied through the
+   buffers of the libupnp web server. It only runs when USHARE_STREAM_PORT
+   is set, and listens on the address of the UPnP server; the libupnp
+   virtual directory serves media otherwise. */
+
+int stream_start (struct ushare_t *ut);
+void stream_stop (void);
+
+/* port the stream server listens on, 0 if it isn't running */
+unsigned short stream_get_port (void);
+
+#endif /* _STREAM_H_ */
@@ -23,13 +23,51 @@
 
 #ifdef HAVE_FAM
 
+#ifndef HAVE_INOTIFY
 #include <fam.h>
+#endif /* HAVE_INOTIFY */
 #include <pthread.h>
 
 
 #include "ushare.h"
 #include "metadata.h"
 
+/* Wait for that long without any new event before rescanning the
+   modified directories, but never delay an update for more than
+   UFAM_MAX_DELAY (both in ms) */
+#define UFAM_QUIET_PERIOD 500
+#define UFAM_MAX_DELAY 5000
+
+/* The metadata index is saved that long (in ms) after the first rescan
+   that changed entries, along with those that follow meanwhile */
+#define UFAM_SAVE_DELAY 30000
+
+#ifdef HAVE_INOTIFY
+
+#define UFAM_HASH_SIZE 1024
+
+struct ufam_t {
+  int fd;         /* inotify instance */
+  int epfd;
+  int wakeup[2];  /* used by ufam_stop() to wake the thread up */
+  struct ufam_entry_t *watches[UFAM_HASH_SIZE]; /* indexed by wd */
+
+  pthread_t thread;
+  pthread_mutex_t startstop_lock;
+  pthread_mutex_t add_monitor_lock;
+  bool stop;
+};
+
+struct ufam_entry_t {
+  struct ufam_t *ufam;
+  struct upnp_entry_t *entry;
+  int id;
+  int wd;
+  struct ufam_entry_t *next;
+};
+
+#else
+
 struct ufam_t {
   FAMConnection fc;
 
@@ -46,6 +84,19 @@ struct ufam_entry_t {
   FAMRequest fr;
 };
 
+#endif /* HAVE_INOTIFY */
+
+/* Directories to rescan, gathered while events keep coming */
+struct ufam_batch_t {
+  int *ids;
+  int count;
+  int size;
+  bool rebuild; /* events were lost, rescan everything */
+  long long first; /* time of the first and last event, in ms */
+  long long last;
+  long long save; /* time to save the metadata index at, 0 if none */
+};
+
 struct ufam_t *ufam_init (void);
 void ufam_free (struct ufam_t *ufam);
 
@@ -55,6 +106,10 @@ void ufam_stop (struct ufam_t *ufam);
 struct ufam_entry_t *ufam_add_monitor (struct ufam_t *ufam, struct upnp_entry_t *entry);
 void ufam_remove_monitor (struct ufam_entry_t *ufam_entry);
 
+void ufam_batch_add (struct ufam_batch_t *batch, int id);
+int ufam_batch_timeout (struct ufam_batch_t *batch);
+void ufam_batch_flush (struct ushare_t *ut, struct ufam_batch_t *batch);
+
 #endif /* HAVE_FAM */
 
 #endif /* _UFAM_H_ */
@@ -147,15 +147,24 @@ struct ushare_t {
   char *interface;
   char *model_name;
   content_list *contentlist;
-  struct rbtree *rb;
-  struct upnp_entry_t *root_entry;
-  int nr_entries;
+  struct metadata_list_t *metadata; /* currently published media list */
+  struct metadata_list_t *retired;  /* older ones, oldest first */
+  pthread_mutex_t metadata_lock;    /* protects the above and refcounts */
+  pthread_mutex_t update_lock;      /* serializes list rebuilds/updates */
   int starting_id;
+  int next_id;
   int init;
+  int scan_threads;
+  int prefetch_size; /* KB */
+  int prefetch_max;  /* KB */
+  char *index_file;
+  int index_next_id; /* IDs below it are known to the saved index */
+  bool index_dirty;  /* entries have changed since it was saved */
   UpnpDevice_Handle dev;
   char *udn;
   char *ip;
   unsigned short port;
+  unsigned short stream_port; /* 0 if media is served by libupnp */
   unsigned short telnet_port;
   struct buffer_t *presentation;
   bool use_presentation;
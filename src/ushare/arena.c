@@ -0,0 +1,169 @@
+/*
+ * arena.c : GeeXboX uShare bump allocator for long-lived small objects.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_DEFAULT_SLAB_SIZE 65536
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+struct arena_slab_t {
+  struct arena_slab_t *next;
+  size_t size;
+  size_t used;
+};
+
+struct arena_t {
+  struct arena_slab_t *slabs; /* current slab first */
+  size_t slab_size;
+  size_t total;
+};
+
+/* usable space starts right after the (aligned) slab header */
+#define ARENA_SLAB_DATA(slab) \
+  ((char *) (slab) + ARENA_ROUND (sizeof (struct arena_slab_t)))
+
+static struct arena_slab_t *
+arena_slab_new (size_t size)
+{
+  struct arena_slab_t *slab;
+
+  slab = (struct arena_slab_t *)
+    malloc (ARENA_ROUND (sizeof (struct arena_slab_t)) + size);
+  if (!slab)
+    return NULL;
+
+  slab->next = NULL;
+  slab->size = size;
+  slab->used = 0;
+
+  return slab;
+}
+
+struct arena_t *
+arena_new (size_t slab_size)
+{
+  struct arena_t *arena;
+
+  arena = (struct arena_t *) malloc (sizeof (struct arena_t));
+  if (!arena)
+    return NULL;
+
+  arena->slabs = NULL;
+  arena->slab_size = slab_size ? ARENA_ROUND (slab_size)
+    : ARENA_DEFAULT_SLAB_SIZE;
+  arena->total = 0;
+
+  return arena;
+}
+
+void
+arena_free (struct arena_t *arena)
+{
+  if (!arena)
+    return;
+
+  while (arena->slabs)
+  {
+    struct arena_slab_t *next = arena->slabs->next;
+
+    free (arena->slabs);
+    arena->slabs = next;
+  }
+
+  free (arena);
+}
+
+void *
+arena_alloc (struct arena_t *arena, size_t size)
+{
+  struct arena_slab_t *slab;
+  void *ptr;
+
+  if (!arena)
+    return NULL;
+
+  size = ARENA_ROUND (size ? size : 1);
+  slab = arena->slabs;
+
+  if (!slab || slab->size - slab->used < size)
+  {
+    /* big objects get a slab of their own, behind the current one,
+       so that its free space isn't wasted */
+    if (size > arena->slab_size / 4)
+    {
+      struct arena_slab_t *big = arena_slab_new (size);
+      if (!big)
+        return NULL;
+
+      big->used = size;
+      arena->total += size;
+      if (slab)
+      {
+        big->next = slab->next;
+        slab->next = big;
+      }
+      else
+        arena->slabs = big;
+
+      return ARENA_SLAB_DATA (big);
+    }
+
+    slab = arena_slab_new (arena->slab_size);
+    if (!slab)
+      return NULL;
+
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->total += slab->size;
+  }
+
+  ptr = ARENA_SLAB_DATA (slab) + slab->used;
+  slab->used += size;
+
+  return ptr;
+}
+
+char *
+arena_strdup (struct arena_t *arena, const char *str)
+{
+  size_t len;
+  char *s;
+
+  if (!str)
+    return NULL;
+
+  len = strlen (str) + 1;
+  s = (char *) arena_alloc (arena, len);
+  if (s)
+    memcpy (s, str, len);
+
+  return s;
+}
+
+size_t
+arena_size (const struct arena_t *arena)
+{
+  return arena ? arena->total : 0;
+}
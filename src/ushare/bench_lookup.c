@@ -0,0 +1,157 @@
+/*
+ * bench_lookup.c : GeeXboX uShare entry lookup benchmark.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Times upnp_get_entry () through the dense ID table against rbfind ()
+   on an RB tree of the same entries, the way they were looked up before.
+   Built with "make bench", in place of ushare.o :
+
+     ./bench_lookup [entries] [lookups]   (1000000 and 10000000 by default)
+
+   metadata.c is included, its static helpers are what fills the table. */
+
+#include "metadata.c"
+
+#include <time.h>
+
+#define BENCH_DEFAULT_ENTRIES 1000000
+#define BENCH_DEFAULT_LOOKUPS 10000000
+
+struct ushare_t *ut = NULL;
+
+_inline void
+display_headers (void)
+{
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift, the same sequence of IDs for both runs */
+static unsigned int
+bench_random (unsigned int *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct ushare_t bench_ut;
+  struct metadata_list_t *list;
+  struct upnp_entry_t *root, *entries;
+  struct upnp_entry_lookup_t *lookups, key;
+  struct rbtree *rb;
+  unsigned int seed;
+  int nr_entries, nr_lookups, i;
+  long found_table = 0, found_rb = 0;
+  double start, table_time, rb_time;
+
+  nr_entries = argc > 1 ? atoi (argv[1]) : BENCH_DEFAULT_ENTRIES;
+  nr_lookups = argc > 2 ? atoi (argv[2]) : BENCH_DEFAULT_LOOKUPS;
+  if (nr_entries <= 0 || nr_lookups <= 0)
+  {
+    fprintf (stderr, "usage: %s [entries] [lookups]\n", argv[0]);
+    return 1;
+  }
+
+  memset (&bench_ut, 0, sizeof (bench_ut));
+  bench_ut.starting_id = STARTING_ENTRY_ID_DEFAULT;
+  ut = &bench_ut;
+
+  list = metadata_list_new (ut, NULL);
+  entries = (struct upnp_entry_t *)
+    calloc (nr_entries + 1, sizeof (struct upnp_entry_t));
+  lookups = (struct upnp_entry_lookup_t *)
+    malloc (nr_entries * sizeof (struct upnp_entry_lookup_t));
+  rb = rbinit (rb_compare, NULL);
+  if (!list || !entries || !lookups || !rb)
+  {
+    fprintf (stderr, "Out of memory\n");
+    return 1;
+  }
+
+  /* a flat tree, only the IDs matter here */
+  root = &entries[0];
+  root->childs = upnp_entry_no_childs;
+  list->root_entry = root;
+
+  for (i = 1; i <= nr_entries; i++)
+  {
+    entries[i].id = i;
+    entries[i].parent = root;
+    entries[i].child_count = -1;
+    entries[i].childs = upnp_entry_no_childs;
+    upnp_entry_add_child (list, root, &entries[i]);
+
+    lookups[i - 1].id = i;
+    lookups[i - 1].entry_ptr = &entries[i];
+    rbsearch ((void *) &lookups[i - 1], rb);
+  }
+
+  seed = 2463534242U;
+  start = bench_now ();
+  for (i = 0; i < nr_lookups; i++)
+    if (upnp_get_entry (list, 1 + bench_random (&seed) % nr_entries))
+      found_table++;
+  table_time = bench_now () - start;
+
+  seed = 2463534242U;
+  start = bench_now ();
+  for (i = 0; i < nr_lookups; i++)
+  {
+    const struct upnp_entry_lookup_t *res;
+
+    key.id = 1 + bench_random (&seed) % nr_entries;
+    pthread_mutex_lock (&metadata_lookup_lock);
+    res = (const struct upnp_entry_lookup_t *) rbfind ((void *) &key, rb);
+    pthread_mutex_unlock (&metadata_lookup_lock);
+    if (res)
+      found_rb++;
+  }
+  rb_time = bench_now () - start;
+
+  printf ("%d entries, %d random lookups\n", nr_entries, nr_lookups);
+  printf ("  RB tree  : %8.2f M lookups/s\n", nr_lookups / rb_time / 1e6);
+  printf ("  ID table : %8.2f M lookups/s\n", nr_lookups / table_time / 1e6);
+
+  rbdestroy (rb);
+  free (lookups);
+  free (root->childs);
+  free (entries);
+  list->root_entry = NULL;
+  metadata_list_free_tree (ut, list);
+  free (list);
+
+  if (found_table != nr_lookups || found_rb != nr_lookups)
+  {
+    fprintf (stderr, "Lookups missed entries\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -30,6 +30,13 @@
 
 #define BUFFER_DEFAULT_CAPACITY 32768
 
+/* beyond that, a C library that can't tell the size it needs is lying */
+#define BUFFER_MAX_FORMAT (1024 * 1024)
+
+#ifndef va_copy
+#define va_copy(dst, src) ((dst) = (src))
+#endif
+
 struct buffer_t *
 buffer_new (void)
 {
@@ -46,53 +53,182 @@ buffer_new (void)
   return buffer;
 }
 
+/*
+ * buffer_reserve : make room for n more characters, besides the
+ *  terminating NUL. Returns false if memory is short.
+ */
+bool
+buffer_reserve (struct buffer_t *buffer, size_t n)
+{
+  size_t capacity;
+  char *buf;
+
+  if (buffer->buf && buffer->len + n < buffer->capacity)
+    return true;
+
+  capacity = MAX (buffer->len + n + 1, 2 * buffer->capacity);
+  capacity = MAX (capacity, BUFFER_DEFAULT_CAPACITY);
+  buf = (char *) realloc (buffer->buf, capacity);
+  if (!buf)
+    return false;
+
+  if (!buffer->buf)
+    buf[0] = '\0';
+  buffer->buf = buf;
+  buffer->capacity = capacity;
+
+  return true;
+}
+
 void
 buffer_append (struct buffer_t *buffer, const char *str)
 {
-  size_t len;
+  if (!str)
+    return;
 
-  if (!buffer || !str)
+  buffer_appendn (buffer, str, strlen (str));
+}
+
+void
+buffer_appendn (struct buffer_t *buffer, const char *str, size_t n)
+{
+  if (!buffer || !str || !buffer_reserve (buffer, n))
     return;
 
-  if (!buffer->buf)
+  memcpy (buffer->buf + buffer->len, str, n);
+  buffer->len += n;
+  buffer->buf[buffer->len] = '\0';
+}
+
+/* Append all n chunks at once, the buffer grows once at most */
+void
+buffer_appendv (struct buffer_t *buffer, const struct buffer_chunk_t *chunks,
+                int n)
+{
+  size_t len = 0;
+  int i;
+
+  if (!buffer || !chunks)
+    return;
+
+  for (i = 0; i < n; i++)
+    len += chunks[i].len;
+
+  if (!buffer_reserve (buffer, len))
+    return;
+
+  for (i = 0; i < n; i++)
   {
-    buffer->capacity = BUFFER_DEFAULT_CAPACITY;
-    buffer->buf = (char *) malloc (buffer->capacity * sizeof (char));
-    memset (buffer->buf, '\0', buffer->capacity);
+    memcpy (buffer->buf + buffer->len, chunks[i].data, chunks[i].len);
+    buffer->len += chunks[i].len;
   }
+  buffer->buf[buffer->len] = '\0';
+}
+
+void
+buffer_append_int (struct buffer_t *buffer, long long value)
+{
+  char str[24], *s = str + sizeof (str);
+  unsigned long long v;
+
+  v = (value < 0) ? - (unsigned long long) value : (unsigned long long) value;
+  do
+  {
+    *--s = '0' + (char) (v % 10);
+    v /= 10;
+  } while (v);
+
+  if (value < 0)
+    *--s = '-';
+
+  buffer_appendn (buffer, s, str + sizeof (str) - s);
+}
+
+/* Append str, with the XML special characters escaped */
+void
+buffer_append_xml (struct buffer_t *buffer, const char *str)
+{
+  const char *s;
+
+  if (!buffer || !str)
+    return;
 
-  len = buffer->len + strlen (str);
-  if (len >= buffer->capacity)
+  for (s = str; *s; s++)
   {
-    buffer->capacity = MAX (len + 1, 2 * buffer->capacity);
-    buffer->buf = realloc (buffer->buf, buffer->capacity);
+    const char *entity;
+
+    switch (*s)
+    {
+    case '"':
+      entity = "&quot;";
+      break;
+    case '&':
+      entity = "&amp;";
+      break;
+    case '\'':
+      entity = "&apos;";
+      break;
+    case '<':
+      entity = "&lt;";
+      break;
+    case '>':
+      entity = "&gt;";
+      break;
+    case '\n':
+      entity = "&#xA;";
+      break;
+    case '\r':
+      entity = "&#xD;";
+      break;
+    case '\t':
+      entity = "&#x9;";
+      break;
+    default:
+      continue;
+    }
+
+    buffer_appendn (buffer, str, s - str);
+    buffer_append (buffer, entity);
+    str = s + 1;
   }
 
-  strcat (buffer->buf, str);
-  buffer->len += strlen (str);
+  buffer_appendn (buffer, str, s - str);
 }
 
 void
 buffer_appendf (struct buffer_t *buffer, const char *format, ...)
 {
-  char str[BUFFER_DEFAULT_CAPACITY];
+  va_list va, copy;
+  size_t room;
   int size;
-  va_list va;
 
-  if (!buffer || !format)
+  if (!buffer || !format || !buffer_reserve (buffer, 0))
     return;
 
+  /* format right at the end of the buffer, and once again if it's too
+     short, with a fresh copy of the arguments */
   va_start (va, format);
-  size = vsnprintf (str, BUFFER_DEFAULT_CAPACITY, format, va);
-  if (size >= BUFFER_DEFAULT_CAPACITY)
+  while (true)
   {
-    char* dynstr = (char *) malloc (size + 1);
-    vsnprintf (dynstr, size + 1, format, va);
-    buffer_append (buffer, dynstr);
-    free (dynstr);
+    room = buffer->capacity - buffer->len;
+    va_copy (copy, va);
+    size = vsnprintf (buffer->buf + buffer->len, room, format, copy);
+    va_end (copy);
+
+    if (size >= 0 && (size_t) size < room)
+    {
+      buffer->len += size;
+      break;
+    }
+
+    /* older C libraries only tell it's too short, not how much is needed */
+    if ((size < 0 && room > BUFFER_MAX_FORMAT)
+        || !buffer_reserve (buffer, size >= 0 ? (size_t) size : 2 * room))
+    {
+      buffer->buf[buffer->len] = '\0';
+      break;
+    }
   }
-  else
-    buffer_append (buffer, str);
   va_end (va);
 }
 
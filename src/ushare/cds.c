@@ -24,6 +24,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <time.h>
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 
@@ -31,10 +33,15 @@
 #include "services.h"
 #include "ushare.h"
 #include "services.h"
+#include "cds.h"
 #include "metadata.h"
+#include "searchindex.h"
 #include "mime.h"
 #include "buffer.h"
 #include "minmax.h"
+#ifdef HAVE_SENDFILE
+#include "stream.h"
+#endif /* HAVE_SENDFILE */
 
 /* Represent the CDS GetSearchCapabilities action. */
 #define SERVICE_CDS_ACTION_SEARCH_CAPS "GetSearchCapabilities"
@@ -102,6 +109,12 @@
 /* Represent the CDS DIDL Message UpdateID argument. */
 #define SERVICE_CDS_DIDL_UPDATE_ID "UpdateID"
 
+/* Represent the CDS SystemUpdateID evented variable. */
+#define SERVICE_CDS_SYSTEM_UPDATE_ID "SystemUpdateID"
+
+/* Represent the CDS ContainerUpdateIDs evented variable. */
+#define SERVICE_CDS_CONTAINER_UPDATE_IDS "ContainerUpdateIDs"
+
 /* DIDL parameters */
 /* Represent the CDS DIDL Message Header Namespace. */
 #define DIDL_NAMESPACE \
@@ -163,76 +176,91 @@
 /* Represent the CDS DIDL Message Container Title value. */
 #define DIDL_CONTAINER_TITLE "dc:title"
 
-/* Represent the "upnp:class" reserved keyword for Search action */
-#define SEARCH_CLASS_MATCH_KEYWORD "(upnp:class = \""
+/* Represent the CDS DIDL Message Date value. */
+#define DIDL_DATE "dc:date"
 
-/* Represent the "upnp:class derived from" reserved keyword */
-#define SEARCH_CLASS_DERIVED_KEYWORD "(upnp:class derivedfrom \""
+/* Represent the CDS DIDL Message Item Album Art value. */
+#define DIDL_ITEM_ALBUM_ART "upnp:albumArtURI"
 
-/* Represent the "res@protocolInfo contains" reserved keyword */
-#define SEARCH_PROTOCOL_CONTAINS_KEYWORD "(res@protocolInfo contains \""
+/* Filter, parsed once per request : which optional properties are shown */
+#define DIDL_FILTER_RES (1 << 0)
+#define DIDL_FILTER_RES_SIZE (1 << 1)
+#define DIDL_FILTER_DATE (1 << 2)
+#define DIDL_FILTER_ALBUM_ART (1 << 3)
+#define DIDL_FILTER_ALL \
+	(DIDL_FILTER_RES | DIDL_FILTER_RES_SIZE | DIDL_FILTER_DATE \
+	| DIDL_FILTER_ALBUM_ART)
 
-/* Represent the Search default keyword */
-#define SEARCH_OBJECT_KEYWORD "object"
+/* Represent the CDS supported search capabilities */
+#define CDS_SEARCH_CAPS \
+	"upnp:class,dc:title,dc:date,@id,@parentID,res@protocolInfo,res@size"
 
-/* Represent the Search 'AND' connector keyword */
-#define SEARCH_AND ") and ("
+/*
+ * Sort criteria are packed into an int, CDS_SORT_KEY_BITS per key, the
+ * first key in the lowest bits. 0 means the order of the file system.
+ */
+#define CDS_SORT_TITLE 1
+#define CDS_SORT_DATE 2
+#define CDS_SORT_SIZE 3
+#define CDS_SORT_CLASS 4
+#define CDS_SORT_KEY_MASK 7
+#define CDS_SORT_DESCENDING 8
+#define CDS_SORT_KEY_BITS 4
+#define CDS_SORT_MAX_KEYS 4
+
+/* Represent the CDS supported sort capabilities */
+#define CDS_SORT_CAPS "dc:title,dc:date,res@size,upnp:class"
+
+/* How many sorted lists a container keeps at most */
+#define CDS_SORT_MAX_CACHED 8
+
+static const struct {
+	const char *name;
+	int filter;
+} didl_filter_properties[] = {
+	{ DIDL_RES, DIDL_FILTER_RES },
+	{ DIDL_RES "@" DIDL_RES_INFO, DIDL_FILTER_RES },
+	{ DIDL_RES "@" DIDL_RES_SIZE, DIDL_FILTER_RES | DIDL_FILTER_RES_SIZE },
+	{ "@" DIDL_RES_SIZE, DIDL_FILTER_RES_SIZE },
+	{ DIDL_DATE, DIDL_FILTER_DATE },
+	{ DIDL_ITEM_ALBUM_ART, DIDL_FILTER_ALBUM_ART },
+	{ NULL, 0 }
+};
 
-static bool
-	filter_has_val (const char *filter, const char *val)
+/*
+ * didl_filter_parse : turn a Filter string such as "dc:date,res@size"
+ *  into the optional properties to show. Unknown ones are skipped, the
+ *  required ones are always shown.
+ */
+static int
+	didl_filter_parse (const char *filter)
 {
-	bool ret = false;
-	char const * const x = _strdup(filter);
+	const char *s = filter;
+	int mask = 0;
 
-	if (!strcmp (filter, "*"))
-		return true;
-	if (x)
+	while (s && *s)
 	{
-		size_t lx = (strlen(x));
-		char *  buffer = NULL;
-		char * m_buffer = (char*) malloc((lx +1) * sizeof(char));
-		memset(m_buffer,'\0',lx +1); //clear the string.
-		buffer = m_buffer;
-
-		if (m_buffer)
-		{
-			size_t length = lx; // no null terminating char.
-			size_t count = 0;
-			size_t pos = 0;
-			char charbuf = 0;
-			char delchar = ',';
-
-			for(;;)
-			{
-				charbuf = x[count];
-
-				// set the char to the buffer (if it isn't the delchar).
-				if (charbuf != delchar) buffer[pos++] = charbuf;
-
-				if (pos > 0)
-				{
-					if (charbuf == delchar || count == length)
-					{
-						char * strBuf = (char*)malloc((pos+1) * sizeof(char));
-						char const *const str = strcpy(strBuf, buffer);
-						ret = !strncmp (str, val, pos);
-
-						free(strBuf);
-
-						if (ret) break;
+		size_t len;
+		int i;
+
+		while (*s == ' ' || *s == ',')
+			s++;
+		len = strcspn (s, ", ");
+		if (len == 1 && *s == '*')
+			return DIDL_FILTER_ALL;
+
+		for (i = 0; didl_filter_properties[i].name; i++)
+			if (strlen (didl_filter_properties[i].name) == len
+				&& !strncmp (s, didl_filter_properties[i].name, len))
+				mask |= didl_filter_properties[i].filter;
+		s += len;
+	}
 
-						memset(buffer,'\0',length+1);
+	/* the size attribute comes with its <res> only */
+	if (!(mask & DIDL_FILTER_RES))
+		mask &= ~DIDL_FILTER_RES_SIZE;
 
-						pos = 0; // reset the position.
-					}
-				}
-				if (count++ == length) break; 
-			}
-		}
-		free (buffer);
-	}
-	free ((void*)x);
-	return ret;
+	return mask;
 }
 
 /* UPnP ContentDirectory Service actions */
@@ -242,7 +270,8 @@ static bool
 	{
 		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
 		
-		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_SEARCH_CAPS, "");
+		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_SEARCH_CAPS,
+			CDS_SEARCH_CAPS);
 
 		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
@@ -256,7 +285,8 @@ static bool
 	{
 		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
 
-		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_SORT_CAPS, "");
+		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_SORT_CAPS,
+			CDS_SORT_CAPS);
 
 		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
@@ -264,14 +294,36 @@ static bool
 	return event->status;
 }
 
+/*
+ * The SystemUpdateID of a version of the media list, or the
+ * ContainerUpdateID of one of its containers, i.e. the SystemUpdateID
+ * its children were last changed in.
+ */
+static unsigned int
+	cds_update_id (const struct metadata_list_t *list,
+	const struct upnp_entry_t *entry)
+{
+	if (entry && entry->child_count >= 0)
+		return entry->update_id;
+
+	return list ? list->update_id : 0;
+}
+
 static bool
 	cds_get_system_update_id (struct action_event_t *event)
 {
+	extern struct ushare_t *ut;
+	struct metadata_list_t *list;
+	char tmp[32];
+
+	list = metadata_list_get (ut);
+	sprintf (tmp, "%u", cds_update_id (list, NULL));
+	metadata_list_put (ut, list);
+
 	{
 		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
 
-		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_UPDATE_ID,
-			SERVICE_CDS_ROOT_OBJECT_ID);
+		upnp_add_response (&actionResult, event, SERVICE_CDS_ARG_UPDATE_ID, tmp);
 
 		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
@@ -279,95 +331,282 @@ static bool
 	return event->status;
 }
 
+/* ContainerUpdateIDs : "id,UpdateID" of the containers that have changed
+   in this version of the media list */
+static void
+	cds_container_update_ids (struct buffer_t *out,
+	const struct metadata_list_t *list)
+{
+	int i;
+
+	for (i = 0; list && i < list->nr_updated; i++)
+	{
+		if (i)
+			buffer_appendn (out, ",", 1);
+		buffer_append_int (out, list->updated[i]);
+		buffer_appendn (out, ",", 1);
+		buffer_append_int (out, list->update_id);
+	}
+}
+
+/* Accept a subscription to the CDS events, with their current values */
+void
+	cds_subscribe (UpnpSubscriptionRequest *request)
+{
+	extern struct ushare_t *ut;
+	const char *names[2] = { SERVICE_CDS_SYSTEM_UPDATE_ID,
+		SERVICE_CDS_CONTAINER_UPDATE_IDS };
+	const char *values[2];
+	struct metadata_list_t *list;
+	struct buffer_t *ids;
+	char tmp[32];
+
+	if (strcmp (UpnpSubscriptionRequest_get_ServiceId_cstr (request),
+		CDS_SERVICE_ID))
+		return;
+
+	ids = buffer_new ();
+	if (!ids)
+		return;
+
+	list = metadata_list_get (ut);
+	sprintf (tmp, "%u", cds_update_id (list, NULL));
+	cds_container_update_ids (ids, list);
+	metadata_list_put (ut, list);
+
+	values[0] = tmp;
+	values[1] = ids->buf ? ids->buf : "";
+	UpnpAcceptSubscription (ut->dev,
+		UpnpSubscriptionRequest_get_UDN_cstr (request), CDS_SERVICE_ID,
+		names, values, 2, UpnpSubscriptionRequest_get_SID_cstr (request));
+
+	buffer_free (ids);
+}
+
+/*
+ * Tell the subscribers that a new version of the media list has been
+ * published : control points only need to browse again the containers
+ * listed in ContainerUpdateIDs. There's none after a full rebuild, where
+ * everything has changed.
+ */
+void
+	cds_notify_update (struct metadata_list_t *list)
+{
+	extern struct ushare_t *ut;
+	const char *names[2] = { SERVICE_CDS_SYSTEM_UPDATE_ID,
+		SERVICE_CDS_CONTAINER_UPDATE_IDS };
+	const char *values[2];
+	struct buffer_t *ids, *udn;
+	char tmp[32];
+
+	if (!list || !ut->udn)
+		return;
+
+	ids = buffer_new ();
+	udn = buffer_new ();
+	if (ids && udn)
+	{
+		sprintf (tmp, "%u", cds_update_id (list, NULL));
+		cds_container_update_ids (ids, list);
+		buffer_appendf (udn, "uuid:%s", ut->udn);
+
+		values[0] = tmp;
+		values[1] = ids->buf;
+		if (udn->buf)
+			UpnpNotify (ut->dev, udn->buf, CDS_SERVICE_ID, names, values,
+			ids->buf ? 2 : 1);
+	}
+
+	if (ids)
+		buffer_free (ids);
+	if (udn)
+		buffer_free (udn);
+}
+
 static void
 	didl_add_header (struct buffer_t *out)
 {
-	buffer_appendf (out, "<%s %s>", DIDL_LITE, DIDL_NAMESPACE);
+	buffer_append (out, "<" DIDL_LITE " " DIDL_NAMESPACE ">");
 }
 
 static void
 	didl_add_footer (struct buffer_t *out)
 {
-	buffer_appendf (out, "</%s>", DIDL_LITE);
+	buffer_append (out, "</" DIDL_LITE ">");
 }
 
 static void
-	didl_add_tag (struct buffer_t *out, char *tag, char *value)
+	didl_add_tag (struct buffer_t *out, const char *tag, const char *value)
 {
 	if (value)
-		buffer_appendf (out, "<%s>%s</%s>", tag, value, tag);
+	{
+		buffer_append (out, "<");
+		buffer_append (out, tag);
+		buffer_append (out, ">");
+		buffer_append (out, value);
+		buffer_append (out, "</");
+		buffer_append (out, tag);
+		buffer_append (out, ">");
+	}
 }
 
 static void
-	didl_add_param (struct buffer_t *out, char *param, char *value)
+	didl_add_param (struct buffer_t *out, const char *param,
+	const char *value)
 {
 	if (value)
-		buffer_appendf (out, " %s=\"%s\"", param, value);
+	{
+		buffer_append (out, " ");
+		buffer_append (out, param);
+		buffer_append (out, "=\"");
+		buffer_append (out, value);
+		buffer_append (out, "\"");
+	}
 }
 
 static void
-	didl_add_value (struct buffer_t *out, char *param, ssize_t value)
+	didl_add_value (struct buffer_t *out, const char *param, ssize_t value)
 {
-	
-	buffer_appendf (out, " %s=\"%llu\"", param, value);
+	buffer_append (out, " ");
+	buffer_append (out, param);
+	buffer_append (out, "=\"");
+	buffer_append_int (out, value);
+	buffer_append (out, "\"");
 }
 
+/* "http://address:port" of the server, as in the URLs of the items */
 static void
-	didl_add_item (struct buffer_t *out, int item_id,
-	int parent_id, char *restricted, char *class, char *title,
-	char *protocol_info, ssize_t size, char *url, int cover_id,
-	char *filter)
-{
-	buffer_appendf (out, "<%s", DIDL_ITEM);
-	didl_add_value (out, DIDL_ITEM_ID, item_id);
-	didl_add_value (out, DIDL_ITEM_PARENT_ID, parent_id);
-	didl_add_param (out, DIDL_ITEM_RESTRICTED, restricted);
-	buffer_append (out, ">");
+	didl_server_address (char *buf, size_t size)
+{
+	extern struct ushare_t *ut;
+	int port = ut->port;
+#ifdef HAVE_SENDFILE
+	int stream_port = stream_get_port ();
 
-	didl_add_tag (out, DIDL_ITEM_CLASS, class);
-	didl_add_tag (out, DIDL_ITEM_TITLE, title);
+	/* media is streamed from its own server when it runs */
+	if (stream_port)
+		port = stream_port;
+#endif /* HAVE_SENDFILE */
 
-	//if <upnp:class>object.item.audioItem.musicTrack</upnp:class>
+	snprintf (buf, size, "http://%s:%d", UpnpGetServerIpAddress (), port);
+}
 
-	//<upnp:albumArtURI dlna:profileID="JPEG_TN" xmlns:dlna="urn:schemas-dlnaorg:metadata-1-0/">http://192.168.0.1:8200/AlbumArt/189.jpg</upnp:albumArtURI>
+/* Format the date of entry the way dc:date shows it */
+static size_t
+	cds_entry_date (struct upnp_entry_t *entry, char *buf, size_t size)
+{
+	struct tm tm;
 
-	if (!strcmp (class, UPNP_AUDIO))
-	{
-		extern struct ushare_t *ut;
-		struct upnp_entry_t *cover;
+#ifdef _WIN32
+	if (localtime_s (&tm, &entry->mtime))
+		return 0;
+#else
+	if (!localtime_r (&entry->mtime, &tm))
+		return 0;
+#endif
 
-		cover = upnp_get_entry (ut, cover_id);
-		if (cover)
-		{
-			//printf ("**** Cover URL = %s *****\n", cover->url);
-		}
-	}
+	return strftime (buf, size, "%Y-%m-%d", &tm);
+}
+
+static void
+	didl_add_date (struct buffer_t *out, struct upnp_entry_t *entry)
+{
+	char date[32];
+
+	if (entry->mtime && cds_entry_date (entry, date, sizeof (date)))
+		didl_add_tag (out, DIDL_DATE, date);
+}
+
+/* Cover picked for an audio item among the files of its directory,
+   see upnp_audio_set_covers () */
+static struct upnp_entry_t *
+	didl_album_art (struct metadata_list_t *list,
+	const struct upnp_entry_t *entry)
+{
+	struct upnp_entry_t *cover;
+
+	if (entry->cover_id < 0)
+		return NULL;
+
+	cover = upnp_get_entry (list, entry->cover_id);
+	if (!cover || !cover->url)
+		return NULL;
+
+	return cover;
+}
+
+/*
+ * didl_add_album_art : add the upnp:albumArtURI of entry, if it has a
+ *  cover. Returns where the server address goes, 0 if there's no cover.
+ */
+static size_t
+	didl_add_album_art (struct buffer_t *out, struct metadata_list_t *list,
+	struct upnp_entry_t *entry, const char *server)
+{
+	struct upnp_entry_t *cover = didl_album_art (list, entry);
+	size_t url;
+
+	if (!cover)
+		return 0;
+
+	buffer_append (out, "<" DIDL_ITEM_ALBUM_ART ">");
+	url = out->len;
+	buffer_append (out, server);
+	buffer_append (out, VIRTUAL_DIR "/");
+	buffer_append (out, cover->url);
+	buffer_append (out, "</" DIDL_ITEM_ALBUM_ART ">");
+
+	return url;
+}
+
+static void
+	didl_add_item (struct buffer_t *out, struct metadata_list_t *list,
+	struct upnp_entry_t *entry, char *restricted, char *class,
+	char *protocol_info, int filter,
+	const char *server)
+{
+	buffer_append (out, "<" DIDL_ITEM);
+	didl_add_value (out, DIDL_ITEM_ID, entry->id);
+	didl_add_value (out, DIDL_ITEM_PARENT_ID,
+		entry->parent ? entry->parent->id : -1);
+	didl_add_param (out, DIDL_ITEM_RESTRICTED, restricted);
+	buffer_append (out, ">");
+
+	didl_add_tag (out, DIDL_ITEM_CLASS, class);
+	didl_add_tag (out, DIDL_ITEM_TITLE, entry->title);
+
+	if (filter & DIDL_FILTER_DATE)
+		didl_add_date (out, entry);
+	if (filter & DIDL_FILTER_ALBUM_ART)
+		didl_add_album_art (out, list, entry, server);
 
-	if (filter_has_val (filter, DIDL_RES))
+	if (filter & DIDL_FILTER_RES)
 	{
-		buffer_appendf (out, "<%s", DIDL_RES);
+		buffer_append (out, "<" DIDL_RES);
 		// protocolInfo is required :
 		didl_add_param (out, DIDL_RES_INFO, protocol_info);
-		if (filter_has_val (filter, "@"DIDL_RES_SIZE))
-			didl_add_value (out, DIDL_RES_SIZE, size);
+		if (filter & DIDL_FILTER_RES_SIZE)
+			didl_add_value (out, DIDL_RES_SIZE, entry->size);
 		buffer_append (out, ">");
-		if (url)
+		if (entry->url)
 		{
-			extern struct ushare_t *ut;
-			buffer_appendf (out, "http://%s:%d%s/%s",
-				UpnpGetServerIpAddress (), ut->port, VIRTUAL_DIR, url);
+			buffer_append (out, server);
+			buffer_append (out, VIRTUAL_DIR "/");
+			buffer_append (out, entry->url);
 		}
-		buffer_appendf (out, "</%s>", DIDL_RES);
+		buffer_append (out, "</" DIDL_RES ">");
 	}
-	buffer_appendf (out, "</%s>", DIDL_ITEM);
+	buffer_append (out, "</" DIDL_ITEM ">");
 }
 
+/* Opening tag and required properties of a container, the caller adds
+   the optional ones and closes it */
 static void
 	didl_add_container (struct buffer_t *out, int id, int parent_id,
 	int child_count, char *restricted, char *searchable,
 	char *title, char *class)
 {
-	buffer_appendf (out, "<%s", DIDL_CONTAINER);
+	buffer_append (out, "<" DIDL_CONTAINER);
 
 	didl_add_value (out, DIDL_CONTAINER_ID, id);
 	didl_add_value (out, DIDL_CONTAINER_PARENT_ID, parent_id);
@@ -379,17 +618,408 @@ static void
 
 	didl_add_tag (out, DIDL_CONTAINER_CLASS, class);
 	didl_add_tag (out, DIDL_CONTAINER_TITLE, title);
+}
+
+/*
+ * DIDL-Lite of an entry, as listed by BrowseDirectChildren and Search.
+ * It is rendered once with every optional property, and cut down to what
+ * the Filter asks for whenever it is copied. The server address is left
+ * out of the URLs and only put back then, so it may change anytime.
+ */
+struct didl_fragment_t {
+	/* what it was rendered with */
+	ssize_t key; /* item size or container childCount */
+	time_t mtime;
+	int cover_id;
+	/* where its parts are */
+	size_t info; /* protocolInfo value, for Search */
+	size_t info_len;
+	size_t date; /* <dc:date>, up to art */
+	size_t art; /* <upnp:albumArtURI>, up to res */
+	size_t art_url; /* where the server address goes, 0 if there's no art */
+	size_t res; /* <res */
+	size_t res_size; /* size attribute */
+	size_t res_end; /* > */
+	size_t url; /* where the server address goes, 0 if there's no URL */
+	size_t end; /* closing tag */
+	size_t len;
+	char data[1];
+};
+
+/* Atomically replace *ptr by val if it still is old */
+#ifdef _MSC_VER
+#define cds_compare_and_swap(ptr, old, val) \
+	(InterlockedCompareExchangePointer ((PVOID volatile *) (ptr), (val), \
+	(old)) == (old))
+#else
+#define cds_compare_and_swap(ptr, old, val) \
+	__sync_bool_compare_and_swap ((ptr), (old), (val))
+#endif
+
+static struct didl_fragment_t *
+	didl_fragment_new (struct metadata_list_t *list,
+	struct upnp_entry_t *entry, ssize_t key)
+{
+	struct didl_fragment_t *f = NULL;
+	struct buffer_t *b;
+	size_t date, art, art_url = 0, res, res_size, res_end, url = 0, end;
+	size_t info = 0, info_len = 0;
+
+	b = buffer_new ();
+	if (!b)
+		return NULL;
+
+	if (entry->child_count >= 0) /* container */
+	{
+		didl_add_container (b, entry->id, entry->parent ?
+			entry->parent->id : -1, (int) key, "true", NULL,
+			entry->title, entry->mime_type->mime_class);
+		date = b->len;
+		didl_add_date (b, entry);
+		art = res = res_size = res_end = end = b->len;
+		buffer_append (b, "</" DIDL_CONTAINER ">");
+	}
+	else /* item */
+	{
+#ifdef HAVE_DLNA
+		extern struct ushare_t *ut;
+#endif /* HAVE_DLNA */
+
+		char *protocol =
+#ifdef HAVE_DLNA
+			entry->dlna_profile ?
+			dlna_write_protocol_info (DLNA_PROTOCOL_INFO_TYPE_HTTP,
+			DLNA_ORG_PLAY_SPEED_NORMAL,
+			DLNA_ORG_CONVERSION_NONE,
+			DLNA_ORG_OPERATION_RANGE,
+			ut->dlna_flags, entry->dlna_profile) :
+#endif /* HAVE_DLNA */
+			mime_get_protocol (entry->mime_type);
+
+		buffer_append (b, "<" DIDL_ITEM);
+		didl_add_value (b, DIDL_ITEM_ID, entry->id);
+		didl_add_value (b, DIDL_ITEM_PARENT_ID,
+			entry->parent ? entry->parent->id : -1);
+		didl_add_param (b, DIDL_ITEM_RESTRICTED, "true");
+		buffer_append (b, ">");
+
+		didl_add_tag (b, DIDL_ITEM_CLASS, upnp_entry_class (entry));
+		didl_add_tag (b, DIDL_ITEM_TITLE, entry->title);
+
+		date = b->len;
+		didl_add_date (b, entry);
+		art = b->len;
+		art_url = didl_add_album_art (b, list, entry, "");
+
+		res = b->len;
+		buffer_append (b, "<" DIDL_RES);
+		if (protocol)
+		{
+			/* just in between the quotes */
+			info = b->len + strlen (" " DIDL_RES_INFO "=\"");
+			info_len = strlen (protocol);
+		}
+		didl_add_param (b, DIDL_RES_INFO, protocol);
+		res_size = b->len;
+		didl_add_value (b, DIDL_RES_SIZE, key);
+		res_end = b->len;
+		buffer_append (b, ">");
+		if (entry->url)
+		{
+			url = b->len;
+			buffer_append (b, VIRTUAL_DIR "/");
+			buffer_append (b, entry->url);
+		}
+		buffer_append (b, "</" DIDL_RES ">");
+		end = b->len;
+		buffer_append (b, "</" DIDL_ITEM ">");
+
+		free (protocol);
+	}
+
+	if (b->buf)
+		f = (struct didl_fragment_t *)
+		malloc (sizeof (struct didl_fragment_t) + b->len);
+	if (f)
+	{
+		f->key = key;
+		f->mtime = entry->mtime;
+		f->cover_id = entry->cover_id;
+		f->info = info;
+		f->info_len = info_len;
+		f->date = date;
+		f->art = art;
+		f->art_url = art_url;
+		f->res = res;
+		f->res_size = res_size;
+		f->res_end = res_end;
+		f->url = url;
+		f->end = end;
+		f->len = b->len;
+		memcpy (f->data, b->buf, b->len + 1);
+	}
+	buffer_free (b);
+
+	return f;
+}
+
+static void
+	didl_add_fragment (struct buffer_t *out, const struct didl_fragment_t *f,
+	int filter, const char *server)
+{
+	struct buffer_chunk_t chunks[12];
+	int n = 0;
+
+#define DIDL_CHUNK(from, to) \
+	chunks[n].data = f->data + (from), chunks[n++].len = (to) - (from)
+#define DIDL_CHUNK_SERVER() \
+	chunks[n].data = server, chunks[n++].len = strlen (server)
+
+	DIDL_CHUNK (0, f->date);
+	if (filter & DIDL_FILTER_DATE)
+		DIDL_CHUNK (f->date, f->art);
+	if ((filter & DIDL_FILTER_ALBUM_ART) && f->art_url)
+	{
+		DIDL_CHUNK (f->art, f->art_url);
+		DIDL_CHUNK_SERVER ();
+		DIDL_CHUNK (f->art_url, f->res);
+	}
+	if (filter & DIDL_FILTER_RES)
+	{
+		DIDL_CHUNK (f->res, f->res_size);
+		if (filter & DIDL_FILTER_RES_SIZE)
+			DIDL_CHUNK (f->res_size, f->res_end);
+		if (f->url)
+		{
+			DIDL_CHUNK (f->res_end, f->url);
+			DIDL_CHUNK_SERVER ();
+			DIDL_CHUNK (f->url, f->end);
+		}
+		else
+			DIDL_CHUNK (f->res_end, f->end);
+	}
+	DIDL_CHUNK (f->end, f->len);
+
+#undef DIDL_CHUNK_SERVER
+#undef DIDL_CHUNK
+
+	buffer_appendv (out, chunks, n);
+}
+
+/*
+ * didl_get_fragment : return the fragment of entry, the cached one when
+ *  it's still up to date. *tmp is set if the caller has to free it.
+ */
+static struct didl_fragment_t *
+	didl_get_fragment (struct metadata_list_t *list,
+	struct upnp_entry_t *entry, struct didl_fragment_t **tmp)
+{
+	struct didl_fragment_t *f = entry->didl;
+	ssize_t key = (entry->child_count >= 0) ? entry->child_count : entry->size;
+
+	*tmp = NULL;
+	if (f && f->key == key && f->mtime == entry->mtime
+		&& f->cover_id == entry->cover_id)
+		return f;
+
+	f = didl_fragment_new (list, entry, key);
+	if (!f)
+		return NULL;
+
+	/* keep it for next time, unless another request was faster or an
+	outdated one is still there, until the rescan that changed it drops it */
+	if (!cds_compare_and_swap (&entry->didl, NULL, f))
+		*tmp = f;
+
+	return f;
+}
+
+/* Add entry to a BrowseDirectChildren or Search answer */
+static void
+	didl_add_entry (struct buffer_t *out, struct metadata_list_t *list,
+	struct upnp_entry_t *entry, int filter, const char *server)
+{
+	struct didl_fragment_t *f, *tmp;
+
+	f = didl_get_fragment (list, entry, &tmp);
+	if (!f)
+		return;
+
+	didl_add_fragment (out, f, filter, server);
+	if (tmp)
+		free (tmp);
+}
+
+static const struct {
+	const char *name;
+	int key;
+} cds_sort_keys[] = {
+	{ DIDL_ITEM_TITLE, CDS_SORT_TITLE },
+	{ DIDL_DATE, CDS_SORT_DATE },
+	{ DIDL_RES "@" DIDL_RES_SIZE, CDS_SORT_SIZE },
+	{ DIDL_ITEM_CLASS, CDS_SORT_CLASS },
+	{ NULL, 0 }
+};
+
+/* One child while being sorted, qsort () has no room for the criteria */
+struct cds_sort_item_t {
+	struct upnp_entry_t *entry;
+	int criteria;
+	int index;
+};
+
+/*
+ * cds_sort_parse : turn a SortCriteria string such as "+upnp:class,-dc:date"
+ *  into sort criteria. Properties that can't be sorted on are skipped.
+ */
+static int
+	cds_sort_parse (const char *sort_criteria)
+{
+	const char *s = sort_criteria;
+	int criteria = 0, nr_keys = 0;
+
+	while (s && *s && nr_keys < CDS_SORT_MAX_KEYS)
+	{
+		int key = 0, i;
+		size_t len;
+
+		while (*s == ' ' || *s == ',')
+			s++;
+		if (*s == '-')
+		{
+			key = CDS_SORT_DESCENDING;
+			s++;
+		}
+		else if (*s == '+')
+			s++;
+
+		len = strcspn (s, ", ");
+		for (i = 0; cds_sort_keys[i].name; i++)
+			if (strlen (cds_sort_keys[i].name) == len
+				&& !strncmp (s, cds_sort_keys[i].name, len))
+			{
+				criteria |= (key | cds_sort_keys[i].key)
+					<< (nr_keys++ * CDS_SORT_KEY_BITS);
+				break;
+			}
+		s += len;
+	}
 
-	buffer_appendf (out, "</%s>", DIDL_CONTAINER);
+	return criteria;
 }
 
 static int
-	cds_browse_metadata (struct action_event_t *event, struct buffer_t *out,
-	int index, int count, struct upnp_entry_t *entry,
-	char *filter)
+	cds_sort_compare (const void *pa, const void *pb)
+{
+	const struct cds_sort_item_t *a = (const struct cds_sort_item_t *) pa;
+	const struct cds_sort_item_t *b = (const struct cds_sort_item_t *) pb;
+	int criteria, res = 0;
+
+	for (criteria = a->criteria; criteria && !res;
+		criteria >>= CDS_SORT_KEY_BITS)
+	{
+		switch (criteria & CDS_SORT_KEY_MASK)
+		{
+		case CDS_SORT_TITLE:
+			res = strcasecmp (a->entry->title, b->entry->title);
+			break;
+		case CDS_SORT_DATE:
+			res = (a->entry->mtime > b->entry->mtime)
+				- (a->entry->mtime < b->entry->mtime);
+			break;
+		case CDS_SORT_SIZE:
+			res = (a->entry->size > b->entry->size)
+				- (a->entry->size < b->entry->size);
+			break;
+		case CDS_SORT_CLASS:
+			res = strcmp (upnp_entry_class (a->entry),
+				upnp_entry_class (b->entry));
+			break;
+		}
+		if (criteria & CDS_SORT_DESCENDING)
+			res = -res;
+	}
+
+	/* keep the file system order of equal entries */
+	return res ? res : a->index - b->index;
+}
+
+/*
+ * cds_sorted_childs : return the children of entry in the order given by
+ *  criteria, from the list sorted by a previous request when possible,
+ *  and their number in count, see upnp_entry_get_childs ().
+ *  *sort is set to a list the caller has to free if it couldn't be kept.
+ */
+static struct upnp_entry_t **
+	cds_sorted_childs (struct upnp_entry_t *entry, int criteria,
+	int *count, struct upnp_sort_t **sort)
 {
-	int result_count = 0, c = 0;
+	struct upnp_entry_t **childs;
+	struct upnp_sort_t *sorts, *s;
+	struct cds_sort_item_t *items;
+	int nr_cached = 0, i;
+
+	*sort = NULL;
+	childs = upnp_entry_get_childs (entry, count);
+	if (!criteria || *count < 2)
+		return childs;
+
+	sorts = entry->sorts;
+	for (s = sorts; s; s = s->next, nr_cached++)
+		if (s->criteria == criteria && s->childs == childs)
+		{
+			*count = s->count;
+			return s->sorted;
+		}
+
+	/* the list may end early while entry is being rescanned */
+	for (i = 0; i < *count && childs[i]; i++)
+		;
+	*count = i;
+
+	s = (struct upnp_sort_t *)
+		malloc (sizeof (struct upnp_sort_t)
+		+ i * sizeof (struct upnp_entry_t *));
+	items = (struct cds_sort_item_t *)
+		malloc (i * sizeof (struct cds_sort_item_t));
+	if (!s || !items)
+	{
+		if (s)
+			free (s);
+		if (items)
+			free (items);
+		return childs;
+	}
+
+	for (i = 0; i < *count; i++)
+	{
+		items[i].entry = childs[i];
+		items[i].criteria = criteria;
+		items[i].index = i;
+	}
+	qsort (items, *count, sizeof (struct cds_sort_item_t), cds_sort_compare);
+
+	s->criteria = criteria;
+	s->childs = childs;
+	s->count = *count;
+	for (i = 0; i < *count; i++)
+		s->sorted[i] = items[i].entry;
+	s->sorted[*count] = NULL;
+	free (items);
+
+	/* keep it along with the others, unless there are too many already */
+	s->next = sorts;
+	if (nr_cached >= CDS_SORT_MAX_CACHED
+		|| !cds_compare_and_swap (&entry->sorts, sorts, s))
+		*sort = s;
+
+	return s->sorted;
+}
 
+static int
+	cds_browse_metadata (struct buffer_t *out, struct metadata_list_t *list,
+	struct upnp_entry_t *entry, int filter, const char *server)
+{
 	if (!entry)
 		return -1;
 
@@ -413,24 +1043,15 @@ static int
 		didl_add_header (out);
 #ifdef HAVE_DLNA
 		entry->dlna_profile ?
-			didl_add_item (out, entry->id, entry->parent
-			? entry->parent->id : -1, "false",
+			didl_add_item (out, list, entry, "false",
 			dlna_profile_upnp_object_item (entry->dlna_profile),
-			entry->title,
-			protocol, entry->size,
-			entry->url, entry->cover_id, filter) :
+			protocol, filter, server) :
 #endif /* HAVE_DLNA */
-		didl_add_item (out, entry->id, entry->parent
-			? entry->parent->id : -1, "false",
-			entry->mime_type->mime_class, entry->title,
-			protocol, entry->size,
-			entry->url, entry->cover_id, filter);
+		didl_add_item (out, list, entry, "false",
+			entry->mime_type->mime_class, protocol, filter, server);
 
 		didl_add_footer (out);
 		free (protocol);
-
-		for (c = index; c < MIN (index + count, entry->child_count); c++)
-			result_count++;
 	}
 	else  /* container : directory */
 	{
@@ -439,135 +1060,306 @@ static int
 			? entry->parent->id : -1, entry->child_count,
 			"true", "true", entry->title,
 			entry->mime_type->mime_class);
+		if (filter & DIDL_FILTER_DATE)
+			didl_add_date (out, entry);
+		buffer_append (out, "</" DIDL_CONTAINER ">");
 		didl_add_footer (out);
-
-		result_count = 1;
-	}
-
-	{
-		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
-
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_RESULT, out->buf);
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_NUM_RETURNED, "1");
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_TOTAL_MATCH, "1");
-
-		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
 
-	return result_count;
+	return 1;
 }
 
 static int
-	cds_browse_directchildren (struct action_event_t *event,
-struct buffer_t *out, int index,
-	int count, struct upnp_entry_t *entry, char *filter)
+	cds_browse_directchildren (struct buffer_t *out,
+	struct metadata_list_t *list, int index, int count,
+	struct upnp_entry_t *entry, int filter, int sort_criteria,
+	const char *server, int *total)
 {
 	struct upnp_entry_t **childs;
-	int s, result_count = 0;
-	char tmp[32];
+	struct upnp_sort_t *sort;
+	int nr_childs, result_count = 0;
 
 	if (entry->child_count == -1) /* item : file */
 		return -1;
 
 	didl_add_header (out);
 
-	/* go to the child pointed out by index */
-	childs = entry->childs;
-	for (s = 0; s < index; s++)
-		if (*childs)
-			childs++;
+	/* go straight to the child pointed out by index */
+	childs = cds_sorted_childs (entry, sort_criteria, &nr_childs, &sort);
+	if (index < 0)
+		index = 0;
+	if (index > nr_childs)
+		index = nr_childs;
+	childs += index;
 
-	/* UPnP CDS compliance : If starting index = 0 and requested count = 0
+	/* UPnP CDS compliance : If requested count = 0
 	then all children must be returned */
-	if (index == 0 && count == 0)
-		count = entry->child_count;
-
-	for (; *childs; childs++)
-	{
-		if (count == 0 || result_count < count)
-			/* only fetch the requested count number or all entries if count = 0 */
-		{
-			if ((*childs)->child_count >= 0) /* container */
-				didl_add_container (out, (*childs)->id, (*childs)->parent ?
-				(*childs)->parent->id : -1,
-				(*childs)->child_count, "true", NULL,
-				(*childs)->title,
-				(*childs)->mime_type->mime_class);
-			else /* item */
-			{
-#ifdef HAVE_DLNA
-				extern struct ushare_t *ut;
-#endif /* HAVE_DLNA */
+	if (count == 0 || count > nr_childs - index)
+		count = nr_childs - index;
 
-				char *protocol =
-#ifdef HAVE_DLNA
-					(*childs)->dlna_profile ?
-					dlna_write_protocol_info (DLNA_PROTOCOL_INFO_TYPE_HTTP,
-					DLNA_ORG_PLAY_SPEED_NORMAL,
-					DLNA_ORG_CONVERSION_NONE,
-					DLNA_ORG_OPERATION_RANGE,
-					ut->dlna_flags, (*childs)->dlna_profile) :
-#endif /* HAVE_DLNA */
-					mime_get_protocol ((*childs)->mime_type);
+	for (; result_count < count && childs[result_count]; result_count++)
+		didl_add_entry (out, list, childs[result_count], filter,
+		server);
 
-#ifdef HAVE_DLNA
-				(*childs)->dlna_profile ?
-					didl_add_item (out, (*childs)->id,
-					(*childs)->parent ? (*childs)->parent->id : -1,
-					"true", dlna_profile_upnp_object_item ((*childs)->dlna_profile),
-					(*childs)->title, protocol,
-					(*childs)->size, (*childs)->url,
-					(*childs)->cover_id, filter) :
-#endif /* HAVE_DLNA */
-				didl_add_item (out, (*childs)->id,
-					(*childs)->parent ? (*childs)->parent->id : -1,
-					"true", (*childs)->mime_type->mime_class,
-					(*childs)->title, protocol,
-					(*childs)->size, (*childs)->url,
-					(*childs)->cover_id, filter);
-
-				free (protocol);
-			}
-			result_count++;
-		}
-	}
+	if (sort)
+		free (sort);
 
 	didl_add_footer (out);
+	*total = nr_childs;
 
-	{
-		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
+	return result_count;
+}
 
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_RESULT, out->buf);
-		sprintf (tmp, "%d", result_count);
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_NUM_RETURNED, tmp);
-		sprintf (tmp, "%d", entry->child_count);
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_TOTAL_MATCH, tmp);
+/* Add the DIDL-Lite result of a Browse or Search to its answer */
+static void
+	cds_add_result (struct action_event_t *event, const char *result,
+	int returned, int total)
+{
+	IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
+	char tmp[32];
 
-		UpnpActionRequest_set_ActionResult(event->request, actionResult);
-	}
+	upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_RESULT, result);
+	sprintf (tmp, "%d", returned);
+	upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_NUM_RETURNED, tmp);
+	sprintf (tmp, "%d", total);
+	upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_TOTAL_MATCH, tmp);
 
-	return result_count;
+	UpnpActionRequest_set_ActionResult(event->request, actionResult);
 }
 
-static bool
-	cds_browse (struct action_event_t *event)
-{
-	extern struct ushare_t *ut;
-	struct upnp_entry_t *entry = NULL;
-	int result_count = 0, index, count, id, sort_criteria;
-	char *flag = NULL;
-	char *filter = NULL;
-	struct buffer_t *out = NULL;
+/*
+ * Browse answers, for the renderers that ask the very same over and over
+ * while a menu is open. They are only good for the version of the media
+ * list they were built from: a rescan publishes a new generation, and
+ * the answers of the previous ones are never found again.
+ */
+#define CDS_BROWSE_CACHE_SIZE 32
+
+/* larger ones are cheap to build again compared to sending them */
+#define CDS_BROWSE_CACHE_MAX_RESULT (256 * 1024)
+
+struct cds_browse_answer_t {
+	/* what was asked */
+	unsigned int generation;
+	int id;
 	bool metadata;
+	int index;
+	int count;
+	int sort_criteria;
+	int filter;
+	char *server;
+	/* and the answer */
+	char *result;
+	size_t len;
+	int returned;
+	int total;
+	unsigned int update_id;
+	int refcount;
+	bool cached;
+	unsigned int last_used;
+};
 
-	if (!event)
-		return false;
+static struct cds_browse_answer_t *cds_browse_cache[CDS_BROWSE_CACHE_SIZE];
+static unsigned int cds_browse_cache_clock;
+static unsigned long cds_browse_cache_hits, cds_browse_cache_misses;
+static pthread_mutex_t cds_browse_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	/* Check for status */
-	if (!event->status)
-		return false;
+static void
+	cds_browse_answer_free (struct cds_browse_answer_t *answer)
+{
+	if (answer->server)
+		free (answer->server);
+	if (answer->result)
+		free (answer->result);
+	free (answer);
+}
 
-	/* check if metadatas have been well inited */
+static bool
+	cds_browse_answer_match (const struct cds_browse_answer_t *a,
+	const struct cds_browse_answer_t *b)
+{
+	return a->generation == b->generation && a->id == b->id
+		&& a->metadata == b->metadata && a->index == b->index
+		&& a->count == b->count && a->sort_criteria == b->sort_criteria
+		&& a->filter == b->filter && !strcmp (a->server, b->server);
+}
+
+/* Cached answer to the request described by key, see cds_browse_cache_put () */
+static struct cds_browse_answer_t *
+	cds_browse_cache_get (const struct cds_browse_answer_t *key)
+{
+	struct cds_browse_answer_t *answer = NULL;
+	int i;
+
+	pthread_mutex_lock (&cds_browse_cache_lock);
+	for (i = 0; i < CDS_BROWSE_CACHE_SIZE; i++)
+		if (cds_browse_cache[i]
+			&& cds_browse_answer_match (cds_browse_cache[i], key))
+		{
+			answer = cds_browse_cache[i];
+			answer->refcount++;
+			answer->last_used = ++cds_browse_cache_clock;
+			break;
+		}
+	if (answer)
+		cds_browse_cache_hits++;
+	else
+		cds_browse_cache_misses++;
+	pthread_mutex_unlock (&cds_browse_cache_lock);
+
+	return answer;
+}
+
+static void
+	cds_browse_cache_put (struct cds_browse_answer_t *answer)
+{
+	bool drop;
+
+	if (!answer)
+		return;
+
+	pthread_mutex_lock (&cds_browse_cache_lock);
+	drop = (--answer->refcount == 0 && !answer->cached);
+	pthread_mutex_unlock (&cds_browse_cache_lock);
+
+	if (drop)
+		cds_browse_answer_free (answer);
+}
+
+/* Keep the answer to key, result is taken over */
+static void
+	cds_browse_cache_add (const struct cds_browse_answer_t *key,
+	char *result, size_t len, int returned, int total, unsigned int update_id)
+{
+	struct cds_browse_answer_t *answer, *old;
+	int i, slot = 0;
+
+	if (len > CDS_BROWSE_CACHE_MAX_RESULT)
+	{
+		free (result);
+		return;
+	}
+
+	answer = (struct cds_browse_answer_t *)
+		malloc (sizeof (struct cds_browse_answer_t));
+	if (!answer)
+	{
+		free (result);
+		return;
+	}
+	*answer = *key;
+	answer->server = strdup (key->server);
+	answer->result = result;
+	answer->len = len;
+	answer->returned = returned;
+	answer->total = total;
+	answer->update_id = update_id;
+	answer->refcount = 0;
+	answer->cached = true;
+	if (!answer->server)
+	{
+		cds_browse_answer_free (answer);
+		return;
+	}
+
+	pthread_mutex_lock (&cds_browse_cache_lock);
+
+	/* an empty slot, or an answer of an older generation, or the LRU one */
+	for (i = 0; i < CDS_BROWSE_CACHE_SIZE; i++)
+	{
+		old = cds_browse_cache[i];
+		if (!old || old->generation != key->generation)
+		{
+			slot = i;
+			break;
+		}
+		if (cds_browse_answer_match (old, key))
+		{
+			/* another request was faster */
+			pthread_mutex_unlock (&cds_browse_cache_lock);
+			cds_browse_answer_free (answer);
+			return;
+		}
+		if (old->last_used < cds_browse_cache[slot]->last_used)
+			slot = i;
+	}
+
+	old = cds_browse_cache[slot];
+	if (old)
+	{
+		old->cached = false;
+		if (old->refcount)
+			old = NULL; /* its last reader frees it */
+	}
+	answer->last_used = ++cds_browse_cache_clock;
+	cds_browse_cache[slot] = answer;
+
+	pthread_mutex_unlock (&cds_browse_cache_lock);
+
+	if (old)
+		cds_browse_answer_free (old);
+}
+
+/* Browse cache statistics, for the telnet interface */
+void
+	cds_browse_cache_stats (unsigned long *hits, unsigned long *misses,
+	int *answers, size_t *size)
+{
+	int i;
+
+	pthread_mutex_lock (&cds_browse_cache_lock);
+	*hits = cds_browse_cache_hits;
+	*misses = cds_browse_cache_misses;
+	*answers = 0;
+	*size = 0;
+	for (i = 0; i < CDS_BROWSE_CACHE_SIZE; i++)
+		if (cds_browse_cache[i])
+		{
+			(*answers)++;
+			*size += cds_browse_cache[i]->len;
+		}
+	pthread_mutex_unlock (&cds_browse_cache_lock);
+}
+
+void
+	cds_browse_cache_free (void)
+{
+	int i;
+
+	pthread_mutex_lock (&cds_browse_cache_lock);
+	for (i = 0; i < CDS_BROWSE_CACHE_SIZE; i++)
+		if (cds_browse_cache[i])
+		{
+			cds_browse_answer_free (cds_browse_cache[i]);
+			cds_browse_cache[i] = NULL;
+		}
+	pthread_mutex_unlock (&cds_browse_cache_lock);
+}
+
+static bool
+	cds_browse (struct action_event_t *event)
+{
+	extern struct ushare_t *ut;
+	struct upnp_entry_t *entry = NULL;
+	int result_count = 0, index, count, id, sort_criteria, filter;
+	char *flag = NULL;
+	char *filter_string = NULL;
+	char *sort = NULL;
+	struct buffer_t *out = NULL;
+	struct metadata_list_t *list = NULL;
+	struct cds_browse_answer_t key, *answer;
+	char server[64], update_id[32];
+	bool metadata;
+	int total = 1;
+
+	if (!event)
+		return false;
+
+	/* Check for status */
+	if (!event->status)
+		return false;
+
+	/* check if metadatas have been well inited */
 	if (!ut->init)
 		return false;
 
@@ -576,11 +1368,22 @@ static bool
 	count = upnp_get_ui4 (event->request, SERVICE_CDS_ARG_REQUEST_COUNT);
 	id = upnp_get_ui4 (event->request, SERVICE_CDS_ARG_OBJECT_ID);
 	flag = upnp_get_string (event->request, SERVICE_CDS_ARG_BROWSE_FLAG);
-	filter = upnp_get_string (event->request, SERVICE_CDS_ARG_FILTER);
-	sort_criteria = upnp_get_ui4 (event->request, SERVICE_CDS_ARG_SORT_CRIT);
-
-	if (!flag || !filter)
+	filter_string = upnp_get_string (event->request, SERVICE_CDS_ARG_FILTER);
+	filter = didl_filter_parse (filter_string);
+	sort = upnp_get_string (event->request, SERVICE_CDS_ARG_SORT_CRIT);
+	sort_criteria = cds_sort_parse (sort);
+	if (sort)
+		free (sort);
+
+	if (!flag || !filter_string)
+	{
+		if (flag)
+			free (flag);
+		if (filter_string)
+			free (filter_string);
 		return false;
+	}
+	free (filter_string);
 
 	/* Check arguments validity */
 	if (!strcmp (flag, SERVICE_CDS_BROWSE_METADATA))
@@ -601,44 +1404,76 @@ static bool
 	}
 	free (flag);
 
-	entry = upnp_get_entry (ut, id);
+	/* keep the entries alive until the answer is built */
+	list = metadata_list_get (ut);
+
+	didl_server_address (server, sizeof (server));
+	key.generation = list ? list->generation : 0;
+	key.id = id;
+	key.metadata = metadata;
+	key.index = index;
+	key.count = count;
+	key.sort_criteria = metadata ? 0 : sort_criteria;
+	key.filter = filter;
+	key.server = server;
+
+	answer = cds_browse_cache_get (&key);
+	if (answer)
+	{
+		metadata_list_put (ut, list);
+		cds_add_result (event, answer->result, answer->returned, answer->total);
+		sprintf (update_id, "%u", answer->update_id);
+		cds_browse_cache_put (answer);
+		goto update_id;
+	}
+
+	entry = upnp_get_entry (list, id);
 	if (!entry && (id < ut->starting_id))
-		entry = upnp_get_entry (ut, ut->starting_id);
+		entry = upnp_get_entry (list, ut->starting_id);
 
 	if (!entry)
 	{
-		free (filter);
+		metadata_list_put (ut, list);
 		return false;
 	}
 
 	out = buffer_new ();
 	if (!out)
 	{
-		free (filter);
+		metadata_list_put (ut, list);
 		return false;
 	}
 
 	if (metadata)
-		result_count =
-		cds_browse_metadata (event, out, index, count, entry, filter);
+		result_count = cds_browse_metadata (out, list, entry, filter,
+		server);
 	else
-		result_count =
-		cds_browse_directchildren (event, out, index, count, entry, filter);
-	free (filter);
+		result_count = cds_browse_directchildren (out, list, index, count,
+		entry, filter, sort_criteria, server, &total);
+	key.update_id = cds_update_id (list, entry);
+	metadata_list_put (ut, list);
 
-	if (result_count < 0)
+	if (result_count < 0 || !out->buf)
 	{
 		buffer_free (out);
 		return false;
 	}
 
+	cds_add_result (event, out->buf, result_count, total);
+	sprintf (update_id, "%u", key.update_id);
+
+	/* the buffer is handed over to the cache */
+	cds_browse_cache_add (&key, out->buf, out->len, result_count, total,
+		key.update_id);
+	out->buf = NULL;
 	buffer_free (out);
 
+update_id:
 	{
 		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
 
 		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_UPDATE_ID,
-			SERVICE_CDS_ROOT_OBJECT_ID);
+			update_id);
 
 		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
@@ -646,242 +1481,852 @@ static bool
 	return event->status;
 }
 
+/* SearchCriteria, compiled once per Search request */
+enum search_op_t {
+	SEARCH_ALL,
+	SEARCH_AND,
+	SEARCH_OR,
+	SEARCH_NOT,
+	SEARCH_EQ,
+	SEARCH_NE,
+	SEARCH_LT,
+	SEARCH_LE,
+	SEARCH_GT,
+	SEARCH_GE,
+	SEARCH_CONTAINS,
+	SEARCH_NOT_CONTAINS,
+	SEARCH_DERIVED_FROM,
+	SEARCH_EXISTS
+};
+
+enum search_property_t {
+	SEARCH_PROP_UNKNOWN,
+	SEARCH_PROP_CLASS,
+	SEARCH_PROP_TITLE,
+	SEARCH_PROP_DATE,
+	SEARCH_PROP_ID,
+	SEARCH_PROP_PARENT_ID,
+	SEARCH_PROP_RES,
+	SEARCH_PROP_PROTOCOL,
+	SEARCH_PROP_SIZE
+};
+
+struct search_expr_t {
+	enum search_op_t op;
+	enum search_property_t property;
+	char *value; /* XML escaped, as the strings of the entries */
+	size_t len;
+	long long number; /* value, for numeric properties */
+	bool exists;
+	struct search_expr_t *left, *right;
+};
+
+static const struct {
+	const char *name;
+	enum search_property_t property;
+} search_properties[] = {
+	{ DIDL_ITEM_CLASS, SEARCH_PROP_CLASS },
+	{ DIDL_ITEM_TITLE, SEARCH_PROP_TITLE },
+	{ DIDL_DATE, SEARCH_PROP_DATE },
+	{ "@" DIDL_ITEM_ID, SEARCH_PROP_ID },
+	{ "@" DIDL_ITEM_PARENT_ID, SEARCH_PROP_PARENT_ID },
+	{ DIDL_RES, SEARCH_PROP_RES },
+	{ DIDL_RES "@" DIDL_RES_INFO, SEARCH_PROP_PROTOCOL },
+	{ DIDL_RES "@" DIDL_RES_SIZE, SEARCH_PROP_SIZE },
+	{ NULL, SEARCH_PROP_UNKNOWN }
+};
+
+static void
+	search_free (struct search_expr_t *e)
+{
+	if (!e)
+		return;
+
+	search_free (e->left);
+	search_free (e->right);
+	if (e->value)
+		free (e->value);
+	free (e);
+}
+
+/* New logical node, takes care of its arguments if it can't be made */
+static struct search_expr_t *
+	search_node (enum search_op_t op, struct search_expr_t *left,
+	struct search_expr_t *right)
+{
+	struct search_expr_t *e = NULL;
+
+	if (op == SEARCH_ALL || (left && (right || op == SEARCH_NOT)))
+		e = (struct search_expr_t *) calloc (1, sizeof (struct search_expr_t));
+	if (!e)
+	{
+		search_free (left);
+		search_free (right);
+		return NULL;
+	}
+
+	e->op = op;
+	e->left = left;
+	e->right = right;
+
+	return e;
+}
+
+static void
+	search_skip_spaces (const char **s)
+{
+	while (**s == ' ' || **s == '\t' || **s == '\r' || **s == '\n')
+		(*s)++;
+}
+
+/* Skip keyword (lower case) if it comes next, whatever its case */
 static bool
-	matches_search (char *search_criteria, struct upnp_entry_t *entry)
+	search_keyword (const char **s, const char *keyword)
 {
-	char keyword[256] = SEARCH_OBJECT_KEYWORD;
-	bool derived_from = false, protocol_contains = false, result = false;
-	char *quote_closed = NULL, *and_clause = NULL;
-#ifdef HAVE_DLNA
-	extern struct ushare_t *ut;
-#endif /* HAVE_DLNA */
-	char *protocol =
-#ifdef HAVE_DLNA
-		entry->dlna_profile ?
-		dlna_write_protocol_info (DLNA_PROTOCOL_INFO_TYPE_HTTP,
-		DLNA_ORG_PLAY_SPEED_NORMAL,
-		DLNA_ORG_CONVERSION_NONE,
-		DLNA_ORG_OPERATION_RANGE,
-		ut->dlna_flags, entry->dlna_profile) :
-#endif /* HAVE_DLNA */
-	mime_get_protocol (entry->mime_type);
+	const char *p = *s;
+
+	for (; *keyword; keyword++, p++)
+		if (tolower ((unsigned char) *p) != *keyword)
+			return false;
+	if (isalnum ((unsigned char) *p))
+		return false;
+
+	*s = p;
+	return true;
+}
+
+/* Parse a double quoted string, with \" and \\ escapes */
+static bool
+	search_parse_value (const char **s, struct search_expr_t *e)
+{
+	const char *p = *s;
+	char *value, *v, *xml;
+
+	if (*p++ != '"')
+		return false;
+
+	value = v = (char *) malloc (strlen (p) + 1);
+	if (!value)
+		return false;
 
-	if (!strncmp (search_criteria, SEARCH_CLASS_MATCH_KEYWORD,
-		strlen (SEARCH_CLASS_MATCH_KEYWORD)))
+	for (; *p && *p != '"'; p++)
 	{
-		strncpy (keyword, search_criteria
-			+ strlen (SEARCH_CLASS_MATCH_KEYWORD), sizeof (keyword));
-		quote_closed = strchr (keyword, '"');
+		if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+			p++;
+		*v++ = *p;
+	}
+	*v = '\0';
 
-		if (quote_closed)
-			*quote_closed = '\0';
+	if (*p != '"')
+	{
+		free (value);
+		return false;
 	}
-	else if (!strncmp (search_criteria, SEARCH_CLASS_DERIVED_KEYWORD,
-		strlen (SEARCH_CLASS_DERIVED_KEYWORD)))
+	*s = p + 1;
+
+	xml = convert_xml (value);
+	if (xml)
 	{
-		derived_from = true;
-		strncpy (keyword, search_criteria
-			+ strlen (SEARCH_CLASS_DERIVED_KEYWORD), sizeof (keyword));
-		quote_closed = strchr (keyword, '"');
+		free (value);
+		value = xml;
+	}
+
+	e->value = value;
+	e->len = strlen (value);
+	e->number = strtoll (value, NULL, 10);
+
+	return true;
+}
 
-		if (quote_closed)
-			*quote_closed = '\0';
+/* property binOp "value" | property exists true|false */
+static struct search_expr_t *
+	search_parse_relation (const char **s)
+{
+	struct search_expr_t *e;
+	size_t len;
+	int i;
+
+	len = strcspn (*s, " \t\r\n()=!<>\"");
+	if (!len)
+		return NULL;
+
+	e = (struct search_expr_t *) calloc (1, sizeof (struct search_expr_t));
+	if (!e)
+		return NULL;
+
+	/* unknown properties are simply never found */
+	for (i = 0; search_properties[i].name; i++)
+		if (strlen (search_properties[i].name) == len
+			&& !strncmp (*s, search_properties[i].name, len))
+			e->property = search_properties[i].property;
+	*s += len;
+	search_skip_spaces (s);
+
+	if (!strncmp (*s, "!=", 2))
+		e->op = SEARCH_NE, *s += 2;
+	else if (!strncmp (*s, "<=", 2))
+		e->op = SEARCH_LE, *s += 2;
+	else if (!strncmp (*s, ">=", 2))
+		e->op = SEARCH_GE, *s += 2;
+	else if (**s == '<')
+		e->op = SEARCH_LT, (*s)++;
+	else if (**s == '>')
+		e->op = SEARCH_GT, (*s)++;
+	else if (**s == '=')
+		e->op = SEARCH_EQ, (*s)++;
+	else if (search_keyword (s, "contains"))
+		e->op = SEARCH_CONTAINS;
+	else if (search_keyword (s, "doesnotcontain"))
+		e->op = SEARCH_NOT_CONTAINS;
+	else if (search_keyword (s, "derivedfrom"))
+		e->op = SEARCH_DERIVED_FROM;
+	else if (search_keyword (s, "exists"))
+		e->op = SEARCH_EXISTS;
+	else
+	{
+		free (e);
+		return NULL;
 	}
-	else if (!strncmp (search_criteria, SEARCH_PROTOCOL_CONTAINS_KEYWORD,
-		strlen (SEARCH_PROTOCOL_CONTAINS_KEYWORD)))
+	search_skip_spaces (s);
+
+	if (e->op == SEARCH_EXISTS)
 	{
-		protocol_contains = true;
-		strncpy (keyword, search_criteria
-			+ strlen (SEARCH_PROTOCOL_CONTAINS_KEYWORD), sizeof (keyword));
-		quote_closed = strchr (keyword, '"');
+		if (search_keyword (s, "true"))
+			e->exists = true;
+		else if (!search_keyword (s, "false"))
+		{
+			free (e);
+			return NULL;
+		}
+		return e;
+	}
 
-		if (quote_closed)
-			*quote_closed = '\0';
+	if (!search_parse_value (s, e))
+	{
+		free (e);
+		return NULL;
 	}
 
-	if (derived_from && entry->mime_type
-		&& !strncmp (entry->mime_type->mime_class, keyword, strlen (keyword)))
-		result = true;
-	else if (protocol_contains && strstr (protocol, keyword))
-		result = true;
-	else if (entry->mime_type &&
-		!strcmp (entry->mime_type->mime_class, keyword))
-		result = true;
-	free (protocol);
+	return e;
+}
 
-	and_clause = strstr (search_criteria, SEARCH_AND);
-	if (and_clause)
-		return (result &&
-		matches_search (and_clause + strlen (SEARCH_AND) -1, entry));
+static struct search_expr_t *search_parse_or (const char **s);
 
-	return true;
+/* ( expression ) | not expression | relation */
+static struct search_expr_t *
+	search_parse_unary (const char **s)
+{
+	struct search_expr_t *e;
+
+	search_skip_spaces (s);
+
+	if (**s == '(')
+	{
+		(*s)++;
+		e = search_parse_or (s);
+		search_skip_spaces (s);
+		if (e && **s == ')')
+		{
+			(*s)++;
+			return e;
+		}
+		search_free (e);
+		return NULL;
+	}
+
+	if (search_keyword (s, "not"))
+		return search_node (SEARCH_NOT, search_parse_unary (s), NULL);
+
+	return search_parse_relation (s);
 }
 
+/* "and" binds tighter than "or" */
+static struct search_expr_t *
+	search_parse_and (const char **s)
+{
+	struct search_expr_t *e = search_parse_unary (s);
+
+	while (e)
+	{
+		search_skip_spaces (s);
+		if (!search_keyword (s, "and"))
+			break;
+		e = search_node (SEARCH_AND, e, search_parse_unary (s));
+	}
+
+	return e;
+}
+
+static struct search_expr_t *
+	search_parse_or (const char **s)
+{
+	struct search_expr_t *e = search_parse_and (s);
+
+	while (e)
+	{
+		search_skip_spaces (s);
+		if (!search_keyword (s, "or"))
+			break;
+		e = search_node (SEARCH_OR, e, search_parse_and (s));
+	}
+
+	return e;
+}
+
+/*
+ * search_compile : parse a SearchCriteria string, following the grammar
+ *  of the UPnP ContentDirectory specification (plus "not").
+ *  Returns NULL if it's invalid.
+ */
+static struct search_expr_t *
+	search_compile (const char *criteria)
+{
+	struct search_expr_t *e;
+	const char *s = criteria;
+
+	search_skip_spaces (&s);
+	if (*s == '*' || *s == '\0')
+	{
+		if (*s)
+			s++;
+		e = search_node (SEARCH_ALL, NULL, NULL);
+	}
+	else
+		e = search_parse_or (&s);
+
+	search_skip_spaces (&s);
+	if (e && *s)
+	{
+		search_free (e);
+		return NULL;
+	}
+
+	return e;
+}
+
+/* Case insensitive comparison of strings of known lengths */
 static int
-	cds_search_directchildren_recursive (struct buffer_t *out, int count,
-struct upnp_entry_t *entry, char *filter,
-	char *search_criteria)
+	search_compare (const char *a, size_t alen, const char *b, size_t blen)
 {
-	struct upnp_entry_t **childs;
-	int result_count = 0;
+	size_t i;
 
-	if (entry->child_count == -1) /* item : file */
-		return -1;
+	for (i = 0; i < alen && i < blen; i++)
+	{
+		int d = tolower ((unsigned char) a[i]) - tolower ((unsigned char) b[i]);
+		if (d)
+			return d;
+	}
 
-	/* go to the first child */
-	childs = entry->childs;
+	return (alen > blen) - (alen < blen);
+}
+
+static bool
+	search_contains (const char *s, size_t len, const char *sub, size_t sublen)
+{
+	size_t i;
+
+	for (i = 0; i + sublen <= len; i++)
+		if (!search_compare (s + i, sublen, sub, sublen))
+			return true;
+
+	return false;
+}
+
+/* Test a value of the property of relation e */
+static bool
+	search_test (const struct search_expr_t *e, const char *value, size_t len,
+	bool numeric, long long number)
+{
+	char buf[32];
+	int cmp;
+
+	if (e->op == SEARCH_EXISTS)
+		return ((value || numeric) == e->exists);
+	if (!value && !numeric)
+		return false;
 
-	for (; *childs; childs++)
+	if (numeric && e->op < SEARCH_CONTAINS)
+		cmp = (number > e->number) - (number < e->number);
+	else
 	{
-		if (count == 0 || result_count < count)
-			/* only fetch the requested count number or all entries if count = 0 */
+		if (numeric)
 		{
-			if ((*childs)->child_count >= 0) /* container */
-			{
-				int new_count;
-				new_count = cds_search_directchildren_recursive
-					(out, (count == 0) ? 0 : (count - result_count),
-					(*childs), filter, search_criteria);
-				result_count += new_count;
-			}
-			else /* item */
-			{
-				if (matches_search (search_criteria, *childs))
-				{
-#ifdef HAVE_DLNA
-					extern struct ushare_t *ut;
-#endif /* HAVE_DLNA */
-					char *protocol =
-#ifdef HAVE_DLNA
-						(*childs)->dlna_profile ?
-						dlna_write_protocol_info(DLNA_PROTOCOL_INFO_TYPE_HTTP,
-						DLNA_ORG_PLAY_SPEED_NORMAL,
-						DLNA_ORG_CONVERSION_NONE,
-						DLNA_ORG_OPERATION_RANGE,
-						ut->dlna_flags, (*childs)->dlna_profile):
-#endif /* HAVE_DLNA */
-						mime_get_protocol ((*childs)->mime_type);
+			len = snprintf (buf, sizeof (buf), "%lld", number);
+			value = buf;
+		}
+		cmp = search_compare (value, len, e->value, e->len);
+	}
 
-#ifdef HAVE_DLNA
-					(*childs)->dlna_profile ?
-						didl_add_item (out, (*childs)->id,
-						(*childs)->parent ? (*childs)->parent->id : -1,
-						"true", dlna_profile_upnp_object_item ((*childs)->dlna_profile),
-						(*childs)->title, protocol,
-						(*childs)->size, (*childs)->url,
-						(*childs)->cover_id, filter) :
-#endif /* HAVE_DLNA */
-					didl_add_item (out, (*childs)->id,
-						(*childs)->parent ? (*childs)->parent->id : -1,
-						"true", (*childs)->mime_type->mime_class,
-						(*childs)->title, protocol,
-						(*childs)->size, (*childs)->url,
-						(*childs)->cover_id, filter);
-					free (protocol);
-					result_count++;
-				}
+	switch (e->op)
+	{
+	case SEARCH_EQ:
+		return (cmp == 0);
+	case SEARCH_NE:
+		return (cmp != 0);
+	case SEARCH_LT:
+		return (cmp < 0);
+	case SEARCH_LE:
+		return (cmp <= 0);
+	case SEARCH_GT:
+		return (cmp > 0);
+	case SEARCH_GE:
+		return (cmp >= 0);
+	case SEARCH_CONTAINS:
+		return search_contains (value, len, e->value, e->len);
+	case SEARCH_NOT_CONTAINS:
+		return !search_contains (value, len, e->value, e->len);
+	case SEARCH_DERIVED_FROM:
+		/* the class itself, or one below it */
+		return len >= e->len
+			&& !search_compare (value, e->len, e->value, e->len)
+			&& (len == e->len || value[e->len] == '.');
+	default:
+		return false;
+	}
+}
+
+/*
+ * search_match : evaluate e against entry. Nothing gets allocated, but
+ *  for the DIDL-Lite fragment the protocolInfo is read from, which is
+ *  kept for the next requests.
+ */
+static bool
+	search_match (const struct search_expr_t *e, struct metadata_list_t *list,
+	struct upnp_entry_t *entry)
+{
+	struct didl_fragment_t *f, *tmp = NULL;
+	const char *value = NULL;
+	char buf[32];
+	size_t len = 0;
+	long long number = 0;
+	bool numeric = false, res;
+
+	switch (e->op)
+	{
+	case SEARCH_ALL:
+		return true;
+	case SEARCH_AND:
+		return search_match (e->left, list, entry)
+			&& search_match (e->right, list, entry);
+	case SEARCH_OR:
+		return search_match (e->left, list, entry)
+			|| search_match (e->right, list, entry);
+	case SEARCH_NOT:
+		return !search_match (e->left, list, entry);
+	default:
+		break;
+	}
+
+	switch (e->property)
+	{
+	case SEARCH_PROP_CLASS:
+		value = upnp_entry_class (entry);
+		break;
+	case SEARCH_PROP_TITLE:
+		value = entry->title;
+		break;
+	case SEARCH_PROP_DATE:
+		if (entry->mtime && (len = cds_entry_date (entry, buf, sizeof (buf))))
+			value = buf;
+		break;
+	case SEARCH_PROP_ID:
+		numeric = true;
+		number = entry->id;
+		break;
+	case SEARCH_PROP_PARENT_ID:
+		numeric = true;
+		number = entry->parent ? entry->parent->id : -1;
+		break;
+	case SEARCH_PROP_RES:
+		if (entry->child_count < 0)
+			value = entry->url;
+		break;
+	case SEARCH_PROP_PROTOCOL:
+		if (entry->child_count < 0
+			&& (f = didl_get_fragment (list, entry, &tmp))
+			&& f->info_len)
+		{
+			value = f->data + f->info;
+			len = f->info_len;
+		}
+		break;
+	case SEARCH_PROP_SIZE:
+		if (entry->child_count < 0)
+		{
+			numeric = true;
+			number = entry->size;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (value && !len)
+		len = strlen (value);
+	res = search_test (e, value, len, numeric, number);
+
+	if (tmp)
+		free (tmp);
+
+	return res;
+}
+
+/*
+ * search_candidates : narrow the entries that may match e down using the
+ *  search index, the result still has to be checked with search_match ().
+ *  Returns false if the index is of no help for e.
+ */
+static bool
+	search_candidates (const struct search_expr_t *e,
+	const struct search_index_t *index, struct search_set_t *set)
+{
+	struct search_set_t other;
+	int i;
+
+	switch (e->op)
+	{
+	case SEARCH_AND:
+		if (!search_candidates (e->left, index, set))
+			return search_candidates (e->right, index, set);
+		if (search_candidates (e->right, index, &other))
+			search_set_and (set, &other);
+		return true;
+	case SEARCH_OR:
+		if (!search_candidates (e->left, index, set))
+			return false;
+		if (!search_candidates (e->right, index, &other))
+		{
+			search_set_free (set);
+			return false;
+		}
+		return search_set_or (set, &other);
+	case SEARCH_EQ:
+	case SEARCH_DERIVED_FROM:
+		if (e->property == SEARCH_PROP_CLASS)
+			break;
+		/* fall through */
+	case SEARCH_CONTAINS:
+		if (e->property == SEARCH_PROP_TITLE)
+			return search_index_title (index, e->value, e->len, set);
+		return false;
+	default:
+		return false;
+	}
+
+	/* every class that matches, there are only a few of them */
+	set->ranks = NULL;
+	set->count = 0;
+	set->owned = false;
+	for (i = 0; i < search_index_nr_classes (index); i++)
+	{
+		const char *class = search_index_class (index, i, &other);
+
+		if (search_test (e, class, strlen (class), false, 0)
+			&& !search_set_or (set, &other))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * cds_search_sort_ranks : put the matches ranks in the order given by
+ *  criteria, equal entries staying in tree order.
+ *  Returns false if memory is short.
+ */
+static bool
+	cds_search_sort_ranks (const struct search_index_t *index, int *ranks,
+	int count, int criteria)
+{
+	struct cds_sort_item_t *items;
+	int i;
+
+	if (!criteria || count < 2)
+		return true;
+
+	items = (struct cds_sort_item_t *)
+		malloc (count * sizeof (struct cds_sort_item_t));
+	if (!items)
+		return false;
+
+	for (i = 0; i < count; i++)
+	{
+		items[i].entry = search_index_entry (index, ranks[i]);
+		items[i].criteria = criteria;
+		items[i].index = ranks[i];
+	}
+	qsort (items, count, sizeof (struct cds_sort_item_t), cds_sort_compare);
+
+	for (i = 0; i < count; i++)
+		ranks[i] = items[i].index;
+	free (items);
+
+	return true;
+}
+
+/*
+ * cds_search_matches : every entry below container first..end that
+ *  matches search, taken from the candidates of the index if it can tell,
+ *  in the order given by sort_criteria
+ */
+static struct search_matches_t *
+	cds_search_matches (struct metadata_list_t *list,
+	struct search_index_t *index, int first, int end,
+	const struct search_expr_t *search, const char *criteria, int id,
+	int sort_criteria)
+{
+	struct search_set_t set;
+	int *ranks = NULL, size = 0, count = 0, i, rank;
+	bool candidates;
+
+	candidates = search_candidates (search, index, &set);
+
+	for (i = candidates ? search_set_find (&set, first + 1) : first + 1;
+		candidates ? (i < set.count && set.ranks[i] < end) : (i < end); i++)
+	{
+		struct upnp_entry_t *e;
+
+		rank = candidates ? set.ranks[i] : i;
+		e = search_index_entry (index, rank);
+		if (!e || !search_match (search, list, e))
+			continue;
+
+		if (count == size)
+		{
+			int *r;
+
+			size = size ? 2 * size : 64;
+			r = (int *) realloc (ranks, size * sizeof (int));
+			if (!r)
+			{
+				if (ranks)
+					free (ranks);
+				if (candidates)
+					search_set_free (&set);
+				return NULL;
 			}
+			ranks = r;
 		}
+		ranks[count++] = rank;
 	}
 
-	return result_count;
+	if (candidates)
+		search_set_free (&set);
+
+	if (!cds_search_sort_ranks (index, ranks, count, sort_criteria))
+	{
+		if (ranks)
+			free (ranks);
+		return NULL;
+	}
+
+	return search_index_store (index, criteria, id, sort_criteria,
+		ranks, count);
 }
 
+/*
+ * cds_search_indexed : add the matches below entry in the order given by
+ *  sort_criteria, starting with the index-th one, up to count of them
+ *  (all of them if count is 0).
+ *  Pages after the first one come from the cache of the index.
+ *  Returns the number of entries added, -1 if the index can't tell.
+ */
 static int
-	cds_search_directchildren (struct action_event_t *event,
-struct buffer_t *out, int index,
-	int count, struct upnp_entry_t *entry,
-	char *filter, char *search_criteria)
+	cds_search_indexed (struct buffer_t *out, int index, int count,
+struct upnp_entry_t *entry, int filter_class, const char *server,
+	const struct search_expr_t *search, const char *criteria,
+	int sort_criteria, struct metadata_list_t *list, int *total)
 {
-	struct upnp_entry_t **childs;
-	int s, result_count = 0;
-	char tmp[32];
+	struct search_index_t *search_index;
+	struct search_matches_t *matches;
+	int result_count = 0, first, end;
 
-	index = 0;
+	search_index = search_index_get (list);
+	if (!search_index || !search_index_range (search_index, entry, &first, &end))
+		return -1;
 
-	if (entry->child_count == -1) /* item : file */
+	matches = search_index_lookup (search_index, criteria, entry->id,
+		sort_criteria);
+	if (!matches)
+		matches = cds_search_matches (list, search_index, first, end,
+		search, criteria, entry->id, sort_criteria);
+	if (!matches)
 		return -1;
 
-	didl_add_header (out);
+	*total = matches->count;
+	if (index < 0)
+		index = 0;
+	if (index > matches->count)
+		index = matches->count;
+	if (count == 0 || count > matches->count - index)
+		count = matches->count - index;
 
-	/* go to the child pointed out by index */
-	childs = entry->childs;
-	for (s = 0; s < index; s++)
-		if (*childs)
-			childs++;
+	for (; result_count < count; result_count++)
+	{
+		struct upnp_entry_t *e;
 
-	/* UPnP CDS compliance : If starting index = 0 and requested count = 0
-	then all children must be returned */
-	if (index == 0 && count == 0)
-		count = entry->child_count;
+		e = search_index_entry (search_index, matches->ranks[index + result_count]);
+		didl_add_entry (out, list, e, filter_class, server);
+	}
+
+	search_index_release (search_index, matches);
+
+	return result_count;
+}
+
+/*
+ * cds_search_directchildren_recursive : walk everything below entry,
+ *  containers before their children, and add the matches starting with
+ *  the index-th one, up to count of them (all of them if count is 0).
+ *  Every match is counted in total.
+ */
+static void
+	cds_search_directchildren_recursive (struct buffer_t *out,
+	struct metadata_list_t *list, int index, int count,
+	struct upnp_entry_t *entry, int filter_class,
+	const char *server, const struct search_expr_t *search,
+	int *total, int *result_count)
+{
+	struct upnp_entry_t **childs;
 
-	for (; *childs; childs++)
+	for (childs = entry->childs; *childs; childs++)
 	{
-		if (count == 0 || result_count < count)
-			/* only fetch the requested count number or all entries if count = 0 */
+		if (search_match (search, list, *childs))
 		{
-			if ((*childs)->child_count >= 0) /* container */
+			if (*total >= index && (count == 0 || *result_count < count))
 			{
-				int new_count;
-				new_count = cds_search_directchildren_recursive
-					(out, (count == 0) ? 0 : (count - result_count),
-					(*childs), filter, search_criteria);
-				result_count += new_count;
+				didl_add_entry (out, list, *childs, filter_class,
+				server);
+				(*result_count)++;
 			}
-			else /* item */
-			{
-				if (matches_search (search_criteria, *childs))
-				{
-#ifdef HAVE_DLNA
-					extern struct ushare_t *ut;
-#endif /* HAVE_DLNA */
-					char *protocol =
-#ifdef HAVE_DLNA
-						(*childs)->dlna_profile ?
-						dlna_write_protocol_info(DLNA_PROTOCOL_INFO_TYPE_HTTP,
-						DLNA_ORG_PLAY_SPEED_NORMAL,
-						DLNA_ORG_CONVERSION_NONE,
-						DLNA_ORG_OPERATION_RANGE,
-						ut->dlna_flags, (*childs)->dlna_profile):
-#endif /* HAVE_DLNA */
-						mime_get_protocol ((*childs)->mime_type);
+			(*total)++;
+		}
 
-#ifdef HAVE_DLNA
-					(*childs)->dlna_profile ?
-						didl_add_item (out, (*childs)->id,
-						(*childs)->parent ? (*childs)->parent->id : -1,
-						"true", dlna_profile_upnp_object_item ((*childs)->dlna_profile),
-						(*childs)->title, protocol,
-						(*childs)->size, (*childs)->url,
-						(*childs)->cover_id, filter) :
-#endif /* HAVE_DLNA */
-					didl_add_item (out, (*childs)->id,
-						(*childs)->parent ? (*childs)->parent->id : -1,
-						"true", (*childs)->mime_type->mime_class,
-						(*childs)->title, protocol,
-						(*childs)->size, (*childs)->url,
-						(*childs)->cover_id, filter);
-					free (protocol);
-					result_count++;
-				}
+		if ((*childs)->child_count >= 0) /* container */
+			cds_search_directchildren_recursive (out, list, index, count,
+			*childs, filter_class, server, search, total, result_count);
+	}
+}
+
+/*
+ * cds_search_collect : gather the matches below entry, as
+ *  cds_search_directchildren_recursive () walks them.
+ *  Returns false if memory is short.
+ */
+static bool
+	cds_search_collect (struct metadata_list_t *list,
+	struct upnp_entry_t *entry, const struct search_expr_t *search,
+	int sort_criteria, struct cds_sort_item_t **items, int *count,
+	int *size)
+{
+	struct upnp_entry_t **childs;
+
+	for (childs = entry->childs; *childs; childs++)
+	{
+		if (search_match (search, list, *childs))
+		{
+			if (*count == *size)
+			{
+				struct cds_sort_item_t *i;
+
+				*size = *size ? 2 * *size : 64;
+				i = (struct cds_sort_item_t *)
+					realloc (*items, *size * sizeof (struct cds_sort_item_t));
+				if (!i)
+					return false;
+				*items = i;
 			}
+			(*items)[*count].entry = *childs;
+			(*items)[*count].criteria = sort_criteria;
+			(*items)[*count].index = *count;
+			(*count)++;
 		}
+
+		if ((*childs)->child_count >= 0 /* container */
+			&& !cds_search_collect (list, *childs, search, sort_criteria,
+			items, count, size))
+			return false;
 	}
 
-	didl_add_footer (out);
+	return true;
+}
+
+/*
+ * cds_search_sorted : add the matches below entry in the order given by
+ *  sort_criteria, when the index can't tell them, starting with the
+ *  index-th one, up to count of them (all of them if count is 0).
+ *  Returns the number of entries added, -1 if memory is short.
+ */
+static int
+	cds_search_sorted (struct buffer_t *out, struct metadata_list_t *list,
+	int index, int count, struct upnp_entry_t *entry, int filter_class,
+	const char *server, const struct search_expr_t *search,
+	int sort_criteria, int *total)
+{
+	struct cds_sort_item_t *items = NULL;
+	int nr_items = 0, size = 0, result_count = 0;
 
+	if (!cds_search_collect (list, entry, search, sort_criteria,
+		&items, &nr_items, &size))
 	{
-		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
+		if (items)
+			free (items);
+		return -1;
+	}
 
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_RESULT, out->buf);
+	if (nr_items > 1)
+		qsort (items, nr_items, sizeof (struct cds_sort_item_t),
+		cds_sort_compare);
 
-		sprintf (tmp, "%d", result_count);
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_NUM_RETURNED, tmp);
-		sprintf (tmp, "%d", result_count);
-		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_TOTAL_MATCH, tmp);
+	*total = nr_items;
+	if (index < 0)
+		index = 0;
+	if (index > nr_items)
+		index = nr_items;
+	if (count == 0 || count > nr_items - index)
+		count = nr_items - index;
 
-		UpnpActionRequest_set_ActionResult(event->request, actionResult);
+	for (; result_count < count; result_count++)
+		didl_add_entry (out, list, items[index + result_count].entry,
+		filter_class, server);
+
+	if (items)
+		free (items);
+
+	return result_count;
+}
+
+static int
+	cds_search_directchildren (struct action_event_t *event,
+struct buffer_t *out, int index,
+	int count, struct upnp_entry_t *entry,
+	int filter_class, const struct search_expr_t *search,
+	const char *criteria, int sort_criteria, struct metadata_list_t *list)
+{
+	int result_count = 0, total = 0;
+	char server[64];
+
+	if (entry->child_count == -1) /* item : file */
+		return -1;
+
+	didl_server_address (server, sizeof (server));
+
+	didl_add_header (out);
+	result_count = cds_search_indexed (out, index, count, entry,
+		filter_class, server, search, criteria, sort_criteria, list, &total);
+	if (result_count < 0 && sort_criteria)
+		result_count = cds_search_sorted (out, list, index, count, entry,
+		filter_class, server, search, sort_criteria, &total);
+	if (result_count < 0)
+	{
+		result_count = 0;
+		total = 0;
+		cds_search_directchildren_recursive (out, list, index, count, entry,
+			filter_class, server, search, &total, &result_count);
 	}
+	didl_add_footer (out);
+
+	cds_add_result (event, out->buf, result_count, total);
 
 	return result_count;
 }
@@ -891,10 +2336,14 @@ static bool
 {
 	extern struct ushare_t *ut;
 	struct upnp_entry_t *entry = NULL;
-	int result_count = 0, index, count, id, sort_criteria;
+	int result_count = 0, index, count, id, sort_criteria, filter;
 	char *search_criteria = NULL;
-	char *filter = NULL;
+	char *filter_string = NULL;
+	char *sort = NULL;
+	struct search_expr_t *search = NULL;
 	struct buffer_t *out = NULL;
+	struct metadata_list_t *list = NULL;
+	char update_id[32];
 
 	if (!event)
 		return false;
@@ -914,31 +2363,53 @@ static bool
 
 	search_criteria = upnp_get_string (event->request,
 		SERVICE_CDS_ARG_SEARCH_CRIT);
-	filter = upnp_get_string (event->request, SERVICE_CDS_ARG_FILTER);
-	sort_criteria = upnp_get_ui4 (event->request, SERVICE_CDS_ARG_SORT_CRIT);
-
-	if (!search_criteria || !filter)
+	filter_string = upnp_get_string (event->request, SERVICE_CDS_ARG_FILTER);
+	filter = didl_filter_parse (filter_string);
+	sort = upnp_get_string (event->request, SERVICE_CDS_ARG_SORT_CRIT);
+	sort_criteria = cds_sort_parse (sort);
+	if (sort)
+		free (sort);
+
+	if (search_criteria)
+		search = search_compile (search_criteria);
+	if (!search || !filter_string)
+	{
+		search_free (search);
+		if (search_criteria)
+			free (search_criteria);
+		if (filter_string)
+			free (filter_string);
 		return false;
+	}
+	free (filter_string);
 
-	entry = upnp_get_entry (ut, id);
+	list = metadata_list_get (ut);
 
-	if (!entry && (id < ut->starting_id))
-		entry = upnp_get_entry (ut, ut->starting_id);
+	entry = upnp_get_entry (list, id);
 
-	if (!entry)
-		return false;
+	if (!entry && (id < ut->starting_id))
+		entry = upnp_get_entry (list, ut->starting_id);
 
-	out = buffer_new ();
+	out = entry ? buffer_new () : NULL;
 	if (!out)
+	{
+		metadata_list_put (ut, list);
+		search_free (search);
+		free (search_criteria);
 		return false;
+	}
 
 	result_count =
 		cds_search_directchildren (event, out, index, count, entry,
-		filter, search_criteria);
+		filter, search, search_criteria, sort_criteria, list);
+	sprintf (update_id, "%u", cds_update_id (list, entry));
+	metadata_list_put (ut, list);
+	search_free (search);
 
 	if (result_count < 0)
 	{
 		buffer_free (out);
+		free (search_criteria);
 		return false;
 	}
 
@@ -948,13 +2419,12 @@ static bool
 		IXML_Document *actionResult = UpnpActionRequest_get_ActionResult(event->request);
 
 		upnp_add_response (&actionResult, event, SERVICE_CDS_DIDL_UPDATE_ID,
-			SERVICE_CDS_ROOT_OBJECT_ID);
+			update_id);
 
 		UpnpActionRequest_set_ActionResult(event->request, actionResult);
 	}
 
 	free (search_criteria);
-	free (filter);
 
 	return event->status;
 }
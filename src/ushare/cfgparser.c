@@ -33,6 +33,8 @@
 #include "ushare.h"
 #include "trace.h"
 #include "osdep.h"
+#include "scanner.h"
+#include "prefetch.h"
 
 #define USHARE_DIR_DELIM ","
 
@@ -205,6 +207,24 @@ ushare_set_telnet_port (struct ushare_t *ut, const char *port)
   ut->telnet_port = atoi (port);
 }
 
+static void
+ushare_set_stream_port (struct ushare_t *ut, const char *port)
+{
+  int p;
+
+  if (!ut || !port)
+    return;
+
+  p = atoi (port);
+  if (p < 0 || p > 65535)
+  {
+    fprintf (stderr, _("Warning: invalid stream port, "
+                       "media will be served on the UPnP port.\n"));
+    p = 0;
+  }
+  ut->stream_port = (unsigned short) p;
+}
+
 static void
 ushare_use_web (struct ushare_t *ut, const char *val)
 {
@@ -243,6 +263,66 @@ ushare_use_dlna (struct ushare_t *ut, const char *val)
 #endif /* HAVE_DLNA */
 }
 
+static void
+ushare_set_scan_threads (struct ushare_t *ut, const char *threads)
+{
+  if (!ut || !threads)
+    return;
+
+  ut->scan_threads = atoi (threads);
+  if (ut->scan_threads < 1 || ut->scan_threads > SCANNER_MAX_THREADS)
+  {
+    fprintf (stderr, _("Warning: invalid number of scanner threads, "
+                       "using %d.\n"), SCANNER_DEFAULT_THREADS);
+    ut->scan_threads = SCANNER_DEFAULT_THREADS;
+  }
+}
+
+static void
+ushare_set_prefetch_size (struct ushare_t *ut, const char *size)
+{
+  if (!ut || !size)
+    return;
+
+  ut->prefetch_size = atoi (size);
+  if (ut->prefetch_size < 0)
+  {
+    fprintf (stderr, _("Warning: invalid prefetch size, using %d KB.\n"),
+             PREFETCH_DEFAULT_SIZE);
+    ut->prefetch_size = PREFETCH_DEFAULT_SIZE;
+  }
+}
+
+static void
+ushare_set_prefetch_max (struct ushare_t *ut, const char *max)
+{
+  if (!ut || !max)
+    return;
+
+  ut->prefetch_max = atoi (max);
+  if (ut->prefetch_max < 0)
+  {
+    fprintf (stderr, _("Warning: invalid prefetch limit, using %d KB.\n"),
+             PREFETCH_DEFAULT_MAX);
+    ut->prefetch_max = PREFETCH_DEFAULT_MAX;
+  }
+}
+
+static void
+ushare_set_index_file (struct ushare_t *ut, const char *file)
+{
+  if (!ut || !file)
+    return;
+
+  if (ut->index_file)
+  {
+    free (ut->index_file);
+    ut->index_file = NULL;
+  }
+
+  ut->index_file = _strdup (file);
+}
+
 static void
 ushare_set_override_iconv_err (struct ushare_t *ut, const char *arg)
 {
@@ -262,12 +342,17 @@ static u_configline_t configline[] = {
   { USHARE_IFACE,                ushare_set_interface           },
   { USHARE_PORT,                 ushare_set_port                },
   { USHARE_TELNET_PORT,          ushare_set_telnet_port         },
+  { USHARE_STREAM_PORT,          ushare_set_stream_port         },
   { USHARE_DIR,                  ushare_set_dir                 },
   { USHARE_OVERRIDE_ICONV_ERR,   ushare_set_override_iconv_err  },
   { USHARE_ENABLE_WEB,           ushare_use_web                 },
   { USHARE_ENABLE_TELNET,        ushare_use_telnet              },
   { USHARE_ENABLE_XBOX,          ushare_use_xbox                },
   { USHARE_ENABLE_DLNA,          ushare_use_dlna                },
+  { USHARE_SCAN_THREADS,         ushare_set_scan_threads        },
+  { USHARE_INDEX_FILE,           ushare_set_index_file          },
+  { USHARE_PREFETCH_SIZE,        ushare_set_prefetch_size       },
+  { USHARE_PREFETCH_MAX,         ushare_set_prefetch_max        },
   { NULL,                        NULL                           },
 };
 
@@ -0,0 +1,396 @@
+/*
+ * fdcache.c : GeeXboX uShare media file descriptor cache.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+
+#ifndef _WIN32
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#include "fdcache.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+struct fdcache_entry_t {
+  int id; /* of the upnp_entry_t, -1 for the files of the server itself */
+  char *path;
+  int fd;
+  dev_t dev; /* of the file it was opened on */
+  ino_t ino;
+  time_t mtime;
+  bool stale; /* the path now leads to another file, not to be shared */
+  int refcount;
+  time_t idle_since;
+  struct fdcache_entry_t *prev; /* most recently used first */
+  struct fdcache_entry_t *next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct fdcache_entry_t *head;
+  struct fdcache_entry_t *tail;
+  pthread_cond_t idle; /* signaled as descriptors become idle */
+  pthread_t thread;
+  bool running;
+  bool stop;
+} cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static time_t
+fdcache_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void
+fdcache_unlink (struct fdcache_entry_t *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache.head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache.tail = entry->prev;
+}
+
+static void
+fdcache_push (struct fdcache_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache.head;
+  if (cache.head)
+    cache.head->prev = entry;
+  else
+    cache.tail = entry;
+  cache.head = entry;
+}
+
+/*
+ * fdcache_expire: unlink the idle descriptors past their time or stale,
+ *  and the least recently used ones beyond FDCACHE_MAX_IDLE, return them
+ *  note: must be called with cache.lock held
+ */
+static struct fdcache_entry_t *
+fdcache_expire (void)
+{
+  struct fdcache_entry_t *entry, *next, *expired = NULL;
+  time_t now = fdcache_now ();
+  int idle = 0;
+
+  for (entry = cache.head; entry; entry = next)
+  {
+    next = entry->next;
+    if (entry->refcount)
+      continue;
+
+    if (entry->stale || ++idle > FDCACHE_MAX_IDLE
+        || now - entry->idle_since >= FDCACHE_IDLE_TIME)
+    {
+      fdcache_unlink (entry);
+      entry->next = expired;
+      expired = entry;
+    }
+  }
+
+  return expired;
+}
+
+/*
+ * fdcache_close: close the descriptors returned by fdcache_expire (),
+ *  away from the lock
+ */
+static void
+fdcache_close (struct fdcache_entry_t *expired)
+{
+  while (expired)
+  {
+    struct fdcache_entry_t *next = expired->next;
+
+    close (expired->fd);
+    free (expired->path);
+    free (expired);
+    expired = next;
+  }
+}
+
+/*
+ * fdcache_thread: expire the idle descriptors on time, even when no
+ *  request comes to do it anymore
+ */
+static void *
+fdcache_thread (void *arg __attribute__ ((unused)))
+{
+  pthread_mutex_lock (&cache.lock);
+
+  while (!cache.stop)
+  {
+    struct fdcache_entry_t *entry, *expired;
+    struct timespec deadline;
+    time_t oldest = 0;
+    bool idle = false;
+
+    expired = fdcache_expire ();
+    if (expired)
+    {
+      pthread_mutex_unlock (&cache.lock);
+      fdcache_close (expired);
+      pthread_mutex_lock (&cache.lock);
+      continue;
+    }
+
+    for (entry = cache.head; entry; entry = entry->next)
+      if (!entry->refcount && (!idle || entry->idle_since < oldest))
+      {
+        oldest = entry->idle_since;
+        idle = true;
+      }
+
+    if (!idle)
+    {
+      pthread_cond_wait (&cache.idle, &cache.lock);
+      continue;
+    }
+
+    /* on the same clock as idle_since */
+    clock_gettime (CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += oldest + FDCACHE_IDLE_TIME - fdcache_now ();
+    pthread_cond_timedwait (&cache.idle, &cache.lock, &deadline);
+  }
+
+  pthread_mutex_unlock (&cache.lock);
+
+  return NULL;
+}
+
+/*
+ * fdcache_start: start closing the idle descriptors after
+ *  FDCACHE_IDLE_TIME seconds, rather than on the next request only
+ */
+int
+fdcache_start (void)
+{
+  pthread_condattr_t attr;
+  int res = 0;
+
+  pthread_mutex_lock (&cache.lock);
+
+  if (cache.running)
+  {
+    pthread_mutex_unlock (&cache.lock);
+    return 0;
+  }
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&cache.idle, &attr);
+  pthread_condattr_destroy (&attr);
+
+  cache.stop = false;
+  if (pthread_create (&cache.thread, NULL, fdcache_thread, NULL))
+  {
+    perror ("Failed to create thread");
+    pthread_cond_destroy (&cache.idle);
+    res = -1;
+  }
+  else
+    cache.running = true;
+
+  pthread_mutex_unlock (&cache.lock);
+
+  return res;
+}
+
+/*
+ * fdcache_stop: stop the expiry thread and close every idle descriptor
+ */
+void
+fdcache_stop (void)
+{
+  bool running;
+
+  pthread_mutex_lock (&cache.lock);
+  running = cache.running;
+  cache.running = false;
+  cache.stop = true;
+  if (running)
+    pthread_cond_signal (&cache.idle);
+  pthread_mutex_unlock (&cache.lock);
+
+  if (running)
+  {
+    pthread_join (cache.thread, NULL);
+    pthread_cond_destroy (&cache.idle);
+  }
+
+  fdcache_flush ();
+}
+
+/*
+ * fdcache_open: return a descriptor of the file of entry id at path,
+ *  to be given back with fdcache_release ()
+ */
+int
+fdcache_open (int id, const char *path)
+{
+  struct fdcache_entry_t *entry, *expired;
+  struct stat st;
+  int fd;
+
+  /* what the path leads to now, a descriptor is only shared if it's the
+     very file it was opened on */
+  if (stat (path, &st) < 0)
+    return -1;
+
+  pthread_mutex_lock (&cache.lock);
+
+  /* the path guards against an id given to another file by a rescan */
+  for (entry = cache.head; entry; entry = entry->next)
+    if (!entry->stale && entry->id == id && !strcmp (entry->path, path))
+      break;
+
+  if (entry && (entry->dev != st.st_dev || entry->ino != st.st_ino
+                || entry->mtime != st.st_mtime))
+  {
+    /* replaced or rewritten : the readers of the old file finish with it,
+       the descriptor is closed after the last of them */
+    entry->stale = true;
+    entry = NULL;
+  }
+
+  if (entry)
+  {
+    entry->refcount++;
+    fdcache_unlink (entry);
+    fdcache_push (entry);
+    fd = entry->fd;
+  }
+
+  expired = fdcache_expire ();
+  pthread_mutex_unlock (&cache.lock);
+  fdcache_close (expired);
+
+  if (entry)
+    return fd;
+
+  /* no O_SYNC or O_NONBLOCK, they only make regular files slower */
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &st) < 0)
+  {
+    close (fd);
+    return -1;
+  }
+
+  entry = malloc (sizeof (struct fdcache_entry_t));
+  if (entry)
+    entry->path = strdup (path);
+  if (!entry || !entry->path)
+  {
+    free (entry);
+    close (fd);
+    return -1;
+  }
+  entry->id = id;
+  entry->fd = fd;
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->mtime = st.st_mtime;
+  entry->stale = false;
+  entry->refcount = 1;
+
+  /* two requests may have opened the file at once : both are kept, the
+     older one just ends up expiring first */
+  pthread_mutex_lock (&cache.lock);
+  fdcache_push (entry);
+  pthread_mutex_unlock (&cache.lock);
+
+  return fd;
+}
+
+/*
+ * fdcache_release: give back a descriptor returned by fdcache_open ()
+ */
+void
+fdcache_release (int fd)
+{
+  struct fdcache_entry_t *entry, *expired;
+
+  pthread_mutex_lock (&cache.lock);
+
+  for (entry = cache.head; entry; entry = entry->next)
+    if (entry->fd == fd && entry->refcount)
+      break;
+
+  if (entry && --entry->refcount == 0)
+  {
+    entry->idle_since = fdcache_now ();
+    if (cache.running)
+      pthread_cond_signal (&cache.idle);
+  }
+
+  expired = fdcache_expire ();
+  pthread_mutex_unlock (&cache.lock);
+  fdcache_close (expired);
+}
+
+/*
+ * fdcache_flush: close every idle descriptor
+ */
+void
+fdcache_flush (void)
+{
+  struct fdcache_entry_t *entry, *next, *expired = NULL;
+
+  pthread_mutex_lock (&cache.lock);
+
+  for (entry = cache.head; entry; entry = next)
+  {
+    next = entry->next;
+    if (entry->refcount)
+      continue;
+
+    fdcache_unlink (entry);
+    entry->next = expired;
+    expired = entry;
+  }
+
+  pthread_mutex_unlock (&cache.lock);
+  fdcache_close (expired);
+}
+
+#endif /* _WIN32 */
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <errno.h>
 #include <string.h>
@@ -46,9 +47,45 @@
 #include "presentation.h"
 #include "osdep.h"
 #include "mime.h"
+#include "reader.h"
 
 #define PROTOCOL_TYPE_PRE_SZ  11   /* for the str length of "http-get:*:" */
-#define PROTOCOL_TYPE_SUFF_SZ 2    /* for the str length of ":*" */
+
+/* seconds the info of a file no change monitor looks after is trusted */
+#define HTTP_INFO_TTL 2
+
+/* atomically replace *ptr by val if it still is old */
+#ifdef _MSC_VER
+#define http_compare_and_swap(ptr, old, val) \
+  (InterlockedCompareExchangePointer ((PVOID volatile *) (ptr), (val), \
+                                      (old)) == (old))
+#else
+#define http_compare_and_swap(ptr, old, val) \
+  __sync_bool_compare_and_swap ((ptr), (old), (val))
+#endif
+
+/*
+ * What http_get_info () answers for the file of an entry. Renderers ask
+ * for it several times before playing anything, so it is kept on the
+ * entry and only checked against the disk again when the file may have
+ * changed : when the rescan of a monitored directory has updated the
+ * entry, or after HTTP_INFO_TTL otherwise.
+ */
+struct http_info_t {
+  /* what it was checked against */
+  ssize_t key_size; /* entry->size */
+  time_t key_mtime; /* entry->mtime */
+  time_t checked; /* 0 until the file has been stat'ed */
+  /* the file */
+  ssize_t size;
+  time_t mtime;
+  bool readable;
+  bool dir;
+  char content_type[1];
+};
+
+/* guards the fields of every http_info_t but content_type */
+static pthread_mutex_t http_info_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 #ifdef _WIN32
@@ -93,6 +130,7 @@ bool httpGetDataFile(IN wchar_t const * const wstrFilename, OUT wchar_t const **
 struct web_file_t {
   char *fullpath;
   ssize_t pos;
+  ssize_t size; /* as last seen by http_get_info (), -1 if unknown */
   enum { FILE_LOCAL, FILE_MEMORY } type;
   union {
     struct {
@@ -101,9 +139,8 @@ struct web_file_t {
 	  HANDLE fileMapping;
 	  __int64 fileSize;
 #else
-      int fd;
+      struct reader_t reader;
 #endif
-      struct upnp_entry_t *entry;
     } local;
     struct {
       char *contents;
@@ -146,15 +183,135 @@ int http_getVirtualInfo(OUT UpnpFileInfo *info, char const * const strFilename,
 }
 
 
+/*
+ * http_get_protocol: return the malloc'd protocolInfo the file of this
+ *  entry is served with, "http-get:*:<content type>:<extra>"
+ */
+char *
+http_get_protocol (struct upnp_entry_t *entry)
+{
+#ifdef HAVE_DLNA
+  extern struct ushare_t *ut;
+
+  if (entry->dlna_profile)
+    return dlna_write_protocol_info (DLNA_PROTOCOL_INFO_TYPE_HTTP,
+                                     DLNA_ORG_PLAY_SPEED_NORMAL,
+                                     DLNA_ORG_CONVERSION_NONE,
+                                     DLNA_ORG_OPERATION_RANGE,
+                                     ut->dlna_flags, entry->dlna_profile);
+#endif /* HAVE_DLNA */
+
+  return mime_get_protocol (entry->mime_type);
+}
+
+static struct http_info_t *
+http_info_new (struct upnp_entry_t *entry)
+{
+  struct http_info_t *info;
+  char *protocol, *type;
+  size_t len;
+
+  protocol = http_get_protocol (entry);
+  if (!protocol)
+    return NULL;
+
+  /* "http-get:*:<content type>:<extra>" */
+  type = protocol + PROTOCOL_TYPE_PRE_SZ;
+  len = strcspn (type, ":");
+
+  info = (struct http_info_t *) malloc (sizeof (struct http_info_t) + len);
+  if (info)
+  {
+    memcpy (info->content_type, type, len);
+    info->content_type[len] = '\0';
+    info->checked = 0;
+  }
+  free (protocol);
+
+  return info;
+}
+
+/*
+ * http_get_entry_info: return the info of the file of entry, a copy of
+ *  its fields in *copy. The file is only stat'ed if it may have changed
+ *  since last time, else neither syscall nor allocation is needed.
+ */
+static struct http_info_t *
+http_get_entry_info (struct upnp_entry_t *entry, struct http_info_t *copy)
+{
+  struct http_info_t *info = entry->http_info;
+  char fullpath[PATH_MAX];
+  struct _stat64 st;
+  time_t now = time (NULL);
+  bool monitored = false;
+  bool readable = true;
+
+  if (!info)
+  {
+    info = http_info_new (entry);
+    if (!info)
+      return NULL;
+
+    /* the content type never changes, keep the first one set */
+    if (!http_compare_and_swap (&entry->http_info, NULL, info))
+    {
+      free (info);
+      info = entry->http_info;
+    }
+  }
+
+#ifdef HAVE_FAM
+  /* changes to the file then show up as a new size or mtime */
+  monitored = (entry->parent && entry->parent->ufam_entry);
+#endif /* HAVE_FAM */
+
+  pthread_mutex_lock (&http_info_lock);
+  if (info->checked && info->key_size == entry->size
+      && info->key_mtime == entry->mtime
+      && (monitored || now - info->checked < HTTP_INFO_TTL))
+  {
+    *copy = *info;
+    pthread_mutex_unlock (&http_info_lock);
+    return info;
+  }
+  pthread_mutex_unlock (&http_info_lock);
+
+  if (upnp_entry_get_path (entry, fullpath, sizeof (fullpath)) < 0
+      || _stat64 (fullpath, &st) < 0)
+    return NULL;
+
+#ifndef _MSC_VER
+  if (access (fullpath, R_OK) < 0)
+  {
+    if (errno != EACCES)
+      return NULL;
+    readable = false;
+  }
+#endif
+
+  pthread_mutex_lock (&http_info_lock);
+  info->key_size = entry->size;
+  info->key_mtime = entry->mtime;
+  info->checked = now;
+  info->size = st.st_size;
+  info->mtime = st.st_mtime;
+  info->readable = readable;
+  info->dir = S_ISDIR (st.st_mode) ? true : false;
+  *copy = *info;
+  pthread_mutex_unlock (&http_info_lock);
+
+  return info;
+}
+
 static int
 http_get_info (const char *filename, OUT UpnpFileInfo *info)
 {
   extern struct ushare_t *ut;
+  struct metadata_list_t *list = NULL;
   struct upnp_entry_t *entry = NULL;
-  struct  _stat64 st;
+  struct http_info_t *http_info = NULL;
+  struct http_info_t copy;
   int upnp_id = 0;
-  char *content_type = NULL;
-  char *protocol = NULL;
   
   if (!filename || !info)
     return -1;
@@ -218,56 +375,23 @@ http_get_info (const char *filename, OUT UpnpFileInfo *info)
   }
 
   upnp_id = atoi (strrchr (filename, '/') + 1);
-  entry = upnp_get_entry (ut, upnp_id);
-  if (!entry)
-    return -1;
-
-  if (!entry->fullpath)
-    return -1;
-
-  if ( _stat64 (entry->fullpath, &st) < 0)
-    return -1;
-
-#ifndef _MSC_VER
-  if (access (entry->fullpath, R_OK) < 0)
+  list = metadata_list_get (ut);
+  entry = upnp_get_entry (list, upnp_id);
+  if (entry)
+    http_info = http_get_entry_info (entry, &copy);
+  if (!http_info)
   {
-    if (errno != EACCES)
-      return -1;
-	UpnpFileInfo_set_IsReadable(info,0);
+    metadata_list_put (ut, list);
+    return -1;
   }
-  else
-#endif
-    UpnpFileInfo_set_IsReadable(info,1);
-
-  /* file exist and can be read */
-  UpnpFileInfo_set_FileLength(info,st.st_size);
-  UpnpFileInfo_set_LastModified(info,st.st_mtime);
-  UpnpFileInfo_set_IsDirectory(info,S_ISDIR (st.st_mode));
-
-  protocol = 
-#ifdef HAVE_DLNA
-    entry->dlna_profile ?
-    dlna_write_protocol_info (DLNA_PROTOCOL_INFO_TYPE_HTTP,
-                              DLNA_ORG_PLAY_SPEED_NORMAL,
-                              DLNA_ORG_CONVERSION_NONE,
-                              DLNA_ORG_OPERATION_RANGE,
-                              ut->dlna_flags, entry->dlna_profile) :
-#endif /* HAVE_DLNA */
-    mime_get_protocol (entry->mime_type);
 
-  content_type =
-    strndup ((protocol + PROTOCOL_TYPE_PRE_SZ),
-             strlen (protocol + PROTOCOL_TYPE_PRE_SZ)
-             - PROTOCOL_TYPE_SUFF_SZ);
-  free (protocol);
-
-  if (content_type)
-  {
-	  UpnpFileInfo_set_ContentType(info,ixmlCloneDOMString(content_type));
-    free (content_type);
-  }
-  else
-	  UpnpFileInfo_set_ContentType(info,ixmlCloneDOMString (""));
+  UpnpFileInfo_set_IsReadable(info,copy.readable);
+  UpnpFileInfo_set_FileLength(info,copy.size);
+  UpnpFileInfo_set_LastModified(info,copy.mtime);
+  UpnpFileInfo_set_IsDirectory(info,copy.dir);
+  /* copied by libupnp, the entry may go away once the list is put */
+  UpnpFileInfo_set_ContentType(info,http_info->content_type);
+  metadata_list_put (ut, list);
 
   return 0;
 }
@@ -281,6 +405,7 @@ get_file_memory (const char *fullpath, const char *description,
   file = malloc (sizeof (struct web_file_t));
   file->fullpath = _strdup (fullpath);
   file->pos = 0;
+  file->size = -1;
   file->type = FILE_MEMORY;
   file->detail.memory.contents = _strdup (description);
   file->detail.memory.len = length;
@@ -292,8 +417,12 @@ static UpnpWebFileHandle
 get_file_local (const char *fullpath)
 {
   struct web_file_t *file;
+#ifdef _WIN32
   FILE * fd = NULL;
   errno_t err = 0;
+#else
+  struct reader_t reader;
+#endif
 
 #ifdef _WIN32
   wchar_t const * http_fullpathex = NULL;
@@ -309,18 +438,20 @@ get_file_local (const char *fullpath)
   if (fd < 0)
     return NULL;
 #else
-
-  fd = open (fullpath, O_RDONLY | O_NONBLOCK | O_SYNC | O_NDELAY);
-  if (fd < 0)
+  if (reader_open (&reader, -1, fullpath) < 0)
     return NULL;
 #endif
 
   file = malloc (sizeof (struct web_file_t));
   file->fullpath = _strdup (fullpath);
   file->pos = 0;
+  file->size = -1;
   file->type = FILE_LOCAL;
-  file->detail.local.entry = NULL;
+#ifdef _WIN32
   file->detail.local.fd = fd;
+#else
+  file->detail.local.reader = reader;
+#endif
 
   return ((UpnpWebFileHandle) file);
 }
@@ -329,11 +460,19 @@ static UpnpWebFileHandle
 http_open (const char *filename, enum UpnpOpenFileMode mode)
 {
   extern struct ushare_t *ut;
+  struct metadata_list_t *list = NULL;
   struct upnp_entry_t *entry = NULL;
   struct web_file_t *file  = NULL;
+  struct http_info_t copy;
+  char path[PATH_MAX], *fullpath = NULL;
+  ssize_t size = -1;
+#ifdef _WIN32
   FILE *fd = NULL;
-  int upnp_id = 0;
   errno_t err = 0;
+#else
+  struct reader_t reader;
+#endif
+  int upnp_id = 0;
 
   if (!filename)
     return NULL;
@@ -370,46 +509,59 @@ http_open (const char *filename, enum UpnpOpenFileMode mode)
                             ut->presentation->len);
 
   upnp_id = atoi (strrchr (filename, '/') + 1);
-  entry = upnp_get_entry (ut, upnp_id);
-  if (!entry)
-    return NULL;
+  list = metadata_list_get (ut);
+  entry = upnp_get_entry (list, upnp_id);
+  if (entry && upnp_entry_get_path (entry, path, sizeof (path)) >= 0)
+  {
+    fullpath = _strdup (path);
+    /* most likely just checked by http_get_info () */
+    if (http_get_entry_info (entry, &copy))
+      size = copy.size;
+  }
+  /* the entry may go away, only its path is needed from now on */
+  metadata_list_put (ut, list);
 
-  if (!entry->fullpath)
+  if (!fullpath)
     return NULL;
 
-  if (NULL == ut->strNowPlaying || strcmp(ut->strNowPlaying,entry->fullpath))
+  if (NULL == ut->strNowPlaying || strcmp(ut->strNowPlaying,fullpath))
   {
 	  if (NULL != ut->strNowPlaying) free (ut->strNowPlaying);
-	  {
-	  size_t lenFullpath = (strlen(entry->fullpath) +1) * sizeof(char *);
-	  char * strBufNowPlaying = (char *) malloc(lenFullpath);
-	  ut->strNowPlaying = (char *) memcpy(strBufNowPlaying,entry->fullpath,lenFullpath);
-	  }
+	  ut->strNowPlaying = _strdup (fullpath);
 	log_info ("Now Playing: %s\n", ut->strNowPlaying);
   }
 
-  log_verbose ("Opening File: %s\n", entry->fullpath);
+  log_verbose ("Opening File: %s\n", fullpath);
 
 #ifdef _WIN32
   {
 	  wchar_t * wFilename = (wchar_t *) malloc((PATH_MAX+1)*sizeof(wchar_t*));
-	  _snwprintf(wFilename,PATH_MAX,L"%hs",entry->fullpath);
+	  _snwprintf(wFilename,PATH_MAX,L"%hs",fullpath);
 	  err = _wfopen_s (&fd,wFilename, L"rb" );
 	  if (fd < 0)
+	  {
+		  free (fullpath);
 		  return NULL;
+	  }
   }
 #else
-  fd = open (entry->fullpath, O_RDONLY | O_NONBLOCK | O_SYNC | O_NDELAY);
-  if (fd < 0)
+  if (reader_open (&reader, upnp_id, fullpath) < 0)
+  {
+    free (fullpath);
     return NULL;
+  }
 #endif
 
   file = malloc (sizeof (struct web_file_t));
-  file->fullpath = _strdup (entry->fullpath);
+  file->fullpath = fullpath;
   file->pos = 0;
+  file->size = size;
   file->type = FILE_LOCAL;
-  file->detail.local.entry = entry;
+#ifdef _WIN32
   file->detail.local.fd = fd;
+#else
+  file->detail.local.reader = reader;
+#endif
 
   return ((UpnpWebFileHandle) file);
 }
@@ -432,7 +584,7 @@ http_read (UpnpWebFileHandle fh, char *buf, size_t buflen)
 #ifdef _WIN32
     len = fread (buf, sizeof(char), buflen,file->detail.local.fd);
 #else
-    len = _read (file->detail.local.fd, buf, buflen);
+    len = reader_read (&file->detail.local.reader, buf, buflen);
 #endif
 
     break;
@@ -499,7 +651,9 @@ http_seek (UpnpWebFileHandle fh, ptrdiff_t offset, int origin)
     log_verbose ("Attempting to seek by %lld from end (was at %ld) in %s\n",
                 offset, file->pos, file->fullpath);
 
-    if (file->type == FILE_LOCAL)
+    if (file->type == FILE_LOCAL && file->size >= 0)
+      newpos = file->size + offset;
+    else if (file->type == FILE_LOCAL)
     {
       struct  _stat64 sb;
       if ( _stat64 (file->fullpath, &sb) < 0)
@@ -530,7 +684,7 @@ http_seek (UpnpWebFileHandle fh, ptrdiff_t offset, int origin)
 #ifdef _WIN32
     if (_fseeki64 (file->detail.local.fd, newpos, SEEK_SET) == -1)
 #else
-    if (_lseek (file->detail.local.fd, newpos, SEEK_SET) == -1)
+    if (reader_seek (&file->detail.local.reader, newpos) < 0)
 #endif
     {
       log_verbose ("%s: cannot seek: %s\n", file->fullpath, strerror (errno));
@@ -567,7 +721,7 @@ http_close (UpnpWebFileHandle fh)
 #ifdef _WIN32
     fclose (file->detail.local.fd);
 #else
-    _close (file->detail.local.fd);
+    reader_close (&file->detail.local.reader);
 #endif
 	break;
   case FILE_MEMORY:
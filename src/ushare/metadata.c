@@ -37,6 +37,11 @@
 #include "content.h"
 #include "gettext.h"
 #include "trace.h"
+#include "scanner.h"
+#include "metaindex.h"
+#include "arena.h"
+#include "searchindex.h"
+#include "cds.h"
 
 #ifdef HAVE_FAM
 #include "ufam.h"
@@ -56,16 +61,59 @@ struct upnp_entry_lookup_name_t {
   struct upnp_entry_t *entry_ptr;
 };
 
+#define METADATA_ARENA_SLAB_SIZE (256 * 1024)
+
+/* Rescans can't give back the arena memory of the entries they remove :
+   once it makes up more than half of the arena, and at least
+   METADATA_ARENA_DEAD_MIN bytes, the live entries are copied to a new
+   arena, IDs and all. */
+#define METADATA_ARENA_DEAD_MIN (4 * METADATA_ARENA_SLAB_SIZE)
+
+/* Saving the index after rescans can wait, but IDs they hand out must
+   never be given again after a restart : the saved index reserves that
+   many more, and is saved at once when they run out. */
+#define METADATA_INDEX_ID_RESERVE METADATA_IDS_CHUNK_SIZE
+
+#define UPNP_ENTRY_MIN_CHILDS 4
+
+/* items have no children, they all share this empty childs list */
+static struct upnp_entry_t *upnp_entry_no_childs[1] = { NULL };
+
+/* make sure everything written so far is visible before going on */
+#ifdef _MSC_VER
+#define metadata_barrier() MemoryBarrier ()
+#else
+#define metadata_barrier() __sync_synchronize ()
+#endif
+
+/* atomically replace *ptr by val, return the previous value */
+#ifdef _MSC_VER
+#define metadata_exchange(ptr, val) \
+  InterlockedExchangePointer ((PVOID volatile *) (ptr), (val))
+#else
+#define metadata_exchange(ptr, val) __sync_lock_test_and_set ((ptr), (val))
+#endif
+
+/* guards the RB lookup trees (sparse IDs) against concurrent updates */
+static pthread_mutex_t metadata_lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifdef _WIN32
 static int
-metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
-                   const char *file, const char *name, struct _stat64 *st_ptr);
+metadata_add_file (struct ushare_t *ut, struct metadata_list_t *list,
+                   struct upnp_entry_t *entry,
+                   const char *file, const char *name, struct _stat64 *st_ptr,
+                   int id);
 #else
 static int
-metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
-                   const char *file, const char *name, struct  _stat64 *st_ptr);
+metadata_add_file (struct ushare_t *ut, struct metadata_list_t *list,
+                   struct upnp_entry_t *entry,
+                   const char *file, const char *name, struct  _stat64 *st_ptr,
+                   int id);
 #endif
 
+static void upnp_entry_free (void *data);
+static void upnp_sort_free (void *data);
+
 static char *
 getExtension (const char *filename)
 {
@@ -110,18 +158,6 @@ is_valid_extension (const char *extension)
   return false;
 }
 
-static int
-get_list_length (void *list)
-{
-  void **l = list;
-  int n = 0;
-
-  while (*(l++))
-    n++;
-
-  return n;
-}
-
 static xml_convert_t xml_convert[] = {
   {'"' , "&quot;"},
   {'&' , "&amp;"},
@@ -146,7 +182,11 @@ get_xmlconvert (int c)
   return NULL;
 }
 
-static char *
+/*
+ * convert_xml : escape the XML special characters of title
+ *  Returns a malloc'd string, NULL if there's nothing to escape.
+ */
+char *
 convert_xml (const char *title)
 {
   char *newtitle, *s, *t, *xml;
@@ -185,148 +225,155 @@ static struct mime_type_t Container_MIME_Type =
 
 #define ARRAY_NB_ELEMENTS(array) (sizeof (array) / sizeof (array[0]))
 
-static int
-vh_file_exists (const char *file)
-{
-  struct  _stat64 st;
-  return ! _stat64 (file, &st);
-}
+static const char *known_audio_filenames[] =
+  { "cover", "COVER", "front", "FRONT" };
+
+static const char *known_audio_extensions[] =
+  { "jpg", "JPG", "jpeg", "JPEG", "png", "PNG", "tbn", "TBN" };
 
+/* Rank of name as a generic cover file, lower is better, -1 if it's not */
 static int
-upnp_audio_get_cover (struct ushare_t *ut, struct upnp_entry_t *entry,
-                      const char *fullpath, const char *class)
+upnp_cover_rank (const char *name)
 {
-  const char *known_audio_filenames[] =
-    { "cover", "COVER", "front", "FRONT" };
-
-  const char *known_audio_extensions[] =
-    { "jpg", "JPG", "jpeg", "JPEG", "png", "PNG", "tbn", "TBN" };
-
-  char *s, *dir = NULL, *file = NULL, *cv = NULL, *f = NULL;
+  const char *ext;
   unsigned int i, j;
 
-#ifdef _WIN32
-  struct _stat64 st;
-#else
-  struct  _stat64 st;
-#endif
-
-  int cover_id;
-
-  if (!class || strcmp (class, UPNP_AUDIO))
-    goto end;
-
-  /* retrieve directory name */
-  s = strrchr (fullpath, '/');
-  if (!s)
-    goto end;
-  dir = strndup (fullpath, strlen (fullpath) - strlen (s));
+  if (!name)
+    return -1;
 
-  /* retrieve file base name */
-  s = strrchr (fullpath, '.');
-  if (!s)
-    goto end;
-  file = strndup (fullpath + strlen (dir) + 1,
-                  strlen (fullpath) - strlen (dir) - strlen (s) - 1);
+  ext = strrchr (name, '.');
+  if (!ext)
+    return -1;
 
-  /* try to find a generic cover file for the whole directory */
   for (i = 0; i < ARRAY_NB_ELEMENTS (known_audio_extensions); i++)
+  {
+    if (strcmp (ext + 1, known_audio_extensions[i]))
+      continue;
+
     for (j = 0; j < ARRAY_NB_ELEMENTS (known_audio_filenames); j++)
-    {
-      char cover[1024] = { 0 };
-      char f2[512] = { 0 };
+      if (strlen (known_audio_filenames[j]) == (size_t) (ext - name)
+          && !strncmp (name, known_audio_filenames[j], ext - name))
+        return i * ARRAY_NB_ELEMENTS (known_audio_filenames) + j;
+  }
 
-      snprintf (f2, sizeof (f2), "%s.%s",
-                known_audio_filenames[j], known_audio_extensions[i]);
-      snprintf (cover, sizeof (cover), "%s/%s", dir, f2);
+  return -1;
+}
 
-      if (vh_file_exists (cover))
-      {
-        cv = _strdup (cover);
-        f = _strdup (f2);
-        goto end;
-      }
-    }
+/* UPnP class of entry, as shown in its DIDL-Lite */
+const char *
+upnp_entry_class (const struct upnp_entry_t *entry)
+{
+#ifdef HAVE_DLNA
+  if (entry->dlna_profile)
+    return dlna_profile_upnp_object_item (entry->dlna_profile);
+#endif /* HAVE_DLNA */
+  return entry->mime_type ? entry->mime_type->mime_class : NULL;
+}
 
-end:
-  //printf ("Path: %s\n", fullpath);
-  //printf (" Cover: %s\n", cv);
+/*
+ * upnp_audio_set_covers : pick the generic cover file of a directory among
+ *  its children, i.e. from the listing already in hand, and make all
+ *  audio tracks of the directory refer to it
+ */
+static void
+upnp_audio_set_covers (struct upnp_entry_t *entry)
+{
+  struct upnp_entry_t **childs, *cover = NULL;
+  int best = -1;
 
-#ifdef _WIN32
-	{
-		wchar_t * wFilename = (wchar_t *) malloc((PATH_MAX+1)*sizeof(wchar_t*));
-		_snwprintf(wFilename,PATH_MAX,L"%hs",fullpath);
-		_wstat64 (wFilename, &st);
-	}
-#else
-	 _stat64 (fullpath, &st);
-#endif
+  for (childs = entry->childs; *childs; childs++)
+  {
+    int rank;
 
-  cover_id = metadata_add_file (ut, entry, cv, f, &st);
-  //printf (" Cover ID: %d\n", cover_id);
+    if ((*childs)->child_count >= 0) /* container */
+      continue;
+
+    rank = upnp_cover_rank ((*childs)->name);
+    if (rank >= 0 && (best < 0 || rank < best))
+    {
+      best = rank;
+      cover = *childs;
+    }
+  }
 
-  if (dir)
-    free (dir);
-  if (file)
-    free (file);
-  if (f)
-    free (f);
-  if (cv)
-    free (cv);
+  for (childs = entry->childs; *childs; childs++)
+  {
+    const char *class = upnp_entry_class (*childs);
 
-  return cover_id;
+    if ((*childs)->child_count < 0 && class && !strcmp (class, UPNP_AUDIO))
+      (*childs)->cover_id = cover ? cover->id : -1;
+  }
 }
 
 static struct upnp_entry_t *
-upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
-                struct upnp_entry_t *parent, ssize_t size, int dir)
+upnp_entry_new (struct ushare_t *ut, struct metadata_list_t *list,
+                const char *name, const char *fullpath,
+                struct upnp_entry_t *parent, ssize_t size, int dir, int id)
 {
   struct upnp_entry_t *entry = NULL;
   char *title = NULL, *x = NULL;
   char url_tmp[MAX_URL_SIZE] = { '\0' };
   char *title_or_name = NULL;
+#ifdef HAVE_DLNA
+  dlna_profile_t *profile = NULL;
+#endif /* HAVE_DLNA */
 
   if (!name)
     return NULL;
 
-  entry = (struct upnp_entry_t *) malloc (sizeof (struct upnp_entry_t));
-
 #ifdef HAVE_DLNA
-  entry->dlna_profile = NULL;
-  entry->url = NULL;
   if (ut->dlna_enabled && fullpath && !dir)
   {
-    dlna_profile_t *p = dlna_guess_media_profile (ut->dlna, fullpath);
-    if (!p)
-    {
-      free (entry);
+    profile = dlna_guess_media_profile (ut->dlna, fullpath);
+    if (!profile)
       return NULL;
-    }
-    entry->dlna_profile = p;
   }
 #endif /* HAVE_DLNA */
+
+  /* entries and their strings live as long as the whole tree */
+  entry = (struct upnp_entry_t *)
+    arena_alloc (list->arena, sizeof (struct upnp_entry_t));
+  if (!entry)
+    return NULL;
+
+#ifdef HAVE_DLNA
+  entry->dlna_profile = profile;
+  entry->url = NULL;
+#endif /* HAVE_DLNA */
  
-  if (ut->xbox360)
+  if (ut->xbox360 && !list->root_entry)
+    entry->id = 0; /* Creating the root node so don't use the usual IDs */
+  else
   {
-    if (ut->root_entry)
-      entry->id = ut->starting_id + ut->nr_entries++;
-    else
-      entry->id = 0; /* Creating the root node so don't use the usual IDs */
+    /* reuse the ID given by the metadata index, if any */
+    entry->id = (id >= 0) ? id : ut->next_id++;
+    list->nr_entries++;
   }
-  else
-    entry->id = ut->starting_id + ut->nr_entries++;
   
-  entry->fullpath = fullpath ? _strdup (fullpath) : NULL;
+  /* only content directories, right under the root, keep a full path,
+     others are found from their parents */
+  if (fullpath && parent && parent->name)
+  {
+    const char *base = strrchr (fullpath, '/');
+    entry->name = arena_strdup (list->arena, base ? base + 1 : fullpath);
+  }
+  else
+    entry->name = arena_strdup (list->arena, fullpath);
   entry->parent = parent;
   entry->child_count =  dir ? 0 : -1;
+  entry->child_capacity = 0;
+  entry->linked = false;
   entry->title = NULL;
 #ifdef HAVE_FAM
   entry->ufam_entry = NULL;
 #endif /* HAVE_FAM */
 
-  entry->childs = (struct upnp_entry_t **)
-    malloc (sizeof (struct upnp_entry_t *));
-  *(entry->childs) = NULL;
+  entry->childs = upnp_entry_no_childs;
+  entry->didl = NULL;
+  entry->http_info = NULL;
+  entry->sorts = NULL;
+  entry->update_id = list->update_id;
+  entry->mtime = 0;
 
   if (!dir) /* item */
     {
@@ -339,8 +386,10 @@ upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
       struct mime_type_t *mime = getMimeType (getExtension (name));
       if (!mime)
       {
-        --ut->nr_entries; 
-        upnp_entry_free (ut, entry);
+        --list->nr_entries;
+        if (id < 0)
+          --ut->next_id;
+        upnp_entry_free (entry);
         log_error ("Invalid Mime type for %s, entry ignored", name);
         return NULL;
       }
@@ -353,12 +402,8 @@ upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
                     entry->id, getExtension (name)) >= MAX_URL_SIZE)
         log_error ("URL string too long for id %d, truncated!!", entry->id);
 
-      /* look for audio album cover */
-      upnp_audio_get_cover (ut, parent,
-                            fullpath, entry->mime_type->mime_class);
-
-      /* Only malloc() what we really need */
-      entry->url = _strdup (url_tmp);
+      /* Only allocate what we really need */
+      entry->url = arena_strdup (list->arena, url_tmp);
     }
   else /* container */
     {
@@ -383,8 +428,11 @@ upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
     }
     else
     {
-      upnp_entry_free (ut, entry);
       log_error ("Freeing entry invalid name id=%d [%s]\n", entry->id, name);
+      --list->nr_entries;
+      if (id < 0)
+        --ut->next_id;
+      upnp_entry_free (entry);
       return NULL;
     }
   }
@@ -401,15 +449,15 @@ upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
     free (title_or_name);
     title_or_name = x;
   }
-  entry->title = title_or_name;
 
   if (!strcmp (title_or_name, "")) /* DIDL dc:title can't be empty */
-  {
-    free (title_or_name);
-    entry->title = _strdup (TITLE_UNKNOWN);
-  }
+    entry->title = arena_strdup (list->arena, TITLE_UNKNOWN);
+  else
+    entry->title = arena_strdup (list->arena, title_or_name);
+  free (title_or_name);
 
   entry->size = size;
+  entry->cover_id = -1; /* see upnp_audio_set_covers () */
   entry->fd = -1;
 
   if (entry->id && entry->url)
@@ -421,134 +469,220 @@ upnp_entry_new (struct ushare_t *ut, const char *name, const char *fullpath,
   return entry;
 }
 
-/* Seperate recursive free() function in order to avoid freeing off
- * the parents child list within the freeing of the first child, as
- * the only entry which is not part of a childs list is the root entry
+/* Release what entry and its children hold outside of the arena, the
+ * entries themselves go away along with the arena of their tree
  */
 static void
-_upnp_entry_free (struct upnp_entry_t *entry)
+upnp_entry_free (void *data)
 {
+  struct upnp_entry_t *entry = (struct upnp_entry_t *) data;
   struct upnp_entry_t **childs;
 
   if (!entry)
     return;
 
-  if (entry->fullpath)
-    free (entry->fullpath);
-  if (entry->title)
-    free (entry->title);
-  if (entry->url)
-    free (entry->url);
-#ifdef HAVE_DLNA
-  if (entry->dlna_profile)
-    entry->dlna_profile = NULL;
-#endif /* HAVE_DLNA */
 #ifdef HAVE_FAM
   if (entry->ufam_entry)
     ufam_remove_monitor (entry->ufam_entry);
+  entry->ufam_entry = NULL;
 #endif /* HAVE_FAM */
 
+  if (entry->didl)
+    free (entry->didl);
+  entry->didl = NULL;
+  if (entry->http_info)
+    free (entry->http_info);
+  entry->http_info = NULL;
+  upnp_sort_free (entry->sorts);
+  entry->sorts = NULL;
+
   for (childs = entry->childs; *childs; childs++)
-    _upnp_entry_free (*childs);
-  free (entry->childs);
+    upnp_entry_free (*childs);
+  if (entry->childs != upnp_entry_no_childs)
+    free (entry->childs);
+  entry->childs = upnp_entry_no_childs;
+  entry->child_capacity = 0;
 }
 
-void
-upnp_entry_free (struct ushare_t *ut, struct upnp_entry_t *entry)
+/* Release a list of sorted children */
+static void
+upnp_sort_free (void *data)
 {
-  if (!ut || !entry)
-    return;
+  struct upnp_sort_t *sort = (struct upnp_sort_t *) data;
 
-  /* Free all entries (i.e. children) */
-  if (entry == ut->root_entry)
+  while (sort)
   {
-    struct upnp_entry_t *entry_found = NULL;
-    struct upnp_entry_lookup_t *lk = NULL;
-    RBLIST *rblist;
-    int i = 0;
+    struct upnp_sort_t *next = sort->next;
 
-    rblist = rbopenlist (ut->rb);
-    lk = (struct upnp_entry_lookup_t *) rbreadlist (rblist);
+    free (sort);
+    sort = next;
+  }
+}
 
-    while (lk)
-    {
-      entry_found = lk->entry_ptr;
-      if (entry_found)
-      {
- 	if (entry_found->fullpath)
- 	  free (entry_found->fullpath);
- 	if (entry_found->title)
- 	  free (entry_found->title);
- 	if (entry_found->url)
- 	  free (entry_found->url);
-#ifdef HAVE_FAM
-        if (entry_found->ufam_entry)
-          ufam_remove_monitor (entry_found->ufam_entry);
-#endif /* HAVE_FAM */
+/*
+ * upnp_entry_reserve_childs : make room for count more children. The
+ *  list grows geometrically, or to the exact size when the number of
+ *  children is known in advance, e.g. from a scandir () result.
+ *  note: entry must not be visible to readers yet
+ */
+static bool
+upnp_entry_reserve_childs (struct upnp_entry_t *entry, int count)
+{
+  struct upnp_entry_t **childs;
+  int need, capacity;
 
-	free (entry_found);
- 	i++;
-      }
+  need = entry->child_count + count + 1; /* NULL terminated */
+  if (need <= entry->child_capacity)
+    return true;
 
-      free (lk); /* delete the lookup */
-      lk = (struct upnp_entry_lookup_t *) rbreadlist (rblist);
-    }
+  capacity = entry->child_capacity ? 2 * entry->child_capacity
+    : UPNP_ENTRY_MIN_CHILDS;
+  if (capacity < need)
+    capacity = need;
 
-    rbcloselist (rblist);
-    rbdestroy (ut->rb);
-    ut->rb = NULL;
+  if (entry->childs == upnp_entry_no_childs)
+    childs = (struct upnp_entry_t **)
+      malloc (capacity * sizeof (struct upnp_entry_t *));
+  else
+    childs = (struct upnp_entry_t **)
+      realloc (entry->childs, capacity * sizeof (struct upnp_entry_t *));
+  if (!childs)
+    return false;
 
-    if (ut->verbose) log_verbose ("Freed [%d] entries\n", i);
+  childs[entry->child_count] = NULL;
+  entry->childs = childs;
+  entry->child_capacity = capacity;
+
+  return true;
+}
+
+static void
+upnp_entry_append_child (struct upnp_entry_t *entry,
+                         struct upnp_entry_t *child)
+{
+  if (!upnp_entry_reserve_childs (entry, 1))
+    return;
+
+  entry->childs[entry->child_count++] = child;
+  entry->childs[entry->child_count] = NULL;
+  child->linked = true;
+}
+
+static bool
+metadata_ids_has (const struct metadata_ids_t *ids, int id)
+{
+  return ids && id >= ids->base
+    && ((unsigned int) (id - ids->base) >> METADATA_IDS_CHUNK_BITS)
+       < METADATA_IDS_MAX_CHUNKS;
+}
+
+/* Slot of id in the dense table, allocating its chunk if needed */
+static struct upnp_entry_t **
+metadata_ids_slot (struct metadata_ids_t *ids, int id, bool create)
+{
+  unsigned int n = id - ids->base;
+  unsigned int chunk = n >> METADATA_IDS_CHUNK_BITS;
+
+  if (!ids->chunks[chunk])
+  {
+    struct upnp_entry_t **slots;
+
+    if (!create)
+      return NULL;
+
+    slots = (struct upnp_entry_t **)
+      calloc (METADATA_IDS_CHUNK_SIZE, sizeof (struct upnp_entry_t *));
+    if (!slots)
+      return NULL;
+
+    /* readers don't lock, only let them see a cleared chunk */
+    metadata_barrier ();
+    ids->chunks[chunk] = slots;
   }
-  else
-    _upnp_entry_free (entry);
 
-  free (entry);
+  return &ids->chunks[chunk][n & (METADATA_IDS_CHUNK_SIZE - 1)];
 }
 
 static void
-upnp_entry_add_child (struct ushare_t *ut,
+upnp_entry_add_child (struct metadata_list_t *list,
                       struct upnp_entry_t *entry, struct upnp_entry_t *child)
 {
   struct upnp_entry_lookup_t *entry_lookup_ptr = NULL;
-  struct upnp_entry_t **childs;
-  int n;
 
-  if (!entry || !child)
+  if (!entry || !child || child->linked)
     return;
 
-  for (childs = entry->childs; *childs; childs++)
-    if (*childs == child)
+  upnp_entry_append_child (entry, child);
+
+  if (metadata_ids_has (list->ids, child->id))
+  {
+    struct upnp_entry_t **slot;
+
+    slot = metadata_ids_slot (list->ids, child->id, true);
+    if (!slot)
+    {
+      log_info (_("Failed to add the ID lookup table\n"));
       return;
+    }
 
-  n = get_list_length ((void *) entry->childs) + 1;
-  entry->childs = (struct upnp_entry_t **)
-    realloc (entry->childs, (n + 1) * sizeof (*(entry->childs)));
-  entry->childs[n] = NULL;
-  entry->childs[n - 1] = child;
-  entry->child_count++;
+    /* the entry has to be complete before it can be found */
+    metadata_barrier ();
+    *slot = child;
+    return;
+  }
 
   entry_lookup_ptr = (struct upnp_entry_lookup_t *)
     malloc (sizeof (struct upnp_entry_lookup_t));
   entry_lookup_ptr->id = child->id;
   entry_lookup_ptr->entry_ptr = child;
 
-  if (rbsearch ((void *) entry_lookup_ptr, ut->rb) == NULL)
+  pthread_mutex_lock (&metadata_lookup_lock);
+  if (rbsearch ((void *) entry_lookup_ptr, list->rb) == NULL)
     log_info (_("Failed to add the RB lookup tree\n"));
+  pthread_mutex_unlock (&metadata_lookup_lock);
 }
 
 struct upnp_entry_t *
-upnp_get_entry (struct ushare_t *ut, int id)
+upnp_get_entry (struct metadata_list_t *list, int id)
 {
+  extern struct ushare_t *ut;
   struct upnp_entry_lookup_t *res, entry_lookup;
 
+  if (!list)
+    return NULL;
+
   if (ut->verbose) log_verbose ("Looking for entry id %d\n", id);
   if (id == 0) /* We do not store the root (id 0) as it is not a child */
-    return ut->root_entry;
+    return list->root_entry;
+
+  if (metadata_ids_has (list->ids, id))
+  {
+    struct upnp_entry_t **slot, *entry = NULL;
+
+    slot = metadata_ids_slot (list->ids, id, false);
+    if (slot)
+      entry = *slot;
+
+    if (ut->verbose)
+    {
+      if (entry)
+      {
+        log_verbose ("Found at %p\n", entry);
+      }
+      else
+      {
+        log_verbose ("Not Found\n");
+      }
+    }
+
+    return entry;
+  }
 
   entry_lookup.id = id;
+  pthread_mutex_lock (&metadata_lookup_lock);
   res = (struct upnp_entry_lookup_t *)
-    rbfind ((void *) &entry_lookup, ut->rb);
+    rbfind ((void *) &entry_lookup, list->rb);
+  pthread_mutex_unlock (&metadata_lookup_lock);
 
   if (res)
   {
@@ -562,14 +696,81 @@ upnp_get_entry (struct ushare_t *ut, int id)
   return NULL;
 }
 
+/*
+ * upnp_entry_get_childs : return the NULL terminated children of entry and
+ *  their number in count, for random access. A concurrent rescan may make
+ *  the list end before count, but it can always be indexed up to count.
+ */
+struct upnp_entry_t **
+upnp_entry_get_childs (const struct upnp_entry_t *entry, int *count)
+{
+  int n;
+
+  /* a rescan publishes its new list before its size, and makes it
+     at least as large as the previous one */
+  n = entry->child_count;
+  metadata_barrier ();
+
+  if (count)
+    *count = (n > 0) ? n : 0;
+
+  return entry->childs;
+}
+
+/*
+ * upnp_entry_get_path : rebuild the full path of entry into buf, from the
+ *  names of its parents up to its content directory.
+ *  Returns the path length, or -1 if it doesn't fit.
+ */
+int
+upnp_entry_get_path (const struct upnp_entry_t *entry, char *buf, size_t size)
+{
+  const struct upnp_entry_t *e;
+  size_t len = 0, pos;
+
+  if (!entry || !entry->name || !buf)
+    return -1;
+
+  for (e = entry; ; e = e->parent)
+  {
+    len += strlen (e->name);
+    if (!e->parent || !e->parent->name)
+      break;
+    len++; /* separator */
+  }
+
+  if (len >= size)
+    return -1;
+
+  /* fill it backwards, from the entry itself */
+  pos = len;
+  buf[pos] = '\0';
+  for (e = entry; ; e = e->parent)
+  {
+    size_t n = strlen (e->name);
+
+    pos -= n;
+    memcpy (buf + pos, e->name, n);
+    if (!e->parent || !e->parent->name)
+      break;
+    buf[--pos] = '/';
+  }
+
+  return (int) len;
+}
+
 #ifdef _WIN32
 static int
-metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
-                   const char *file, const char *name, struct _stat64 *st_ptr)
+metadata_add_file (struct ushare_t *ut, struct metadata_list_t *list,
+                   struct upnp_entry_t *entry,
+                   const char *file, const char *name, struct _stat64 *st_ptr,
+                   int id)
 #else
 static int
-metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
-                   const char *file, const char *name, struct  _stat64 *st_ptr)
+metadata_add_file (struct ushare_t *ut, struct metadata_list_t *list,
+                   struct upnp_entry_t *entry,
+                   const char *file, const char *name, struct  _stat64 *st_ptr,
+                   int id)
 #endif
 {
   if (!entry || !file || !name)
@@ -583,9 +784,12 @@ metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
   {
     struct upnp_entry_t *child = NULL;
 
-    child = upnp_entry_new (ut, name, file, entry, st_ptr->st_size, false);
-    if (child)
-      upnp_entry_add_child (ut, entry, child);
+    child = upnp_entry_new (ut, list, name, file, entry, st_ptr->st_size, false, id);
+    if (!child)
+      return -1;
+    child->mtime = st_ptr->st_mtime;
+
+    upnp_entry_add_child (list, entry, child);
 
     return child->id;
   }
@@ -594,7 +798,7 @@ metadata_add_file (struct ushare_t *ut, struct upnp_entry_t *entry,
 }
 
 static void
-metadata_add_container (struct ushare_t *ut,
+metadata_add_container (struct ushare_t *ut, struct metadata_list_t *list,
                         struct upnp_entry_t *entry, const char *container)
 {
   struct dirent **namelist = NULL;
@@ -614,6 +818,8 @@ metadata_add_container (struct ushare_t *ut,
     return;
   }
 
+  upnp_entry_reserve_childs (entry, n);
+
   for (i = 0; i < n; i++)
   {
     struct _stat64 st;
@@ -669,117 +875,1194 @@ metadata_add_container (struct ushare_t *ut,
     {
       struct upnp_entry_t *child = NULL;
 
-      child = upnp_entry_new (ut, namelist[i]->d_name,
-                              fullpath, entry, 0, true);
+      child = upnp_entry_new (ut, list, namelist[i]->d_name,
+                              fullpath, entry, 0, true, -1);
       if (child)
       {
-        metadata_add_container (ut, child, fullpath);
-        upnp_entry_add_child (ut, entry, child);
+        child->mtime = st.st_mtime;
+        metadata_add_container (ut, list, child, fullpath);
+        upnp_entry_add_child (list, entry, child);
       }
     }
     else
 	{
 		if (S_ISREG (st.st_mode))
-			metadata_add_file (ut, entry, fullpath, namelist[i]->d_name, &st);
+			metadata_add_file (ut, list, entry, fullpath, namelist[i]->d_name, &st, -1);
 	}
 
     free (namelist[i]);
     free (fullpath);
   }
   free (namelist);
+
+  upnp_audio_set_covers (entry);
 }
 
-void
-free_metadata_list (struct ushare_t *ut)
+/* Remove entry and all of its children from the RB lookup tree */
+static void
+upnp_entry_remove_lookup (struct metadata_list_t *list,
+                          struct upnp_entry_t *entry)
 {
-  ut->init = 0;
-  if (ut->root_entry)
-    upnp_entry_free (ut, ut->root_entry);
-  ut->root_entry = NULL;
-  ut->nr_entries = 0;
+  struct upnp_entry_lookup_t *lk, entry_lookup;
+  struct upnp_entry_t **childs;
+
+  for (childs = entry->childs; *childs; childs++)
+    upnp_entry_remove_lookup (list, *childs);
 
-  if (ut->rb)
+  if (metadata_ids_has (list->ids, entry->id))
   {
-    rbdestroy (ut->rb);
-    ut->rb = NULL;
+    struct upnp_entry_t **slot;
+
+    slot = metadata_ids_slot (list->ids, entry->id, false);
+    if (slot && *slot == entry)
+      *slot = NULL;
+    list->nr_entries--;
+    return;
   }
 
-  ut->rb = rbinit (rb_compare, NULL);
-  if (!ut->rb)
-    log_error (_("Cannot create RB tree for lookups\n"));
+  entry_lookup.id = entry->id;
+  pthread_mutex_lock (&metadata_lookup_lock);
+  lk = (struct upnp_entry_lookup_t *) rbfind ((void *) &entry_lookup, list->rb);
+  if (lk && lk->entry_ptr == entry)
+    rbdelete ((void *) lk, list->rb);
+  else
+    lk = NULL;
+  pthread_mutex_unlock (&metadata_lookup_lock);
+
+  if (lk)
+    free (lk);
+  list->nr_entries--;
 }
 
-void
-build_metadata_list (struct ushare_t *ut)
+static const char *
+upnp_entry_name (const struct upnp_entry_t *entry)
 {
-  int i;
-  log_info (_("Building Metadata List ...\n"));
-
-  /* build root entry */
-  if (!ut->root_entry)
-    ut->root_entry = upnp_entry_new (ut, "root", NULL, NULL, -1, true);
-
-  /* add files from content directory */
-  for (i=0 ; i < ut->contentlist->count ; i++)
-  {
-    struct upnp_entry_t *entry = NULL;
-    char *title = NULL;
-    int size = 0;
-	char * strContent = NULL;
+  const char *s;
 
-	// trim the string
-	{
-		char const * const szContent = ut->contentlist->content[i];
-		size_t lencontent = (strlen(szContent) +1) * sizeof(char *);
-		char * strDirBuf = (char *) malloc(lencontent);
-		size_t outlen = trimwhitespace(strDirBuf,lencontent,szContent);
-		strContent = strDirBuf;
-	}
+  if (!entry->name)
+    return "";
 
-	// replace \\ with /
-	{
-		size_t lencontent = (strlen(strContent) +1) * sizeof(char *);
-		char * strDirBuf = (char *) malloc(lencontent);
-		size_t p = 0;
+  s = strrchr (entry->name, '/');
+  return s ? s + 1 : entry->name;
+}
 
-		memset(strDirBuf,'\0',lencontent);
+static int
+upnp_entry_compare_name (const void *pa, const void *pb)
+{
+  const struct upnp_entry_t *a = *(const struct upnp_entry_t **) pa;
+  const struct upnp_entry_t *b = *(const struct upnp_entry_t **) pb;
 
-		for (; p < lencontent; p++)
-		{
-			if (strContent[p] == '\\')
-				strDirBuf[p] = '/';
-			else
-				strDirBuf[p] = strContent[p];
-		}
-		free (strContent);
-		strContent = strDirBuf;
-	}
+  return strcmp (upnp_entry_name (a), upnp_entry_name (b));
+}
 
-    log_info (_("Looking for files in content directory : %s\n"),
-              strContent);
+/* Look for a not yet reused child called name in the sorted childs list */
+static struct upnp_entry_t *
+metadata_find_child (struct upnp_entry_t **sorted, bool *used, int count,
+                     const char *name, bool dir)
+{
+  struct upnp_entry_t key, *key_ptr = &key, **found;
+  int i;
 
-    size = strlen (strContent);
-    if (strContent[size - 1] == '/') strContent[size - 1] = '\0';
-    title = strrchr (strContent, '/');
-    if (title)
-      title++;
-    else
-    {
-      /* directly use content directory name if no '/' before basename */
-      title = ut->contentlist->content[i];
-    }
+  key.name = (char *) name;
+  found = (struct upnp_entry_t **)
+    bsearch (&key_ptr, sorted, count, sizeof (*sorted),
+             upnp_entry_compare_name);
+  if (!found)
+    return NULL;
 
-    entry = upnp_entry_new (ut, title, strContent,
-                            ut->root_entry, -1, true);
+  /* several entries may share a name, start from the first one */
+  for (i = found - sorted; i > 0; i--)
+    if (strcmp (upnp_entry_name (sorted[i - 1]), name))
+      break;
 
-    if (!entry)
+  for (; i < count && !strcmp (upnp_entry_name (sorted[i]), name); i++)
+  {
+    if (used[i] || ((sorted[i]->child_count >= 0) != dir))
       continue;
-    upnp_entry_add_child (ut, ut->root_entry, entry);
-    metadata_add_container (ut, entry, strContent);
+
+    used[i] = true;
+    return sorted[i];
   }
 
-  log_info (_("Found %d files and subdirectories.\n"), ut->nr_entries);
-  ut->init = 1;
+  return NULL;
+}
+
+static void
+metadata_garbage_add (struct metadata_garbage_t **garbage,
+                      void (*free_fn) (void *data), void *data)
+{
+  struct metadata_garbage_t *g;
+
+  g = (struct metadata_garbage_t *) malloc (sizeof (struct metadata_garbage_t));
+  if (!g)
+    return;
+
+  g->free_fn = free_fn;
+  g->data = data;
+  g->next = *garbage;
+  *garbage = g;
+}
+
+/*
+ * metadata_drop_didl : forget the DIDL-Lite fragment cached for entry,
+ *  once something it shows has changed. Readers may still be copying it.
+ */
+static void
+metadata_drop_didl (struct upnp_entry_t *entry,
+                    struct metadata_garbage_t **garbage)
+{
+  struct didl_fragment_t *didl;
+
+  didl = (struct didl_fragment_t *) metadata_exchange (&entry->didl, NULL);
+  if (didl)
+    metadata_garbage_add (garbage, free, didl);
+}
+
+/* Arena bytes held by entry and its children, about */
+static size_t
+upnp_entry_arena_size (const struct upnp_entry_t *entry)
+{
+  struct upnp_entry_t **childs;
+  size_t size = sizeof (struct upnp_entry_t);
+
+  if (entry->name)
+    size += strlen (entry->name) + 1;
+  if (entry->title)
+    size += strlen (entry->title) + 1;
+  if (entry->url)
+    size += strlen (entry->url) + 1;
+
+  for (childs = entry->childs; *childs; childs++)
+    size += upnp_entry_arena_size (*childs);
+
+  return size;
+}
+
+/*
+ * metadata_rescan_container : update the children of a single container
+ *  after a change notification. Entries still on disk are kept along with
+ *  their ID, new ones are added and vanished ones are removed from the
+ *  RB lookup tree. The new childs list is built aside and swapped in at
+ *  once, everything readers may still be walking goes to garbage.
+ */
+static int
+metadata_rescan_container (struct ushare_t *ut, struct metadata_list_t *list,
+                           struct upnp_entry_t *entry,
+                           struct metadata_garbage_t **garbage)
+{
+  struct upnp_entry_t *tmp, **childs, **sorted;
+  struct upnp_sort_t *sorts;
+  int *covers;
+  char path[PATH_MAX];
+  struct dirent **namelist = NULL;
+  ssize_t n = 0, i = 0;
+  int nr_old, added = 0, removed = 0, modified = 0;
+  bool *used;
+  struct _stat64 st;
+  time_t mtime;
+  int res;
+
+  if (!ut || !entry || entry->child_count < 0
+      || upnp_entry_get_path (entry, path, sizeof (path)) < 0)
+    return -1;
+
+  /* its date goes along with its listing, in the metadata index : taken
+     first, it can't be newer than the listing */
+  mtime = entry->mtime;
+#ifdef _WIN32
+  {
+    wchar_t *wFilename = (wchar_t *) malloc ((PATH_MAX + 1) * sizeof (wchar_t));
+    _snwprintf (wFilename, PATH_MAX, L"%hs", path);
+    res = _wstat64 (wFilename, &st);
+    free (wFilename);
+  }
+#else
+  res = _stat64 (path, &st);
+#endif
+  if (res == 0)
+    mtime = st.st_mtime;
+
+#ifdef _WIN32
+  n = scandir (path, &namelist, 0, NULL);
+#else
+  n = scandir (path, &namelist, 0, alphasort);
+#endif
+  if (n < 0)
+  {
+    perror ("scandir");
+    return -1;
+  }
+
+  nr_old = entry->child_count;
+
+  sorted = (struct upnp_entry_t **)
+    malloc ((nr_old + 1) * sizeof (struct upnp_entry_t *));
+  used = (bool *) calloc (nr_old + 1, sizeof (bool));
+  covers = (int *) malloc ((nr_old + 1) * sizeof (int));
+  if (!sorted || !used || !covers)
+  {
+    for (i = 0; i < n; i++)
+      free (namelist[i]);
+    free (namelist);
+    free (covers);
+    free (used);
+    free (sorted);
+    return -1;
+  }
+  memcpy (sorted, entry->childs, nr_old * sizeof (struct upnp_entry_t *));
+  qsort (sorted, nr_old, sizeof (*sorted), upnp_entry_compare_name);
+  /* to tell which of the kept items get another cover */
+  for (i = 0; i < nr_old; i++)
+    covers[i] = sorted[i]->cover_id;
+
+  /* start over from an empty list so that children are put back
+     in scandir() order, as a full rebuild would do */
+  /* new children point to it until they are moved to entry, and readers
+     of the previous version may still follow that pointer : it goes to
+     garbage along with that version */
+  tmp = (struct upnp_entry_t *) malloc (sizeof (struct upnp_entry_t));
+  if (tmp)
+  {
+    memcpy (tmp, entry, sizeof (struct upnp_entry_t));
+    tmp->didl = NULL;
+    tmp->http_info = NULL;
+    tmp->sorts = NULL;
+    tmp->childs = upnp_entry_no_childs;
+    tmp->child_count = 0;
+    tmp->child_capacity = 0;
+  }
+  /* readers may still index the new list with the previous count, see
+     upnp_entry_get_childs () : make it at least as large */
+  if (!tmp || !upnp_entry_reserve_childs (tmp, n > nr_old ? n : nr_old))
+  {
+    for (i = 0; i < n; i++)
+      free (namelist[i]);
+    free (namelist);
+    free (tmp);
+    free (covers);
+    free (used);
+    free (sorted);
+    return -1;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    struct upnp_entry_t *child = NULL;
+    char *fullpath = NULL;
+
+    if (namelist[i]->d_name[0] == '.')
+    {
+      free (namelist[i]);
+      continue;
+    }
+
+    fullpath = (char *)
+      malloc (strlen (path) + strlen (namelist[i]->d_name) + 2);
+    sprintf (fullpath, "%s/%s", path, namelist[i]->d_name);
+
+#ifdef _WIN32
+    {
+      wchar_t *wFilename = (wchar_t *) malloc ((PATH_MAX + 1) * sizeof (wchar_t));
+      _snwprintf (wFilename, PATH_MAX, L"%hs", fullpath);
+      res = _wstat64 (wFilename, &st);
+      free (wFilename);
+    }
+#else
+    res = _stat64 (fullpath, &st);
+#endif
+
+    if (res < 0 || (!S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode)))
+    {
+      free (namelist[i]);
+      free (fullpath);
+      continue;
+    }
+
+    child = metadata_find_child (sorted, used, nr_old, namelist[i]->d_name,
+                                 S_ISDIR (st.st_mode) ? true : false);
+    if (child)
+    {
+      /* subdirectories are monitored on their own, and update their
+         date when they are rescanned */
+      if (!S_ISDIR (st.st_mode)
+          && (child->size != st.st_size || child->mtime != st.st_mtime))
+      {
+        child->size = st.st_size;
+        child->mtime = st.st_mtime;
+        metadata_drop_didl (child, garbage);
+        modified++;
+      }
+      upnp_entry_append_child (tmp, child);
+    }
+    else if (S_ISDIR (st.st_mode))
+    {
+      child = upnp_entry_new (ut, list, namelist[i]->d_name,
+                              fullpath, entry, 0, true, -1);
+      if (child)
+      {
+        child->mtime = st.st_mtime;
+        metadata_add_container (ut, list, child, fullpath);
+        upnp_entry_add_child (list, tmp, child);
+        added++;
+      }
+    }
+    else if (metadata_add_file (ut, list, tmp, fullpath,
+                                namelist[i]->d_name, &st, -1) >= 0)
+      added++;
+
+    free (namelist[i]);
+    free (fullpath);
+  }
+  free (namelist);
+
+  upnp_audio_set_covers (tmp);
+  for (i = 0; i < nr_old; i++)
+    if (used[i] && sorted[i]->cover_id != covers[i])
+    {
+      /* shows upnp:albumArtURI */
+      metadata_drop_didl (sorted[i], garbage);
+      modified++;
+    }
+  free (covers);
+  for (childs = tmp->childs; *childs; childs++)
+    (*childs)->parent = entry;
+  memset (tmp->childs + tmp->child_count, 0,
+          (tmp->child_capacity - tmp->child_count)
+          * sizeof (struct upnp_entry_t *));
+
+  /* sorted lists are only dropped here, before any reader can see the
+     new list, so that none of them may ever be taken for one of it */
+  sorts = (struct upnp_sort_t *) metadata_exchange (&entry->sorts, NULL);
+  if (sorts)
+    metadata_garbage_add (garbage, upnp_sort_free, sorts);
+
+  /* publish the complete list before readers can see its new size */
+  if (entry->childs != upnp_entry_no_childs)
+    metadata_garbage_add (garbage, free, entry->childs);
+  metadata_barrier ();
+  entry->childs = tmp->childs;
+  entry->child_capacity = tmp->child_capacity;
+  metadata_barrier ();
+  entry->child_count = tmp->child_count;
+  if (tmp->child_count != nr_old)
+    metadata_drop_didl (entry, garbage); /* shows childCount */
+  if (entry->mtime != mtime)
+  {
+    entry->mtime = mtime;
+    metadata_drop_didl (entry, garbage);
+    modified++;
+  }
+  metadata_garbage_add (garbage, free, tmp);
+
+  for (i = 0; i < nr_old; i++)
+  {
+    if (used[i])
+      continue;
+
+    upnp_entry_remove_lookup (list, sorted[i]);
+    list->dead += upnp_entry_arena_size (sorted[i]);
+    metadata_garbage_add (garbage, upnp_entry_free, sorted[i]);
+    removed++;
+  }
+
+  free (used);
+  free (sorted);
+
+  if (ut->verbose)
+    log_verbose ("Rescanned %s : %d added, %d removed\n",
+                 path, added, removed);
+
+  if (!added && !removed && !modified)
+    return 0;
+
+  entry->update_id = list->update_id;
+  return 1;
+}
+
+/* Free the whole entries tree of a version, the root included */
+static void
+metadata_list_free_tree (struct ushare_t *ut, struct metadata_list_t *list)
+{
+  struct upnp_entry_lookup_t *lk = NULL;
+  RBLIST *rblist;
+  int c;
+
+  /* only childs lists and monitors are left, the rest is in the arena */
+  upnp_entry_free (list->root_entry);
+  list->root_entry = NULL;
+
+  if (list->ids)
+  {
+    for (c = 0; c < METADATA_IDS_MAX_CHUNKS; c++)
+      if (list->ids->chunks[c])
+        free (list->ids->chunks[c]);
+
+    free (list->ids);
+    list->ids = NULL;
+  }
+
+  if (list->rb)
+  {
+    rblist = rbopenlist (list->rb);
+    while ((lk = (struct upnp_entry_lookup_t *) rbreadlist (rblist)))
+      free (lk); /* delete the lookup */
+    rbcloselist (rblist);
+    rbdestroy (list->rb);
+    list->rb = NULL;
+  }
+
+  if (ut->verbose)
+    log_verbose ("Freed [%d] entries, %lu bytes\n", list->nr_entries,
+                 (unsigned long) arena_size (list->arena));
+  arena_free (list->arena);
+  list->arena = NULL;
+}
+
+static struct metadata_list_t *
+metadata_list_new (struct ushare_t *ut, struct metadata_list_t *previous)
+{
+  struct metadata_list_t *list;
+
+  list = (struct metadata_list_t *) malloc (sizeof (struct metadata_list_t));
+  if (!list)
+    return NULL;
+
+  list->refcount = 0;
+  list->owns_tree = true;
+  list->garbage = NULL;
+  list->search_index = NULL;
+  list->updated = NULL;
+  list->nr_updated = 0;
+  list->next = NULL;
+
+  if (previous)
+  {
+    /* same tree, the previous version won't free it anymore */
+    list->root_entry = previous->root_entry;
+    list->ids = previous->ids;
+    list->arena = previous->arena;
+    list->rb = previous->rb;
+    list->nr_entries = previous->nr_entries;
+    list->dead = previous->dead;
+    list->generation = previous->generation + 1;
+    list->update_id = previous->update_id;
+    previous->owns_tree = false;
+  }
+  else
+  {
+    list->root_entry = NULL;
+    list->nr_entries = 0;
+    list->dead = 0;
+    list->generation = 0;
+    list->update_id = 0;
+    list->ids = (struct metadata_ids_t *)
+      calloc (1, sizeof (struct metadata_ids_t));
+    list->rb = rbinit (rb_compare, NULL);
+    list->arena = arena_new (METADATA_ARENA_SLAB_SIZE);
+    if (!list->ids || !list->rb || !list->arena)
+    {
+      log_error (_("Cannot create RB tree for lookups\n"));
+      if (list->ids)
+        free (list->ids);
+      if (list->rb)
+        rbdestroy (list->rb);
+      arena_free (list->arena);
+      free (list);
+      return NULL;
+    }
+    list->ids->base = ut->starting_id;
+  }
+
+  return list;
+}
+
+static void
+metadata_list_free (struct ushare_t *ut, struct metadata_list_t *list)
+{
+  while (list->garbage)
+  {
+    struct metadata_garbage_t *g = list->garbage;
+
+    list->garbage = g->next;
+    g->free_fn (g->data);
+    free (g);
+  }
+
+  search_index_free (list->search_index);
+  if (list->updated)
+    free (list->updated);
+
+  if (list->owns_tree)
+    metadata_list_free_tree (ut, list);
+
+  free (list);
+}
+
+/* Free the retired versions no reader is looking at anymore. Versions
+   are released oldest first, as newer ones may share entries with them */
+static void
+metadata_list_reclaim (struct ushare_t *ut)
+{
+  struct metadata_list_t *drained = NULL, **last = &drained;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  while (ut->retired && ut->retired->refcount == 0)
+  {
+    *last = ut->retired;
+    last = &ut->retired->next;
+    ut->retired = ut->retired->next;
+  }
+  *last = NULL;
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  while (drained)
+  {
+    struct metadata_list_t *next = drained->next;
+
+    metadata_list_free (ut, drained);
+    drained = next;
+  }
+}
+
+/* Make list the current version, the previous one is retired along with
+   garbage, i.e. what it may still reference but the new one doesn't */
+static void
+metadata_list_publish (struct ushare_t *ut, struct metadata_list_t *list,
+                       struct metadata_garbage_t *garbage)
+{
+  struct metadata_list_t *old, **last;
+
+  metadata_barrier ();
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  old = ut->metadata;
+  ut->metadata = list;
+  if (old)
+  {
+    old->garbage = garbage;
+    old->next = NULL;
+    for (last = &ut->retired; *last; last = &(*last)->next)
+      ;
+    *last = old;
+  }
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  metadata_list_reclaim (ut);
+}
+
+/* Pin the current version of the media list, NULL if there's none */
+struct metadata_list_t *
+metadata_list_get (struct ushare_t *ut)
+{
+  struct metadata_list_t *list;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  list = ut->metadata;
+  if (list)
+    list->refcount++;
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  return list;
+}
+
+void
+metadata_list_put (struct ushare_t *ut, struct metadata_list_t *list)
+{
+  bool retired;
+
+  if (!list)
+    return;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  list->refcount--;
+  retired = (list->refcount == 0 && list != ut->metadata);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  if (retired)
+    metadata_list_reclaim (ut);
+}
+
+/*
+ * upnp_entry_copy : copy entry and everything below it into the arena of
+ *  list, with the same IDs. What is only cached on the entries is left
+ *  behind, and so are the monitors, see upnp_entry_move_monitors ().
+ */
+static struct upnp_entry_t *
+upnp_entry_copy (struct metadata_list_t *list, struct upnp_entry_t *entry,
+                 struct upnp_entry_t *parent)
+{
+  struct upnp_entry_t *copy, **childs;
+
+  copy = (struct upnp_entry_t *)
+    arena_alloc (list->arena, sizeof (struct upnp_entry_t));
+  if (!copy)
+    return NULL;
+
+  memcpy (copy, entry, sizeof (struct upnp_entry_t));
+  copy->name = arena_strdup (list->arena, entry->name);
+  copy->title = arena_strdup (list->arena, entry->title);
+  copy->url = arena_strdup (list->arena, entry->url);
+  if ((entry->name && !copy->name) || (entry->title && !copy->title)
+      || (entry->url && !copy->url))
+    return NULL;
+
+  copy->parent = parent;
+  copy->child_count = entry->child_count < 0 ? -1 : 0;
+  copy->child_capacity = 0;
+  copy->linked = false;
+  copy->childs = upnp_entry_no_childs;
+  copy->didl = NULL;
+  copy->http_info = NULL;
+  copy->sorts = NULL;
+#ifdef HAVE_FAM
+  copy->ufam_entry = NULL;
+#endif /* HAVE_FAM */
+
+  if (entry->child_count <= 0)
+    return copy;
+
+  if (!upnp_entry_reserve_childs (copy, entry->child_count))
+    return NULL;
+
+  for (childs = entry->childs; *childs; childs++)
+  {
+    struct upnp_entry_t *child;
+
+    child = upnp_entry_copy (list, *childs, copy);
+    if (!child)
+    {
+      upnp_entry_free (copy);
+      return NULL;
+    }
+    upnp_entry_add_child (list, copy, child);
+    list->nr_entries++;
+  }
+
+  return copy;
+}
+
+#ifdef HAVE_FAM
+/* Hand the monitors of the entries below entry over to their copies */
+static void
+upnp_entry_move_monitors (struct upnp_entry_t *entry,
+                          struct upnp_entry_t *copy)
+{
+  struct upnp_entry_t **childs, **copies;
+
+  copy->ufam_entry = entry->ufam_entry;
+  if (copy->ufam_entry)
+    copy->ufam_entry->entry = copy;
+  entry->ufam_entry = NULL;
+
+  for (childs = entry->childs, copies = copy->childs; *childs && *copies;
+       childs++, copies++)
+    upnp_entry_move_monitors (*childs, *copies);
+}
+#endif /* HAVE_FAM */
+
+/*
+ * metadata_list_compact : publish a copy of the current version in a
+ *  new arena, leaving the memory of removed entries behind. IDs, and the
+ *  SystemUpdateID, stay the same.
+ *  note: must be called with ut->update_lock held
+ */
+static void
+metadata_list_compact (struct ushare_t *ut)
+{
+  struct metadata_list_t *list, *current = ut->metadata;
+
+  if (!current || !current->root_entry)
+    return;
+
+  list = metadata_list_new (ut, NULL);
+  if (!list)
+    return;
+
+  list->generation = current->generation + 1;
+  list->update_id = current->update_id;
+  list->root_entry = upnp_entry_copy (list, current->root_entry, NULL);
+  if (!list->root_entry)
+  {
+    log_error (_("Cannot compact the media list\n"));
+    metadata_list_free (ut, list);
+    return;
+  }
+
+#ifdef HAVE_FAM
+  /* the old tree no longer removes them when it is freed */
+  upnp_entry_move_monitors (current->root_entry, list->root_entry);
+#endif /* HAVE_FAM */
+
+  if (ut->verbose)
+    log_verbose ("Compacted the media list from %lu to %lu bytes\n",
+                 (unsigned long) arena_size (current->arena),
+                 (unsigned long) arena_size (list->arena));
+
+  metadata_list_publish (ut, list, NULL);
+}
+
+/*
+ * metadata_index_save : save the entries of list as the metadata index,
+ *  so that they keep their ID after a restart
+ *  note: must be called with update_lock held
+ */
+static void
+metadata_index_save (struct ushare_t *ut, struct metadata_list_t *list)
+{
+  int next_id = ut->index_next_id;
+
+  if (!ut->index_file || !list || !list->root_entry)
+    return;
+
+  if (ut->next_id > next_id)
+    next_id = ut->next_id + METADATA_INDEX_ID_RESERVE;
+
+  if (metaindex_save_entries (ut->index_file, list->root_entry,
+                              ut->starting_id, next_id) < 0)
+    return;
+
+  ut->index_next_id = next_id;
+  ut->index_dirty = false;
+}
+
+/*
+ * metadata_save_index : save the metadata index, if entries have changed
+ *  since it was last saved
+ */
+void
+metadata_save_index (struct ushare_t *ut)
+{
+  if (!ut)
+    return;
+
+  pthread_mutex_lock (&ut->update_lock);
+  if (ut->index_dirty)
+    metadata_index_save (ut, ut->metadata);
+  pthread_mutex_unlock (&ut->update_lock);
+}
+
+/*
+ * metadata_rescan_all : rescan every container of the current version,
+ *  e.g. when change notifications have been lost. Unlike
+ *  build_metadata_list (), entries still on disk keep their ID.
+ */
+int
+metadata_rescan_all (struct ushare_t *ut)
+{
+  struct metadata_list_t *list;
+  struct upnp_entry_t **stack = NULL;
+  int *ids = NULL, nr_ids = 0, size = 0, depth = 0, res;
+  bool failed = false;
+
+  if (!ut)
+    return -1;
+
+  list = metadata_list_get (ut);
+  if (!list || !list->root_entry)
+  {
+    metadata_list_put (ut, list);
+    return -1;
+  }
+
+  /* parents first, their rescan may remove subdirectories */
+  stack = (struct upnp_entry_t **) malloc (sizeof (struct upnp_entry_t *));
+  if (stack)
+    stack[depth++] = list->root_entry;
+  else
+    failed = true;
+
+  while (depth > 0 && !failed)
+  {
+    struct upnp_entry_t *entry = stack[--depth], **childs;
+    int count;
+
+    childs = upnp_entry_get_childs (entry, &count);
+    if (nr_ids + count > size || depth + count > size)
+    {
+      int *i;
+      struct upnp_entry_t **s;
+
+      size = 2 * (size + count);
+      i = (int *) realloc (ids, size * sizeof (int));
+      if (i)
+        ids = i;
+      s = (struct upnp_entry_t **)
+        realloc (stack, size * sizeof (struct upnp_entry_t *));
+      if (s)
+        stack = s;
+      if (!i || !s)
+      {
+        failed = true;
+        break;
+      }
+    }
+
+    for (; *childs; childs++)
+      if ((*childs)->child_count >= 0)
+      {
+        ids[nr_ids++] = (*childs)->id;
+        stack[depth++] = *childs;
+      }
+  }
+
+  if (failed)
+  {
+    log_error (_("Cannot list the containers to rescan\n"));
+    free (stack);
+    free (ids);
+    metadata_list_put (ut, list);
+    return -1;
+  }
+  free (stack);
+  metadata_list_put (ut, list);
+
+  res = metadata_rescan_containers (ut, ids, nr_ids);
+  free (ids);
+
+  return res;
+}
+
+/*
+ * metadata_rescan_containers : rescan the given containers and publish
+ *  the result as a new version of the media list
+ */
+int
+metadata_rescan_containers (struct ushare_t *ut, const int *ids, int count)
+{
+  struct metadata_garbage_t *garbage = NULL;
+  struct metadata_list_t *list;
+  int i, res = 0, updated = 0;
+  bool compact;
+
+  if (!ut || !ids)
+    return -1;
+
+  pthread_mutex_lock (&ut->update_lock);
+
+  if (!ut->metadata)
+  {
+    pthread_mutex_unlock (&ut->update_lock);
+    return -1;
+  }
+
+  list = metadata_list_new (ut, ut->metadata);
+  if (!list)
+  {
+    pthread_mutex_unlock (&ut->update_lock);
+    return -1;
+  }
+
+  /* containers that have changed are given the next SystemUpdateID */
+  list->update_id++;
+  if (count > 0)
+    list->updated = (int *) malloc (count * sizeof (int));
+
+  for (i = 0; i < count; i++)
+  {
+    struct upnp_entry_t *entry;
+    int changed;
+
+    /* may be gone along with a parent rescanned first */
+    entry = upnp_get_entry (list, ids[i]);
+    if (!entry)
+      continue;
+    changed = metadata_rescan_container (ut, list, entry, &garbage);
+    if (changed < 0)
+      res = -1;
+    else if (changed)
+    {
+      updated++;
+      if (list->updated)
+        list->updated[list->nr_updated++] = entry->id;
+    }
+  }
+
+  if (!updated)
+    list->update_id--;
+  else
+    ut->index_dirty = true;
+
+  /* the rest waits for metadata_save_index (), new IDs can't */
+  if (ut->next_id > ut->index_next_id)
+    metadata_index_save (ut, list);
+
+  compact = list->dead >= METADATA_ARENA_DEAD_MIN
+    && list->dead > arena_size (list->arena) / 2;
+
+  metadata_list_publish (ut, list, garbage);
+  if (updated)
+    cds_notify_update (list);
+
+  if (compact)
+    metadata_list_compact (ut);
+
+  pthread_mutex_unlock (&ut->update_lock);
+
+  return res;
+}
+
+void
+free_metadata_list (struct ushare_t *ut)
+{
+  pthread_mutex_lock (&ut->update_lock);
+  if (ut->index_dirty)
+    metadata_index_save (ut, ut->metadata);
+  ut->init = 0;
+  metadata_list_publish (ut, NULL, NULL);
+  pthread_mutex_unlock (&ut->update_lock);
+}
+
+static void
+metadata_merge_container (struct ushare_t *ut, struct metadata_list_t *list,
+                          struct upnp_entry_t *entry, struct scan_dir_t *dir)
+{
+  int i;
+
+  if (!entry || !dir)
+    return;
+
+  upnp_entry_reserve_childs (entry, dir->nr_files);
+
+  /* walk the listing in scandir() order, the very same way
+     metadata_add_container () does, so that IDs match a serial scan */
+  for (i = 0; i < dir->nr_files; i++)
+  {
+    struct scan_file_t *file = &dir->files[i];
+    char *fullpath = NULL;
+
+    fullpath = (char *) malloc (strlen (dir->path) + strlen (file->name) + 2);
+    sprintf (fullpath, "%s/%s", dir->path, file->name);
+
+    if (ut->verbose)
+      log_verbose ("%s\n", fullpath);
+
+    if (file->dir)
+    {
+      struct upnp_entry_t *child = NULL;
+
+      child = upnp_entry_new (ut, list, file->name, fullpath, entry, 0, true,
+                              file->subdir ? file->subdir->id : -1);
+      if (child)
+      {
+        child->mtime = file->mtime;
+        /* remember the ID for the metadata index */
+        if (file->subdir)
+          file->subdir->id = child->id;
+        metadata_merge_container (ut, list, child, file->subdir);
+        upnp_entry_add_child (list, entry, child);
+      }
+    }
+    else
+    {
+      struct _stat64 st;
+
+      memset (&st, 0, sizeof (st));
+      st.st_size = file->size;
+      st.st_mtime = file->mtime;
+      file->id = metadata_add_file (ut, list, entry, fullpath, file->name, &st,
+                                    file->id);
+    }
+
+    free (fullpath);
+  }
+
+  upnp_audio_set_covers (entry);
+}
+
+/* Trim the content directory name, use '/' as separator
+   and strip the trailing one */
+static char *
+metadata_content_path (const char *content)
+{
+  char *path, *s;
+  size_t len;
+
+  len = strlen (content) + 1;
+  path = (char *) malloc (len);
+  if (!path)
+    return NULL;
+
+  trimwhitespace (path, len, content);
+
+  for (s = path; *s; s++)
+    if (*s == '\\')
+      *s = '/';
+
+  len = strlen (path);
+  if (len && path[len - 1] == '/')
+    path[len - 1] = '\0';
+
+  return path;
+}
+
+void
+build_metadata_list (struct ushare_t *ut)
+{
+  struct metadata_list_t *list = NULL;
+  struct metaindex_t *index = NULL;
+  struct scan_dir_t **dirs = NULL;
+  char **paths = NULL;
+  int i, count;
+
+  log_info (_("Building Metadata List ...\n"));
+
+  pthread_mutex_lock (&ut->update_lock);
+
+  /* the new list gets its IDs from there */
+  if (ut->index_dirty)
+    metadata_index_save (ut, ut->metadata);
+
+  /* the new list is built aside, readers keep on using the current one
+     until it gets published */
+  list = metadata_list_new (ut, NULL);
+  if (!list)
+  {
+    pthread_mutex_unlock (&ut->update_lock);
+    return;
+  }
+
+  count = ut->contentlist->count;
+  if (count > 0)
+  {
+    paths = (char **) malloc (count * sizeof (char *));
+    /* listing all content directories at once using the scanner threads,
+       the tree itself is then built serially to keep IDs deterministic */
+    if (paths && (ut->scan_threads > 1 || ut->index_file))
+      dirs = (struct scan_dir_t **)
+        calloc (count, sizeof (struct scan_dir_t *));
+    if (!paths || (!dirs && (ut->scan_threads > 1 || ut->index_file)))
+    {
+      log_error (_("Cannot allocate the content directories list\n"));
+      if (paths)
+        free (paths);
+      metadata_list_free (ut, list);
+      pthread_mutex_unlock (&ut->update_lock);
+      return;
+    }
+  }
+
+  if (ut->metadata)
+  {
+    list->generation = ut->metadata->generation + 1;
+    list->update_id = ut->metadata->update_id + 1;
+  }
+  ut->next_id = ut->starting_id;
+
+  /* build root entry */
+  list->root_entry = upnp_entry_new (ut, list, "root", NULL, NULL, -1, true, -1);
+
+  if (count <= 0)
+  {
+    metadata_list_publish (ut, list, NULL);
+    ut->init = 1;
+    pthread_mutex_unlock (&ut->update_lock);
+    return;
+  }
+
+  for (i = 0 ; i < count ; i++)
+    paths[i] = metadata_content_path (ut->contentlist->content[i]);
+
+  if (dirs)
+  {
+    index = metaindex_load (ut->index_file, ut->starting_id);
+    if (index && metaindex_next_id (index) > ut->next_id)
+      ut->next_id = metaindex_next_id (index);
+
+    for (i = 0 ; i < count ; i++)
+    {
+      int j;
+
+      dirs[i] = scan_dir_new (paths[i]);
+      if (!dirs[i] || !index)
+        continue;
+
+      /* a content directory shared twice must not reuse the same IDs */
+      for (j = 0; j < i; j++)
+        if (paths[j] && !strcmp (paths[j], paths[i]))
+          break;
+      if (j < i)
+        continue;
+
+      dirs[i]->cached = metaindex_find (index, NULL, paths[i]);
+      if (dirs[i]->cached)
+        dirs[i]->id = dirs[i]->cached->id;
+    }
+
+    if (ut->verbose)
+      log_verbose ("Scanning content directories using %d threads\n",
+                   ut->scan_threads);
+    scanner_run (dirs, count, ut->scan_threads, index);
+
+    /* listings hold their own copy of everything restored from the index */
+    metaindex_free (index);
+  }
+
+  /* add files from content directory */
+  for (i = 0 ; i < count ; i++)
+  {
+    struct upnp_entry_t *entry = NULL;
+    char *title = NULL;
+
+    if (!paths[i])
+      continue;
+
+    log_info (_("Looking for files in content directory : %s\n"), paths[i]);
+
+    title = strrchr (paths[i], '/');
+    if (title)
+      title++;
+    else
+    {
+      /* directly use content directory name if no '/' before basename */
+      title = ut->contentlist->content[i];
+    }
+
+    entry = upnp_entry_new (ut, list, title, paths[i], list->root_entry, -1, true,
+                            dirs && dirs[i] ? dirs[i]->id : -1);
+
+    if (!entry)
+      continue;
+    upnp_entry_add_child (list, list->root_entry, entry);
+
+    if (dirs && dirs[i])
+    {
+      dirs[i]->id = entry->id;
+      entry->mtime = dirs[i]->mtime;
+    }
+
+    if (dirs)
+      metadata_merge_container (ut, list, entry, dirs[i]);
+    else
+      metadata_add_container (ut, list, entry, paths[i]);
+  }
+
+  if (dirs && ut->index_file
+      && metaindex_save (ut->index_file, dirs, count,
+                         ut->starting_id, ut->next_id) == 0)
+  {
+    ut->index_next_id = ut->next_id;
+    ut->index_dirty = false;
+  }
+
+  for (i = 0 ; i < count ; i++)
+  {
+    if (dirs)
+      scan_dir_free (dirs[i]);
+    if (paths[i])
+      free (paths[i]);
+  }
+  if (dirs)
+    free (dirs);
+  free (paths);
+
+  log_info (_("Found %d files and subdirectories.\n"), list->nr_entries);
+
+  metadata_list_publish (ut, list, NULL);
+  if (list->update_id)
+    cds_notify_update (list);
+  ut->init = 1;
+
+  pthread_mutex_unlock (&ut->update_lock);
 }
 
 #ifdef _MSC_VER
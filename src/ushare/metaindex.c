@@ -0,0 +1,584 @@
+/*
+ * metaindex.c : GeeXboX uShare persistent metadata index.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "ushare.h"
+#include "metadata.h"
+#include "scanner.h"
+#include "metaindex.h"
+#include "gettext.h"
+#include "trace.h"
+
+#define METAINDEX_TMP_SUFFIX ".tmp"
+
+struct metaindex_t {
+  char *data;
+  size_t len;
+  bool mapped;
+  const struct metaindex_header_t *header;
+  const struct metaindex_record_t *records;
+  const char *strings;
+  uint32_t *hash; /* record index + 1, 0 for an empty slot */
+  uint32_t hash_mask;
+};
+
+static uint32_t
+metaindex_hash (int32_t parent, const char *name)
+{
+  uint32_t h = 2166136261U ^ (uint32_t) parent;
+
+  while (*name)
+  {
+    h ^= (unsigned char) *name++;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static bool
+metaindex_build_hash (struct metaindex_t *index)
+{
+  uint32_t size = 1, i;
+
+  while (size < 2 * index->header->nr_records)
+    size <<= 1;
+
+  index->hash = (uint32_t *) calloc (size, sizeof (uint32_t));
+  if (!index->hash)
+    return false;
+  index->hash_mask = size - 1;
+
+  for (i = 0; i < index->header->nr_records; i++)
+  {
+    const struct metaindex_record_t *r = &index->records[i];
+    uint32_t h = metaindex_hash (r->parent, index->strings + r->name);
+
+    while (index->hash[h & index->hash_mask])
+      h++;
+    index->hash[h & index->hash_mask] = i + 1;
+  }
+
+  return true;
+}
+
+static bool
+metaindex_check (struct metaindex_t *index, int starting_id)
+{
+  const struct metaindex_header_t *header;
+  size_t len;
+  uint32_t i;
+
+  if (index->len < sizeof (struct metaindex_header_t))
+    return false;
+
+  header = index->header;
+  len = index->len - sizeof (struct metaindex_header_t);
+
+  if (memcmp (header->magic, METAINDEX_MAGIC, sizeof (header->magic))
+      || header->version != METAINDEX_VERSION
+      || header->starting_id != starting_id
+      || header->nr_roots > header->nr_records
+      || header->strings_len == 0)
+    return false;
+
+  /* bounded first, the product can't overflow a 32 bits size_t then */
+  if (header->nr_records > len / sizeof (struct metaindex_record_t))
+    return false;
+  len -= (size_t) header->nr_records * sizeof (struct metaindex_record_t);
+  if (len != header->strings_len)
+    return false;
+
+  index->strings = (const char *) (index->records + header->nr_records);
+
+  if (index->strings[header->strings_len - 1] != '\0')
+    return false;
+
+  for (i = 0; i < header->nr_records; i++)
+  {
+    const struct metaindex_record_t *r = &index->records[i];
+
+    if (r->name >= header->strings_len
+        || r->parent >= (int32_t) header->nr_records
+        || r->first_child > header->nr_records
+        || r->nr_childs > header->nr_records - r->first_child
+        || r->id >= header->next_id)
+      return false;
+  }
+
+  return true;
+}
+
+struct metaindex_t *
+metaindex_load (const char *filename, int starting_id)
+{
+  struct metaindex_t *index = NULL;
+
+  if (!filename)
+    return NULL;
+
+  index = (struct metaindex_t *) malloc (sizeof (struct metaindex_t));
+  if (!index)
+    return NULL;
+
+  index->data = NULL;
+  index->len = 0;
+  index->mapped = false;
+  index->hash = NULL;
+
+#ifdef _WIN32
+  {
+    FILE *f = fopen (filename, "rb");
+    long len;
+
+    if (!f)
+    {
+      free (index);
+      return NULL;
+    }
+
+    fseek (f, 0, SEEK_END);
+    len = ftell (f);
+    fseek (f, 0, SEEK_SET);
+
+    if (len > 0)
+      index->data = (char *) malloc (len);
+    if (!index->data || fread (index->data, 1, len, f) != (size_t) len)
+    {
+      fclose (f);
+      metaindex_free (index);
+      return NULL;
+    }
+    index->len = len;
+    fclose (f);
+  }
+#else
+  {
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open (filename, O_RDONLY);
+    if (fd < 0)
+    {
+      free (index);
+      return NULL;
+    }
+
+    if (fstat (fd, &st) < 0 || st.st_size <= 0)
+    {
+      close (fd);
+      free (index);
+      return NULL;
+    }
+
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED)
+    {
+      free (index);
+      return NULL;
+    }
+
+    index->data = (char *) data;
+    index->len = st.st_size;
+    index->mapped = true;
+  }
+#endif
+
+  index->header = (const struct metaindex_header_t *) index->data;
+  index->records = (const struct metaindex_record_t *)
+    (index->data + sizeof (struct metaindex_header_t));
+  index->strings = NULL; /* once the header is known to be there */
+
+  if (!metaindex_check (index, starting_id) || !metaindex_build_hash (index))
+  {
+    log_info (_("Ignoring invalid metadata index %s\n"), filename);
+    metaindex_free (index);
+    return NULL;
+  }
+
+  log_info (_("Loaded metadata index %s (%d entries)\n"),
+            filename, index->header->nr_records);
+
+  return index;
+}
+
+void
+metaindex_free (struct metaindex_t *index)
+{
+  if (!index)
+    return;
+
+  if (index->data)
+  {
+#ifndef _WIN32
+    if (index->mapped)
+      munmap (index->data, index->len);
+    else
+#endif
+      free (index->data);
+  }
+
+  if (index->hash)
+    free (index->hash);
+  free (index);
+}
+
+int
+metaindex_next_id (const struct metaindex_t *index)
+{
+  return index ? index->header->next_id : 0;
+}
+
+const char *
+metaindex_name (const struct metaindex_t *index,
+                const struct metaindex_record_t *record)
+{
+  return index->strings + record->name;
+}
+
+const struct metaindex_record_t *
+metaindex_child (const struct metaindex_t *index,
+                 const struct metaindex_record_t *record, uint32_t n)
+{
+  if (n >= record->nr_childs)
+    return NULL;
+
+  return &index->records[record->first_child + n];
+}
+
+const struct metaindex_record_t *
+metaindex_find (const struct metaindex_t *index,
+                const struct metaindex_record_t *parent, const char *name)
+{
+  int32_t p;
+  uint32_t h, slot;
+
+  if (!index || !name)
+    return NULL;
+
+  p = parent ? (int32_t) (parent - index->records) : -1;
+
+  for (h = metaindex_hash (p, name); (slot = index->hash[h & index->hash_mask]);
+       h++)
+  {
+    const struct metaindex_record_t *r = &index->records[slot - 1];
+
+    if (r->parent == p && !strcmp (index->strings + r->name, name))
+      return r;
+  }
+
+  return NULL;
+}
+
+/* Write the index to a temporary file, then put it in place at once */
+static int
+metaindex_write (const char *filename,
+                 const struct metaindex_header_t *header,
+                 const struct metaindex_record_t *records,
+                 const char *strings)
+{
+  char *tmpfile;
+  FILE *f;
+  int res = -1;
+
+  tmpfile = (char *) malloc (strlen (filename)
+                             + strlen (METAINDEX_TMP_SUFFIX) + 1);
+  if (!tmpfile)
+    return -1;
+  sprintf (tmpfile, "%s%s", filename, METAINDEX_TMP_SUFFIX);
+
+  f = fopen (tmpfile, "wb");
+  if (!f)
+  {
+    log_error (_("Cannot write metadata index %s\n"), tmpfile);
+    free (tmpfile);
+    return -1;
+  }
+
+  if (fwrite (header, sizeof (struct metaindex_header_t), 1, f) != 1
+      || fwrite (records, sizeof (struct metaindex_record_t),
+                 header->nr_records, f) != header->nr_records
+      || fwrite (strings, 1, header->strings_len, f) != header->strings_len)
+  {
+    log_error (_("Cannot write metadata index %s\n"), tmpfile);
+    fclose (f);
+    remove (tmpfile);
+    free (tmpfile);
+    return -1;
+  }
+  fclose (f);
+
+  /* atomically replace the previous index */
+#ifdef _WIN32
+  remove (filename);
+#endif
+  if (rename (tmpfile, filename) < 0)
+  {
+    perror ("rename");
+    remove (tmpfile);
+  }
+  else
+    res = 0;
+
+  free (tmpfile);
+
+  return res;
+}
+
+static void
+metaindex_count (struct scan_dir_t *dir, uint32_t *nr_records,
+                 uint32_t *strings_len)
+{
+  int i;
+
+  for (i = 0; i < dir->nr_files; i++)
+  {
+    (*nr_records)++;
+    *strings_len += strlen (dir->files[i].name) + 1;
+    if (dir->files[i].subdir)
+      metaindex_count (dir->files[i].subdir, nr_records, strings_len);
+  }
+}
+
+int
+metaindex_save (const char *filename, struct scan_dir_t **dirs,
+                int nr_dirs, int starting_id, int next_id)
+{
+  struct metaindex_header_t header;
+  struct metaindex_record_t *records = NULL;
+  struct scan_dir_t **listings = NULL;
+  char *strings = NULL;
+  uint32_t nr_records = 0, strings_len = 0, next, i;
+  int d, res = -1;
+
+  if (!filename || !dirs)
+    return -1;
+
+  memset (&header, 0, sizeof (header));
+  for (d = 0; d < nr_dirs; d++)
+  {
+    if (!dirs[d])
+      continue;
+    header.nr_roots++;
+    strings_len += strlen (dirs[d]->path) + 1;
+    metaindex_count (dirs[d], &nr_records, &strings_len);
+  }
+  nr_records += header.nr_roots;
+
+  memcpy (header.magic, METAINDEX_MAGIC, sizeof (header.magic));
+  header.version = METAINDEX_VERSION;
+  header.nr_records = nr_records;
+  header.strings_len = strings_len;
+  header.starting_id = starting_id;
+  header.next_id = next_id;
+
+  records = (struct metaindex_record_t *)
+    calloc (nr_records ? nr_records : 1, sizeof (struct metaindex_record_t));
+  listings = (struct scan_dir_t **)
+    calloc (nr_records ? nr_records : 1, sizeof (struct scan_dir_t *));
+  strings = (char *) malloc (strings_len ? strings_len : 1);
+  if (!records || !listings || !strings)
+    goto end;
+
+  /* content directories first, identified by their full path */
+  strings_len = 0;
+  for (d = 0, next = 0; d < nr_dirs; d++)
+  {
+    if (!dirs[d])
+      continue;
+
+    records[next].id = dirs[d]->id;
+    records[next].parent = -1;
+    records[next].mtime = dirs[d]->mtime;
+    records[next].flags = METAINDEX_FLAG_DIR;
+    records[next].name = strings_len;
+    strcpy (strings + strings_len, dirs[d]->path);
+    strings_len += strlen (dirs[d]->path) + 1;
+    listings[next++] = dirs[d];
+  }
+
+  /* then every listing, breadth first, so that siblings are contiguous */
+  for (i = 0; i < next; i++)
+  {
+    struct scan_dir_t *dir = listings[i];
+    int j;
+
+    if (!dir)
+      continue;
+
+    records[i].first_child = next;
+    records[i].nr_childs = dir->nr_files;
+
+    for (j = 0; j < dir->nr_files; j++)
+    {
+      struct scan_file_t *file = &dir->files[j];
+      struct metaindex_record_t *r = &records[next];
+
+      r->parent = i;
+      r->size = file->size;
+      r->mtime = file->mtime;
+      r->name = strings_len;
+      strcpy (strings + strings_len, file->name);
+      strings_len += strlen (file->name) + 1;
+
+      if (file->dir)
+      {
+        r->flags = METAINDEX_FLAG_DIR;
+        r->id = file->subdir ? file->subdir->id : -1;
+        listings[next] = file->subdir;
+      }
+      else
+        r->id = file->id;
+
+      next++;
+    }
+  }
+
+  res = metaindex_write (filename, &header, records, strings);
+
+ end:
+  if (records)
+    free (records);
+  if (listings)
+    free (listings);
+  if (strings)
+    free (strings);
+
+  return res;
+}
+
+static void
+metaindex_count_entries (const struct upnp_entry_t *entry,
+                         uint32_t *nr_records, uint32_t *strings_len)
+{
+  struct upnp_entry_t **childs;
+
+  for (childs = entry->childs; *childs; childs++)
+  {
+    (*nr_records)++;
+    *strings_len += strlen ((*childs)->name) + 1;
+    if ((*childs)->child_count >= 0)
+      metaindex_count_entries (*childs, nr_records, strings_len);
+  }
+}
+
+/*
+ * metaindex_save_entries : save the entries below root, the way
+ *  metaindex_save () saves the listings they were built from, so that
+ *  those added by rescans keep their ID across restarts too. Files that
+ *  aren't shared aren't saved : should they be after a restart, they only
+ *  show up once their directory changes.
+ *  note: the tree must not change meanwhile
+ */
+int
+metaindex_save_entries (const char *filename,
+                        const struct upnp_entry_t *root,
+                        int starting_id, int next_id)
+{
+  struct metaindex_header_t header;
+  struct metaindex_record_t *records = NULL;
+  const struct upnp_entry_t **entries = NULL;
+  struct upnp_entry_t **childs;
+  char *strings = NULL;
+  uint32_t nr_records = 0, strings_len = 0, next, i;
+  int res = -1;
+
+  if (!filename || !root)
+    return -1;
+
+  memset (&header, 0, sizeof (header));
+  /* content directories, named by their full path, are the roots */
+  metaindex_count_entries (root, &nr_records, &strings_len);
+  for (childs = root->childs; *childs; childs++)
+    header.nr_roots++;
+
+  memcpy (header.magic, METAINDEX_MAGIC, sizeof (header.magic));
+  header.version = METAINDEX_VERSION;
+  header.nr_records = nr_records;
+  header.strings_len = strings_len;
+  header.starting_id = starting_id;
+  header.next_id = next_id;
+
+  records = (struct metaindex_record_t *)
+    calloc (nr_records ? nr_records : 1, sizeof (struct metaindex_record_t));
+  entries = (const struct upnp_entry_t **)
+    calloc (nr_records ? nr_records : 1, sizeof (struct upnp_entry_t *));
+  strings = (char *) malloc (strings_len ? strings_len : 1);
+  if (!records || !entries || !strings)
+    goto end;
+
+  /* the roots are the first children, then every listing breadth first,
+     so that siblings are contiguous */
+  strings_len = 0;
+  for (i = 0, next = 0; i <= next && next < nr_records; i++)
+  {
+    const struct upnp_entry_t *dir = i ? entries[i - 1] : root;
+
+    if (dir->child_count < 0)
+      continue;
+
+    if (i)
+    {
+      records[i - 1].first_child = next;
+      records[i - 1].nr_childs = dir->child_count;
+    }
+
+    for (childs = dir->childs; *childs; childs++)
+    {
+      struct metaindex_record_t *r = &records[next];
+      const struct upnp_entry_t *e = *childs;
+
+      r->parent = i ? (int32_t) (i - 1) : -1;
+      r->id = e->id;
+      r->mtime = e->mtime;
+      r->size = e->child_count < 0 ? e->size : 0;
+      r->flags = e->child_count < 0 ? 0 : METAINDEX_FLAG_DIR;
+      r->name = strings_len;
+      strcpy (strings + strings_len, e->name);
+      strings_len += strlen (e->name) + 1;
+      entries[next++] = e;
+    }
+  }
+
+  res = metaindex_write (filename, &header, records, strings);
+
+ end:
+  if (records)
+    free (records);
+  if (entries)
+    free ((void *) entries);
+  if (strings)
+    free (strings);
+
+  return res;
+}
@@ -0,0 +1,406 @@
+/*
+ * prefetch.c : GeeXboX uShare media prefetcher.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+#include "gettext.h"
+#include "trace.h"
+#include "prefetch.h"
+
+#define PREFETCH_ALIGN 4096
+
+enum prefetch_state_t {
+  PREFETCH_FREE,
+  PREFETCH_QUEUED,  /* waiting for a thread of the pool */
+  PREFETCH_READING, /* being read, by a thread of the pool */
+  PREFETCH_READY
+};
+
+struct prefetch_chunk_t {
+  struct prefetch_t *prefetch;
+  enum prefetch_state_t state;
+  off_t offset;
+  ssize_t len; /* bytes read, short at the end of the file */
+  int error;   /* errno of the read, if it failed */
+  char *data;
+  struct prefetch_chunk_t *next; /* in the queue of the pool */
+};
+
+struct prefetch_t {
+  int fd;
+  struct prefetch_chunk_t *chunks; /* the ring */
+  int nr_chunks;
+  int head;  /* chunk holding the next bytes of the stream */
+  int count; /* chunks in use, from head */
+  off_t next; /* offset of the chunk to queue after them */
+  char *buffers;
+  pthread_cond_t done; /* signaled as chunks are read */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_t threads[PREFETCH_THREADS];
+  int nr_threads;
+  bool stop;
+  size_t size; /* budget of a stream */
+  size_t max;  /* budget of them all */
+  size_t used;
+  struct prefetch_chunk_t *queue;
+  struct prefetch_chunk_t *queue_tail;
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * prefetch_thread: read the queued chunks, oldest first
+ */
+static void *
+prefetch_thread (void *arg __attribute__ ((unused)))
+{
+  pthread_mutex_lock (&pool.lock);
+
+  while (true)
+  {
+    struct prefetch_chunk_t *chunk;
+    ssize_t n, len = 0;
+
+    while (!pool.stop && !pool.queue)
+      pthread_cond_wait (&pool.work, &pool.lock);
+    if (pool.stop)
+      break;
+
+    chunk = pool.queue;
+    pool.queue = chunk->next;
+    if (!pool.queue)
+      pool.queue_tail = NULL;
+    chunk->state = PREFETCH_READING;
+    pthread_mutex_unlock (&pool.lock);
+
+    /* the chunk and its stream are left alone while READING. A short
+       chunk means the end of the file, network filesystems may return
+       less than asked for anywhere else : read on until it's full */
+    do
+    {
+      n = pread (chunk->prefetch->fd, chunk->data + len,
+                 PREFETCH_CHUNK_SIZE - len, chunk->offset + len);
+      if (n > 0)
+        len += n;
+    }
+    while ((n > 0 && len < PREFETCH_CHUNK_SIZE) || (n < 0 && errno == EINTR));
+
+    pthread_mutex_lock (&pool.lock);
+    chunk->len = n < 0 ? n : len;
+    chunk->error = n < 0 ? errno : 0;
+    chunk->state = PREFETCH_READY;
+    pthread_cond_broadcast (&chunk->prefetch->done);
+  }
+
+  pthread_mutex_unlock (&pool.lock);
+
+  return NULL;
+}
+
+/*
+ * prefetch_start: start the pool, with a budget for each stream and
+ *  one for all of them (in KB), 0 to read streams directly
+ */
+int
+prefetch_start (int size, int max)
+{
+  int i;
+
+  pthread_mutex_lock (&pool.lock);
+
+  if (pool.nr_threads || size <= 0 || max <= 0)
+  {
+    pthread_mutex_unlock (&pool.lock);
+    return 0;
+  }
+
+  pool.size = (size_t) size * 1024;
+  pool.max = (size_t) max * 1024;
+  pool.stop = false;
+
+  for (i = 0; i < PREFETCH_THREADS; i++)
+  {
+    if (pthread_create (&pool.threads[i], NULL, prefetch_thread, NULL))
+    {
+      perror ("Failed to create thread");
+      break;
+    }
+    pool.nr_threads++;
+  }
+
+  pthread_mutex_unlock (&pool.lock);
+
+  return pool.nr_threads ? 0 : -1;
+}
+
+/*
+ * prefetch_stop: stop the pool, once every stream has been freed
+ */
+void
+prefetch_stop (void)
+{
+  int i, nr_threads;
+
+  pthread_mutex_lock (&pool.lock);
+  pool.stop = true;
+  pthread_cond_broadcast (&pool.work);
+  nr_threads = pool.nr_threads;
+  pool.nr_threads = 0;
+  pthread_mutex_unlock (&pool.lock);
+
+  for (i = 0; i < nr_threads; i++)
+    pthread_join (pool.threads[i], NULL);
+}
+
+/*
+ * prefetch_new: return a ring of chunks to read fd through, NULL if
+ *  there's no room left for it
+ */
+struct prefetch_t *
+prefetch_new (int fd)
+{
+  struct prefetch_t *prefetch;
+  size_t size;
+  void *buffers;
+  int i, nr_chunks;
+
+  pthread_mutex_lock (&pool.lock);
+  if (!pool.nr_threads || pool.used >= pool.max)
+  {
+    pthread_mutex_unlock (&pool.lock);
+    return NULL;
+  }
+
+  /* as much as the budget of the stream, and what's left of the total */
+  size = pool.max - pool.used < pool.size ? pool.max - pool.used : pool.size;
+  nr_chunks = size / PREFETCH_CHUNK_SIZE;
+  if (nr_chunks < PREFETCH_MIN_CHUNKS)
+  {
+    pthread_mutex_unlock (&pool.lock);
+    return NULL;
+  }
+  size = (size_t) nr_chunks * PREFETCH_CHUNK_SIZE;
+  pool.used += size;
+  pthread_mutex_unlock (&pool.lock);
+
+  prefetch = malloc (sizeof (struct prefetch_t));
+  if (prefetch)
+    prefetch->chunks = calloc (nr_chunks, sizeof (struct prefetch_chunk_t));
+
+  /* aligned, for the kernel to copy whole pages */
+  if (!prefetch || !prefetch->chunks
+      || posix_memalign (&buffers, PREFETCH_ALIGN, size))
+  {
+    if (prefetch)
+    {
+      free (prefetch->chunks);
+      free (prefetch);
+    }
+    pthread_mutex_lock (&pool.lock);
+    pool.used -= size;
+    pthread_mutex_unlock (&pool.lock);
+    return NULL;
+  }
+
+  prefetch->fd = fd;
+  prefetch->nr_chunks = nr_chunks;
+  prefetch->head = 0;
+  prefetch->count = 0;
+  prefetch->next = 0;
+  prefetch->buffers = buffers;
+  pthread_cond_init (&prefetch->done, NULL);
+
+  for (i = 0; i < nr_chunks; i++)
+  {
+    prefetch->chunks[i].prefetch = prefetch;
+    prefetch->chunks[i].state = PREFETCH_FREE;
+    prefetch->chunks[i].data = prefetch->buffers
+      + (size_t) i * PREFETCH_CHUNK_SIZE;
+  }
+
+  return prefetch;
+}
+
+/*
+ * prefetch_fill: queue chunks until the ring is full
+ *  note: must be called with pool.lock held
+ */
+static void
+prefetch_fill (struct prefetch_t *prefetch)
+{
+  while (prefetch->count < prefetch->nr_chunks)
+  {
+    struct prefetch_chunk_t *chunk = &prefetch->chunks
+      [(prefetch->head + prefetch->count) % prefetch->nr_chunks];
+
+    chunk->state = PREFETCH_QUEUED;
+    chunk->offset = prefetch->next;
+    chunk->next = NULL;
+    if (pool.queue_tail)
+      pool.queue_tail->next = chunk;
+    else
+      pool.queue = chunk;
+    pool.queue_tail = chunk;
+
+    prefetch->next += PREFETCH_CHUNK_SIZE;
+    prefetch->count++;
+  }
+
+  pthread_cond_broadcast (&pool.work);
+}
+
+/*
+ * prefetch_reset: drop every chunk of the ring, the stream goes on
+ *  from pos
+ *  note: must be called with pool.lock held
+ */
+static void
+prefetch_reset (struct prefetch_t *prefetch, off_t pos)
+{
+  struct prefetch_chunk_t **c, *last = NULL;
+  int i;
+
+  /* the queued chunks are just taken back... */
+  for (c = &pool.queue; *c; )
+    if ((*c)->prefetch == prefetch)
+      *c = (*c)->next;
+    else
+    {
+      last = *c;
+      c = &(*c)->next;
+    }
+  pool.queue_tail = last;
+
+  /* ...but those being read are waited for */
+  for (i = 0; i < prefetch->nr_chunks; i++)
+  {
+    while (prefetch->chunks[i].state == PREFETCH_READING)
+      pthread_cond_wait (&prefetch->done, &pool.lock);
+    prefetch->chunks[i].state = PREFETCH_FREE;
+  }
+
+  prefetch->head = 0;
+  prefetch->count = 0;
+  prefetch->next = pos - pos % PREFETCH_CHUNK_SIZE;
+}
+
+/*
+ * prefetch_read: read the stream at pos, from the chunk holding it
+ */
+ssize_t
+prefetch_read (struct prefetch_t *prefetch, off_t pos, char *buf, size_t len)
+{
+  struct prefetch_chunk_t *chunk;
+  size_t n;
+
+  pthread_mutex_lock (&pool.lock);
+
+  while (true)
+  {
+    chunk = prefetch->count ? &prefetch->chunks[prefetch->head] : NULL;
+
+    /* anything else than reading on is a seek */
+    if (!chunk || pos < chunk->offset
+        || pos > chunk->offset + PREFETCH_CHUNK_SIZE)
+    {
+      prefetch_reset (prefetch, pos);
+      prefetch_fill (prefetch);
+      continue;
+    }
+
+    while (chunk->state != PREFETCH_READY)
+      pthread_cond_wait (&prefetch->done, &pool.lock);
+
+    if (chunk->len < 0)
+    {
+      /* don't keep the error, the next read tries again */
+      int error = chunk->error;
+
+      prefetch_reset (prefetch, pos);
+      pthread_mutex_unlock (&pool.lock);
+      errno = error;
+      return -1;
+    }
+
+    if (pos < chunk->offset + chunk->len)
+      break;
+
+    if (chunk->len < PREFETCH_CHUNK_SIZE)
+    {
+      /* end of file, for now: the file may still grow */
+      prefetch_reset (prefetch, pos);
+      pthread_mutex_unlock (&pool.lock);
+      return 0;
+    }
+
+    /* done with this chunk, read the next one in its place */
+    chunk->state = PREFETCH_FREE;
+    prefetch->head = (prefetch->head + 1) % prefetch->nr_chunks;
+    prefetch->count--;
+    prefetch_fill (prefetch);
+  }
+
+  pthread_mutex_unlock (&pool.lock);
+
+  /* a READY chunk is only ever changed by the reader of the stream */
+  n = chunk->offset + chunk->len - pos;
+  if (n > len)
+    n = len;
+  memcpy (buf, chunk->data + (pos - chunk->offset), n);
+
+  return n;
+}
+
+/*
+ * prefetch_free: free the ring, once its chunks are no longer read
+ */
+void
+prefetch_free (struct prefetch_t *prefetch)
+{
+  if (!prefetch)
+    return;
+
+  pthread_mutex_lock (&pool.lock);
+  prefetch_reset (prefetch, 0);
+  pool.used -= (size_t) prefetch->nr_chunks * PREFETCH_CHUNK_SIZE;
+  pthread_mutex_unlock (&pool.lock);
+
+  pthread_cond_destroy (&prefetch->done);
+  free (prefetch->buffers);
+  free (prefetch->chunks);
+  free (prefetch);
+}
+
+#endif /* _WIN32 */
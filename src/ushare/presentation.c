@@ -100,10 +100,7 @@ process_cgi (struct ushare_t *ut, char *cgiargs)
     refresh = 1;
 
   if (refresh && ut->contentlist)
-  {
-    free_metadata_list (ut);
     build_metadata_list (ut);
-  }
 
   if (ut->presentation)
     buffer_free (ut->presentation);
@@ -128,6 +125,7 @@ process_cgi (struct ushare_t *ut, char *cgiargs)
 int
 build_presentation_page (struct ushare_t *ut)
 {
+  struct metadata_list_t *list;
   int i;
   char *mycodeset = NULL;
 
@@ -171,8 +169,11 @@ build_presentation_page (struct ushare_t *ut)
   buffer_append (ut->presentation, "</tr>");
   buffer_appendf (ut->presentation, "<b>%s :</b> %s<br/>",
                   _("Device UDN"), ut->udn);
+  list = metadata_list_get (ut);
   buffer_appendf (ut->presentation, "<b>%s :</b> %d<br/>",
-                  _("Number of shared files and directories"), ut->nr_entries);
+                  _("Number of shared files and directories"),
+                  list ? list->nr_entries : 0);
+  metadata_list_put (ut, list);
   buffer_append (ut->presentation, "</center><br/>");
 
   buffer_appendf (ut->presentation,
@@ -185,7 +186,8 @@ build_presentation_page (struct ushare_t *ut)
     buffer_appendf (ut->presentation, "<b>%s #%d :</b>", _("Share"), i + 1);
     buffer_appendf (ut->presentation,
                     "<input type=\"checkbox\" name=\""CGI_SHARE"[%d]\"/>", i);
-    buffer_appendf (ut->presentation, "%s<br/>", ut->contentlist->content[i]);
+    buffer_append_xml (ut->presentation, ut->contentlist->content[i]);
+    buffer_append (ut->presentation, "<br/>");
   }
   buffer_appendf (ut->presentation,
                  "<input type=\"submit\" value=\"%s\"/>", _("unShare!"));
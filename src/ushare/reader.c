@@ -0,0 +1,196 @@
+/*
+ * reader.c : GeeXboX uShare media file reader, with read-ahead hinting.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+
+#include "fdcache.h"
+#include "reader.h"
+
+static long long
+reader_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * reader_window: return how far ahead of its position the stream should
+ *  be read, from the rate it has been consumed at so far
+ */
+static off_t
+reader_window (const struct reader_t *reader)
+{
+  long long elapsed = reader_now () - reader->start_time;
+  long long window;
+
+  /* too early to tell, a renderer fills its own buffer first anyway */
+  if (elapsed < 1000)
+    return READER_MIN_WINDOW;
+
+  window = (long long) (reader->pos - reader->start_pos)
+    * READER_AHEAD_TIME * 1000 / elapsed;
+
+  if (window < READER_MIN_WINDOW)
+    return READER_MIN_WINDOW;
+  if (window > READER_MAX_WINDOW)
+    return READER_MAX_WINDOW;
+
+  return (off_t) window;
+}
+
+/*
+ * reader_restart: the stream goes on from pos, measure its rate from
+ *  there, what follows is fetched on the next read
+ */
+static void
+reader_restart (struct reader_t *reader, off_t pos)
+{
+  reader->pos = pos;
+  reader->ahead = pos;
+  reader->start_pos = pos;
+  reader->start_time = reader_now ();
+}
+
+/*
+ * reader_open: open the media file of entry id (-1 if none) to be read
+ *  sequentially, sharing its descriptor with the other readers of it
+ */
+int
+reader_open (struct reader_t *reader, int id, const char *path)
+{
+  reader->fd = fdcache_open (id, path);
+  if (reader->fd < 0)
+    return -1;
+
+  /* the ring is only set up on the first read, if ever */
+  reader->prefetch = NULL;
+  reader->direct = false;
+
+#ifdef HAVE_POSIX_FADVISE
+  /* lets the kernel read ahead twice as much on its own */
+  posix_fadvise (reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* HAVE_POSIX_FADVISE */
+
+  reader_restart (reader, 0);
+
+  return 0;
+}
+
+/*
+ * reader_advance: the stream is about to be read from pos, ask for the
+ *  next window once half of the current one is gone
+ */
+void
+reader_advance (struct reader_t *reader, off_t pos)
+{
+  off_t window;
+
+  reader->pos = pos;
+  window = reader_window (reader);
+  if (reader->ahead - pos > window / 2)
+    return;
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (reader->fd, reader->ahead, pos + window - reader->ahead,
+                 POSIX_FADV_WILLNEED);
+#endif /* HAVE_POSIX_FADVISE */
+  reader->ahead = pos + window;
+}
+
+/*
+ * reader_read: read the next bytes of the stream
+ */
+ssize_t
+reader_read (struct reader_t *reader, char *buf, size_t len)
+{
+  ssize_t n;
+
+  if (!reader->prefetch && !reader->direct)
+  {
+    reader->prefetch = prefetch_new (reader->fd);
+    reader->direct = !reader->prefetch;
+  }
+
+  if (reader->prefetch)
+  {
+    n = prefetch_read (reader->prefetch, reader->pos, buf, len);
+    if (n > 0)
+      reader->pos += n;
+    return n;
+  }
+
+  reader_advance (reader, reader->pos);
+
+  /* the descriptor may be shared, its own position is never used */
+  do
+    n = pread (reader->fd, buf, len, reader->pos);
+  while (n < 0 && errno == EINTR);
+
+  if (n > 0)
+    reader->pos += n;
+
+  return n;
+}
+
+/*
+ * reader_seek: go on reading the stream from pos
+ */
+int
+reader_seek (struct reader_t *reader, off_t pos)
+{
+  if (pos < 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* what was read ahead is of no use anymore, nor is the rate */
+  if (pos != reader->pos)
+    reader_restart (reader, pos);
+
+  return 0;
+}
+
+/*
+ * reader_close: close the media file
+ */
+void
+reader_close (struct reader_t *reader)
+{
+  prefetch_free (reader->prefetch);
+  reader->prefetch = NULL;
+
+  if (reader->fd >= 0)
+    fdcache_release (reader->fd);
+  reader->fd = -1;
+}
+
+#endif /* _WIN32 */
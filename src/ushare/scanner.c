@@ -0,0 +1,542 @@
+/*
+ * scanner.c : GeeXboX uShare parallel content directory scanner.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "ushare.h"
+#include "scanner.h"
+#include "metaindex.h"
+#include "trace.h"
+
+#define SCAN_QUEUE_DEFAULT_CAPACITY 64
+
+/*
+ * Each worker owns a deque of directories still to be scanned.
+ * The owner pushes and pops at the tail (depth-first, keeps the disk head
+ * close to where it just was) while idle workers steal from the head.
+ */
+struct scan_queue_t {
+  struct scan_dir_t **jobs;
+  int head;
+  int tail;
+  int capacity;
+  pthread_mutex_t lock;
+};
+
+struct scanner_t;
+
+struct scan_worker_t {
+  pthread_t thread;
+  int index;
+  struct scan_queue_t queue;
+  struct scanner_t *scanner;
+};
+
+struct scanner_t {
+  struct scan_worker_t *workers;
+  int nr_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending; /* directories queued or being scanned */
+  int queued;  /* directories queued only */
+  const struct metaindex_t *index; /* listings of the previous run */
+};
+
+struct scan_dir_t *
+scan_dir_new (const char *path)
+{
+  struct scan_dir_t *dir;
+
+  if (!path)
+    return NULL;
+
+  dir = (struct scan_dir_t *) malloc (sizeof (struct scan_dir_t));
+  if (!dir)
+    return NULL;
+
+  dir->path = _strdup (path);
+  dir->mtime = 0;
+  dir->id = -1;
+  dir->cached = NULL;
+  dir->files = NULL;
+  dir->nr_files = 0;
+
+  return dir;
+}
+
+void
+scan_dir_free (struct scan_dir_t *dir)
+{
+  int i;
+
+  if (!dir)
+    return;
+
+  for (i = 0; i < dir->nr_files; i++)
+  {
+    if (dir->files[i].name)
+      free (dir->files[i].name);
+    scan_dir_free (dir->files[i].subdir);
+  }
+
+  if (dir->files)
+    free (dir->files);
+  if (dir->path)
+    free (dir->path);
+  free (dir);
+}
+
+static int
+scanner_stat (const char *path, struct _stat64 *st)
+{
+#ifdef _WIN32
+  int res;
+  wchar_t *wFilename = (wchar_t *) malloc ((PATH_MAX + 1) * sizeof (wchar_t));
+
+  if (!wFilename)
+    return -1;
+
+  _snwprintf (wFilename, PATH_MAX, L"%hs", path);
+  res = _wstat64 (wFilename, st);
+  free (wFilename);
+
+  return res;
+#else
+  return _stat64 (path, st);
+#endif
+}
+
+static void
+scan_queue_init (struct scan_queue_t *queue)
+{
+  queue->jobs = NULL;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->capacity = 0;
+  pthread_mutex_init (&queue->lock, NULL);
+}
+
+static void
+scan_queue_destroy (struct scan_queue_t *queue)
+{
+  if (queue->jobs)
+    free (queue->jobs);
+  pthread_mutex_destroy (&queue->lock);
+}
+
+static bool
+scan_queue_push (struct scan_queue_t *queue, struct scan_dir_t *dir)
+{
+  pthread_mutex_lock (&queue->lock);
+
+  if (queue->tail == queue->capacity)
+  {
+    int n = queue->tail - queue->head;
+
+    /* reclaim the room left at the head by thieves before growing */
+    if (queue->head > 0 && n < queue->capacity / 2)
+      memmove (queue->jobs, queue->jobs + queue->head, n * sizeof (*queue->jobs));
+    else
+    {
+      int capacity = queue->capacity ?
+        2 * queue->capacity : SCAN_QUEUE_DEFAULT_CAPACITY;
+      struct scan_dir_t **jobs = (struct scan_dir_t **)
+        realloc (queue->jobs, capacity * sizeof (*queue->jobs));
+
+      if (!jobs)
+      {
+        pthread_mutex_unlock (&queue->lock);
+        return false;
+      }
+      queue->jobs = jobs;
+      queue->capacity = capacity;
+      if (queue->head > 0)
+        memmove (queue->jobs, queue->jobs + queue->head,
+                 n * sizeof (*queue->jobs));
+    }
+    queue->head = 0;
+    queue->tail = n;
+  }
+
+  queue->jobs[queue->tail++] = dir;
+
+  pthread_mutex_unlock (&queue->lock);
+
+  return true;
+}
+
+static struct scan_dir_t *
+scan_queue_pop (struct scan_queue_t *queue, bool steal)
+{
+  struct scan_dir_t *dir = NULL;
+
+  pthread_mutex_lock (&queue->lock);
+
+  if (queue->head < queue->tail)
+    dir = steal ? queue->jobs[queue->head++] : queue->jobs[--queue->tail];
+
+  pthread_mutex_unlock (&queue->lock);
+
+  return dir;
+}
+
+static void scanner_scan_dir (struct scan_worker_t *worker,
+                              struct scan_dir_t *dir);
+
+static void
+scanner_push (struct scan_worker_t *worker, struct scan_dir_t *dir)
+{
+  struct scanner_t *scanner = worker->scanner;
+
+  /* account for the job before it becomes visible, so that pending
+     can't drop to zero while it is still waiting in a queue */
+  pthread_mutex_lock (&scanner->lock);
+  scanner->pending++;
+  scanner->queued++;
+  pthread_mutex_unlock (&scanner->lock);
+
+  if (!scan_queue_push (&worker->queue, dir))
+  {
+    pthread_mutex_lock (&scanner->lock);
+    scanner->pending--;
+    scanner->queued--;
+    pthread_mutex_unlock (&scanner->lock);
+
+    /* no room left to queue it, scan it right away instead */
+    scanner_scan_dir (worker, dir);
+    return;
+  }
+
+  pthread_mutex_lock (&scanner->lock);
+  pthread_cond_signal (&scanner->cond);
+  pthread_mutex_unlock (&scanner->lock);
+}
+
+static struct scan_dir_t *
+scanner_next (struct scan_worker_t *worker)
+{
+  struct scanner_t *scanner = worker->scanner;
+  struct scan_dir_t *dir;
+  int i;
+
+  while (true)
+  {
+    dir = scan_queue_pop (&worker->queue, false);
+
+    /* nothing left on our own, try to steal from our neighbours */
+    for (i = 1; !dir && i < scanner->nr_workers; i++)
+      dir = scan_queue_pop (&scanner->workers[(worker->index + i)
+                                              % scanner->nr_workers].queue,
+                            true);
+
+    pthread_mutex_lock (&scanner->lock);
+    if (dir)
+    {
+      scanner->queued--;
+      pthread_mutex_unlock (&scanner->lock);
+      return dir;
+    }
+
+    while (scanner->pending > 0 && scanner->queued == 0)
+      pthread_cond_wait (&scanner->cond, &scanner->lock);
+
+    if (scanner->pending == 0)
+    {
+      pthread_mutex_unlock (&scanner->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock (&scanner->lock);
+  }
+}
+
+static struct scan_dir_t *
+scanner_new_subdir (struct scan_worker_t *worker, const char *fullpath,
+                    time_t mtime, const struct metaindex_record_t *cached)
+{
+  struct scan_dir_t *subdir;
+
+  subdir = scan_dir_new (fullpath);
+  if (!subdir)
+    return NULL;
+
+  subdir->mtime = mtime;
+  if (cached && (cached->flags & METAINDEX_FLAG_DIR))
+  {
+    subdir->id = cached->id;
+    subdir->cached = cached;
+  }
+  scanner_push (worker, subdir);
+
+  return subdir;
+}
+
+/* Fill the listing from the index when the directory hasn't been modified
+   since it was saved : only subdirectories still need to be stat'ed. */
+static bool
+scanner_restore_dir (struct scan_worker_t *worker, struct scan_dir_t *dir)
+{
+  const struct metaindex_t *index = worker->scanner->index;
+  const struct metaindex_record_t *cached = dir->cached;
+  uint32_t i;
+
+  if (!index || !cached || cached->mtime != (long long) dir->mtime)
+    return false;
+
+  if (cached->nr_childs > 0)
+  {
+    dir->files = (struct scan_file_t *)
+      malloc (cached->nr_childs * sizeof (struct scan_file_t));
+    if (!dir->files)
+    {
+      /* nor could a listing of it be, don't even try */
+      log_error ("Failed to allocate the listing of %s, skipping it\n",
+                 dir->path);
+      return true;
+    }
+  }
+
+  for (i = 0; i < cached->nr_childs; i++)
+  {
+    const struct metaindex_record_t *r = metaindex_child (index, cached, i);
+    struct scan_file_t *file = &dir->files[dir->nr_files];
+    const char *name = metaindex_name (index, r);
+
+    file->name = _strdup (name);
+    file->dir = (r->flags & METAINDEX_FLAG_DIR) ? true : false;
+    file->size = (ssize_t) r->size;
+    file->mtime = (time_t) r->mtime;
+    file->id = file->dir ? -1 : r->id;
+    file->subdir = NULL;
+
+    if (file->dir)
+    {
+      struct _stat64 st;
+      char *fullpath;
+
+      fullpath = (char *) malloc (strlen (dir->path) + strlen (name) + 2);
+      sprintf (fullpath, "%s/%s", dir->path, name);
+
+      if (scanner_stat (fullpath, &st) < 0 || !S_ISDIR (st.st_mode))
+      {
+        free (file->name);
+        free (fullpath);
+        continue;
+      }
+
+      file->mtime = st.st_mtime;
+      file->subdir = scanner_new_subdir (worker, fullpath, st.st_mtime, r);
+      free (fullpath);
+    }
+
+    dir->nr_files++;
+  }
+
+  return true;
+}
+
+static void
+scanner_scan_dir (struct scan_worker_t *worker, struct scan_dir_t *dir)
+{
+  const struct metaindex_t *index = worker->scanner->index;
+  struct dirent **namelist = NULL;
+  ssize_t n = 0, i = 0;
+
+  /* content directories don't know their own mtime yet */
+  if (!dir->mtime)
+  {
+    struct _stat64 st;
+
+    if (scanner_stat (dir->path, &st) == 0)
+      dir->mtime = st.st_mtime;
+  }
+
+  if (scanner_restore_dir (worker, dir))
+    return;
+
+#ifdef _WIN32
+  n = scandir (dir->path, &namelist, 0, NULL);
+#else
+  n = scandir (dir->path, &namelist, 0, alphasort);
+#endif
+  if (n < 0)
+  {
+    perror ("scandir");
+    return;
+  }
+
+  if (n > 0)
+  {
+    dir->files = (struct scan_file_t *) malloc (n * sizeof (struct scan_file_t));
+    if (!dir->files)
+    {
+      log_error ("Failed to allocate the listing of %s, skipping it\n",
+                 dir->path);
+      for (i = 0; i < n; i++)
+        free (namelist[i]);
+      free (namelist);
+      return;
+    }
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    const struct metaindex_record_t *cached;
+    struct scan_file_t *file;
+    struct _stat64 st;
+    char *fullpath = NULL;
+
+    if (namelist[i]->d_name[0] == '.')
+    {
+      free (namelist[i]);
+      continue;
+    }
+
+    fullpath = (char *)
+      malloc (strlen (dir->path) + strlen (namelist[i]->d_name) + 2);
+    sprintf (fullpath, "%s/%s", dir->path, namelist[i]->d_name);
+
+    if (scanner_stat (fullpath, &st) < 0
+        || (!S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode)))
+    {
+      free (namelist[i]);
+      free (fullpath);
+      continue;
+    }
+
+    /* keep the entry ID it had during the previous run */
+    cached = dir->cached ?
+      metaindex_find (index, dir->cached, namelist[i]->d_name) : NULL;
+
+    file = &dir->files[dir->nr_files++];
+    file->name = _strdup (namelist[i]->d_name);
+    file->dir = S_ISDIR (st.st_mode) ? true : false;
+    file->size = file->dir ? 0 : st.st_size;
+    file->mtime = st.st_mtime;
+    file->id = (cached && !file->dir
+                && !(cached->flags & METAINDEX_FLAG_DIR)) ? cached->id : -1;
+    file->subdir = NULL;
+
+    if (file->dir)
+      file->subdir = scanner_new_subdir (worker, fullpath, st.st_mtime, cached);
+
+    free (namelist[i]);
+    free (fullpath);
+  }
+
+  if (namelist)
+    free (namelist);
+}
+
+static void *
+scanner_thread (void *arg)
+{
+  struct scan_worker_t *worker = (struct scan_worker_t *) arg;
+  struct scanner_t *scanner = worker->scanner;
+  struct scan_dir_t *dir;
+
+  while ((dir = scanner_next (worker)) != NULL)
+  {
+    scanner_scan_dir (worker, dir);
+
+    pthread_mutex_lock (&scanner->lock);
+    if (--scanner->pending == 0)
+      pthread_cond_broadcast (&scanner->cond);
+    pthread_mutex_unlock (&scanner->lock);
+  }
+
+  return NULL;
+}
+
+int
+scanner_run (struct scan_dir_t **dirs, int nr_dirs, int nr_threads,
+             const struct metaindex_t *index)
+{
+  struct scanner_t scanner;
+  int i, started = 0;
+
+  if (!dirs || nr_dirs <= 0)
+    return -1;
+
+  if (nr_threads < 1)
+    nr_threads = 1;
+  if (nr_threads > SCANNER_MAX_THREADS)
+    nr_threads = SCANNER_MAX_THREADS;
+
+  scanner.nr_workers = nr_threads;
+  scanner.pending = 0;
+  scanner.queued = 0;
+  scanner.index = index;
+  pthread_mutex_init (&scanner.lock, NULL);
+  pthread_cond_init (&scanner.cond, NULL);
+
+  scanner.workers = (struct scan_worker_t *)
+    malloc (nr_threads * sizeof (struct scan_worker_t));
+  if (!scanner.workers)
+  {
+    pthread_cond_destroy (&scanner.cond);
+    pthread_mutex_destroy (&scanner.lock);
+    return -1;
+  }
+
+  for (i = 0; i < nr_threads; i++)
+  {
+    scanner.workers[i].index = i;
+    scanner.workers[i].scanner = &scanner;
+    scan_queue_init (&scanner.workers[i].queue);
+  }
+
+  /* spread content directories among workers */
+  for (i = 0; i < nr_dirs; i++)
+    if (dirs[i])
+      scanner_push (&scanner.workers[i % nr_threads], dirs[i]);
+
+  for (i = 0; i < nr_threads; i++)
+  {
+    if (pthread_create (&scanner.workers[i].thread, NULL,
+                        scanner_thread, &scanner.workers[i]))
+    {
+      log_error ("Failed to create scanner thread\n");
+      break;
+    }
+    started++;
+  }
+
+  /* No worker could be started : do the job ourselves */
+  if (!started)
+    scanner_thread (&scanner.workers[0]);
+
+  for (i = 0; i < started; i++)
+    pthread_join (scanner.workers[i].thread, NULL);
+
+  for (i = 0; i < nr_threads; i++)
+    scan_queue_destroy (&scanner.workers[i].queue);
+  free (scanner.workers);
+
+  pthread_cond_destroy (&scanner.cond);
+  pthread_mutex_destroy (&scanner.lock);
+
+  return 0;
+}
@@ -0,0 +1,720 @@
+/*
+ * searchindex.c : GeeXboX uShare search index.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "ushare.h"
+#include "metadata.h"
+#include "searchindex.h"
+#include "gettext.h"
+#include "trace.h"
+
+#define SEARCH_INDEX_MIN_SIZE 64
+
+/* how many Search results are kept for paging */
+#define SEARCH_CACHE_SIZE 8
+
+/* atomically replace *ptr by val if it still is old */
+#ifdef _MSC_VER
+#define search_index_compare_and_swap(ptr, old, val) \
+  (InterlockedCompareExchangePointer ((PVOID volatile *) (ptr), \
+                                      (val), (old)) == (old))
+#else
+#define search_index_compare_and_swap(ptr, old, val) \
+  __sync_bool_compare_and_swap ((ptr), (old), (val))
+#endif
+
+/* the container an ID refers to, and the ranks of everything below it */
+struct search_range_t {
+  int id;
+  int first; /* the container itself */
+  int end;
+};
+
+struct search_class_t {
+  const char *name;
+  int *ranks;
+  int count;
+  int size;
+};
+
+/*
+ * Built once per version of the media list, on its first Search, and
+ * left untouched afterwards: a rescan publishes a new version, which
+ * gets its own index.
+ */
+struct search_index_t {
+  struct upnp_entry_t **entries; /* by rank */
+  int nr_entries;
+  int size;
+  struct search_range_t *ranges; /* sorted by ID once built */
+  int nr_ranges;
+  int ranges_size;
+  struct search_class_t *classes;
+  int nr_classes;
+  /* titles, by lower case trigrams of their XML escaped form */
+  unsigned long long *pairs; /* trigram << 32 | rank, while building */
+  int nr_pairs;
+  int pairs_size;
+  unsigned int *trigrams; /* sorted */
+  int *trigram_start; /* in trigram_ranks, nr_trigrams + 1 of them */
+  int *trigram_ranks;
+  int nr_trigrams;
+  /* the latest Search results, the only part that changes */
+  pthread_mutex_t cache_lock;
+  struct search_matches_t *cache[SEARCH_CACHE_SIZE];
+  unsigned int cache_clock;
+};
+
+static void
+search_matches_free (struct search_matches_t *matches)
+{
+  if (matches->ranks)
+    free (matches->ranks);
+  free (matches->criteria);
+  free (matches);
+}
+
+/* make room for one more element in a growing array */
+static bool
+search_index_grow (void **array, int count, int *size, size_t elt_size)
+{
+  void *a;
+  int new_size;
+
+  if (count < *size)
+    return true;
+
+  new_size = *size ? 2 * *size : SEARCH_INDEX_MIN_SIZE;
+  a = realloc (*array, new_size * elt_size);
+  if (!a)
+    return false;
+
+  *array = a;
+  *size = new_size;
+
+  return true;
+}
+
+static unsigned int
+search_index_trigram (const char *s)
+{
+  return (unsigned int) tolower ((unsigned char) s[0]) << 16
+    | (unsigned int) tolower ((unsigned char) s[1]) << 8
+    | (unsigned int) tolower ((unsigned char) s[2]);
+}
+
+static bool
+search_index_add_class (struct search_index_t *index, const char *name,
+                        int rank)
+{
+  struct search_class_t *class;
+  int i;
+
+  for (i = 0; i < index->nr_classes; i++)
+    if (index->classes[i].name == name
+        || !strcmp (index->classes[i].name, name))
+      break;
+
+  if (i == index->nr_classes)
+  {
+    class = (struct search_class_t *) realloc (index->classes,
+                                                (i + 1) * sizeof (*class));
+    if (!class)
+      return false;
+    index->classes = class;
+    index->nr_classes++;
+    memset (&class[i], 0, sizeof (*class));
+    class[i].name = name;
+  }
+
+  class = &index->classes[i];
+  if (!search_index_grow ((void **) &class->ranks, class->count,
+                          &class->size, sizeof (int)))
+    return false;
+  class->ranks[class->count++] = rank;
+
+  return true;
+}
+
+static bool
+search_index_add_title (struct search_index_t *index, const char *title,
+                        int rank)
+{
+  size_t i, len = strlen (title);
+
+  for (i = 0; i + 3 <= len; i++)
+  {
+    if (!search_index_grow ((void **) &index->pairs, index->nr_pairs,
+                            &index->pairs_size, sizeof (*index->pairs)))
+      return false;
+    index->pairs[index->nr_pairs++] =
+      (unsigned long long) search_index_trigram (title + i) << 32
+      | (unsigned int) rank;
+  }
+
+  return true;
+}
+
+/* walk the tree depth first, containers before their children */
+static bool
+search_index_add (struct search_index_t *index, struct upnp_entry_t *entry)
+{
+  const char *class;
+  int rank, range;
+
+  if (!search_index_grow ((void **) &index->entries, index->nr_entries,
+                          &index->size, sizeof (*index->entries)))
+    return false;
+  rank = index->nr_entries++;
+  index->entries[rank] = entry;
+
+  class = upnp_entry_class (entry);
+  if (class && !search_index_add_class (index, class, rank))
+    return false;
+  if (entry->title && !search_index_add_title (index, entry->title, rank))
+    return false;
+
+  if (entry->child_count >= 0) /* container */
+  {
+    struct upnp_entry_t **childs;
+
+    if (!search_index_grow ((void **) &index->ranges, index->nr_ranges,
+                            &index->ranges_size, sizeof (*index->ranges)))
+      return false;
+    range = index->nr_ranges++;
+    index->ranges[range].id = entry->id;
+    index->ranges[range].first = rank;
+
+    for (childs = entry->childs; *childs; childs++)
+      if (!search_index_add (index, *childs))
+        return false;
+
+    index->ranges[range].end = index->nr_entries;
+  }
+
+  return true;
+}
+
+static int
+search_range_compare (const void *pa, const void *pb)
+{
+  const struct search_range_t *a = (const struct search_range_t *) pa;
+  const struct search_range_t *b = (const struct search_range_t *) pb;
+
+  return (a->id > b->id) - (a->id < b->id);
+}
+
+static int
+search_pair_compare (const void *pa, const void *pb)
+{
+  unsigned long long a = *(const unsigned long long *) pa;
+  unsigned long long b = *(const unsigned long long *) pb;
+
+  return (a > b) - (a < b);
+}
+
+/* turn the (trigram, rank) pairs into a posting list per trigram */
+static bool
+search_index_build_trigrams (struct search_index_t *index)
+{
+  int i, n = 0;
+
+  if (index->nr_pairs)
+    qsort (index->pairs, index->nr_pairs, sizeof (*index->pairs),
+           search_pair_compare);
+
+  /* the same trigram may appear twice in a title */
+  for (i = 0; i < index->nr_pairs; i++)
+    if (!n || index->pairs[i] != index->pairs[n - 1])
+      index->pairs[n++] = index->pairs[i];
+  index->nr_pairs = n;
+
+  index->trigrams = (unsigned int *) malloc ((n + 1) * sizeof (unsigned int));
+  index->trigram_start = (int *) malloc ((n + 1) * sizeof (int));
+  index->trigram_ranks = (int *) malloc ((n + 1) * sizeof (int));
+  if (!index->trigrams || !index->trigram_start || !index->trigram_ranks)
+    return false;
+
+  for (i = 0; i < n; i++)
+  {
+    unsigned int trigram = (unsigned int) (index->pairs[i] >> 32);
+
+    if (!index->nr_trigrams
+        || index->trigrams[index->nr_trigrams - 1] != trigram)
+    {
+      index->trigrams[index->nr_trigrams] = trigram;
+      index->trigram_start[index->nr_trigrams++] = i;
+    }
+    index->trigram_ranks[i] = (int) (index->pairs[i] & 0xffffffff);
+  }
+  index->trigram_start[index->nr_trigrams] = n;
+
+  free (index->pairs);
+  index->pairs = NULL;
+
+  return true;
+}
+
+static struct search_index_t *
+search_index_new (struct upnp_entry_t *root)
+{
+  struct search_index_t *index;
+
+  index = (struct search_index_t *) calloc (1, sizeof (struct search_index_t));
+  if (!index)
+    return NULL;
+  pthread_mutex_init (&index->cache_lock, NULL);
+
+  if (!search_index_add (index, root) || !search_index_build_trigrams (index))
+  {
+    log_error (_("Cannot build the search index\n"));
+    search_index_free (index);
+    return NULL;
+  }
+
+  qsort (index->ranges, index->nr_ranges, sizeof (*index->ranges),
+         search_range_compare);
+
+  return index;
+}
+
+/*
+ * search_index_get : index of the given version of the media list,
+ *  built the first time it's asked for
+ */
+struct search_index_t *
+search_index_get (struct metadata_list_t *list)
+{
+  struct search_index_t *index;
+
+  if (!list || !list->root_entry)
+    return NULL;
+
+  index = list->search_index;
+  if (index)
+    return index;
+
+  index = search_index_new (list->root_entry);
+  if (!index)
+    return NULL;
+
+  /* some other Search may have been faster */
+  if (!search_index_compare_and_swap (&list->search_index, NULL, index))
+  {
+    search_index_free (index);
+    index = list->search_index;
+  }
+
+  return index;
+}
+
+void
+search_index_free (struct search_index_t *index)
+{
+  int i;
+
+  if (!index)
+    return;
+
+  for (i = 0; i < SEARCH_CACHE_SIZE; i++)
+    if (index->cache[i])
+      search_matches_free (index->cache[i]);
+  pthread_mutex_destroy (&index->cache_lock);
+
+  for (i = 0; i < index->nr_classes; i++)
+    if (index->classes[i].ranks)
+      free (index->classes[i].ranks);
+  if (index->classes)
+    free (index->classes);
+  if (index->entries)
+    free (index->entries);
+  if (index->ranges)
+    free (index->ranges);
+  if (index->pairs)
+    free (index->pairs);
+  if (index->trigrams)
+    free (index->trigrams);
+  if (index->trigram_start)
+    free (index->trigram_start);
+  if (index->trigram_ranks)
+    free (index->trigram_ranks);
+  free (index);
+}
+
+struct upnp_entry_t *
+search_index_entry (const struct search_index_t *index, int rank)
+{
+  if (rank < 0 || rank >= index->nr_entries)
+    return NULL;
+
+  return index->entries[rank];
+}
+
+/*
+ * search_index_range : ranks of the container itself (first) and of what
+ *  follows its last descendant (end), false if it's not indexed
+ */
+bool
+search_index_range (const struct search_index_t *index,
+                    const struct upnp_entry_t *container, int *first, int *end)
+{
+  struct search_range_t key, *range;
+
+  key.id = container->id;
+  range = (struct search_range_t *)
+    bsearch (&key, index->ranges, index->nr_ranges, sizeof (*index->ranges),
+             search_range_compare);
+  if (!range || index->entries[range->first] != container)
+    return false;
+
+  *first = range->first;
+  *end = range->end;
+
+  return true;
+}
+
+int
+search_index_nr_classes (const struct search_index_t *index)
+{
+  return index->nr_classes;
+}
+
+/* Name of the n-th class found, set is given the entries of that class */
+const char *
+search_index_class (const struct search_index_t *index, int n,
+                    struct search_set_t *set)
+{
+  set->ranks = index->classes[n].ranks;
+  set->count = index->classes[n].count;
+  set->owned = false;
+
+  return index->classes[n].name;
+}
+
+/*
+ * search_index_lookup : cached matches of criteria below container id,
+ *  in sort order, to be given back with search_index_release ()
+ */
+struct search_matches_t *
+search_index_lookup (struct search_index_t *index, const char *criteria,
+                     int id, int sort)
+{
+  struct search_matches_t *matches = NULL;
+  int i;
+
+  pthread_mutex_lock (&index->cache_lock);
+  for (i = 0; i < SEARCH_CACHE_SIZE; i++)
+    if (index->cache[i] && index->cache[i]->id == id
+        && index->cache[i]->sort == sort
+        && !strcmp (index->cache[i]->criteria, criteria))
+    {
+      matches = index->cache[i];
+      matches->refcount++;
+      matches->last_used = ++index->cache_clock;
+      break;
+    }
+  pthread_mutex_unlock (&index->cache_lock);
+
+  return matches;
+}
+
+/*
+ * search_index_store : cache the matches of criteria below container id,
+ *  in sort order, ranks is taken over. Returns them the way
+ *  search_index_lookup () does, NULL if memory is short.
+ */
+struct search_matches_t *
+search_index_store (struct search_index_t *index, const char *criteria,
+                    int id, int sort, int *ranks, int count)
+{
+  struct search_matches_t *matches, *found;
+  int i, slot = 0;
+
+  matches = (struct search_matches_t *)
+    malloc (sizeof (struct search_matches_t));
+  if (!matches || !(matches->criteria = strdup (criteria)))
+  {
+    if (matches)
+      free (matches);
+    if (ranks)
+      free (ranks);
+    return NULL;
+  }
+  matches->id = id;
+  matches->sort = sort;
+  matches->ranks = ranks;
+  matches->count = count;
+  matches->refcount = 1;
+  matches->cached = true;
+
+  /* some other Search may have stored the very same ones meanwhile */
+  found = search_index_lookup (index, criteria, id, sort);
+  if (found)
+  {
+    search_matches_free (matches);
+    return found;
+  }
+
+  pthread_mutex_lock (&index->cache_lock);
+  for (i = 0; i < SEARCH_CACHE_SIZE; i++)
+  {
+    if (!index->cache[i])
+    {
+      slot = i;
+      break;
+    }
+    if (index->cache[i]->last_used < index->cache[slot]->last_used)
+      slot = i;
+  }
+
+  /* evict the least recently used, unless someone is still reading it */
+  if (index->cache[slot])
+  {
+    if (index->cache[slot]->refcount)
+      index->cache[slot]->cached = false;
+    else
+      search_matches_free (index->cache[slot]);
+  }
+  matches->last_used = ++index->cache_clock;
+  index->cache[slot] = matches;
+  pthread_mutex_unlock (&index->cache_lock);
+
+  return matches;
+}
+
+void
+search_index_release (struct search_index_t *index,
+                      struct search_matches_t *matches)
+{
+  bool drop;
+
+  if (!matches)
+    return;
+
+  pthread_mutex_lock (&index->cache_lock);
+  drop = (--matches->refcount == 0 && !matches->cached);
+  pthread_mutex_unlock (&index->cache_lock);
+
+  if (drop)
+    search_matches_free (matches);
+}
+
+static int
+search_index_find_trigram (const struct search_index_t *index,
+                           unsigned int trigram)
+{
+  int lo = 0, hi = index->nr_trigrams;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (index->trigrams[mid] < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < index->nr_trigrams && index->trigrams[lo] == trigram) ? lo : -1;
+}
+
+/*
+ * search_index_title : entries whose title has all trigrams of value,
+ *  case insensitive. That's a superset of the titles containing value,
+ *  to be checked one by one. Returns false if value is too short to
+ *  narrow anything down.
+ */
+bool
+search_index_title (const struct search_index_t *index,
+                    const char *value, size_t len, struct search_set_t *set)
+{
+  size_t i;
+  int best = -1;
+
+  if (len < 3)
+    return false;
+
+  set->ranks = NULL;
+  set->count = 0;
+  set->owned = false;
+
+  /* start from the shortest posting list */
+  for (i = 0; i + 3 <= len; i++)
+  {
+    int t = search_index_find_trigram (index, search_index_trigram (value + i));
+
+    if (t < 0)
+      return true; /* no title at all */
+    if (best < 0 || index->trigram_start[t + 1] - index->trigram_start[t]
+        < index->trigram_start[best + 1] - index->trigram_start[best])
+      best = t;
+  }
+
+  set->ranks = index->trigram_ranks + index->trigram_start[best];
+  set->count = index->trigram_start[best + 1] - index->trigram_start[best];
+
+  for (i = 0; i + 3 <= len && set->count; i++)
+  {
+    struct search_set_t other;
+    int t = search_index_find_trigram (index, search_index_trigram (value + i));
+
+    if (t == best)
+      continue;
+
+    other.ranks = index->trigram_ranks + index->trigram_start[t];
+    other.count = index->trigram_start[t + 1] - index->trigram_start[t];
+    other.owned = false;
+    search_set_and (set, &other);
+  }
+
+  return true;
+}
+
+void
+search_set_free (struct search_set_t *set)
+{
+  if (set->owned && set->ranks)
+    free (set->ranks);
+
+  set->ranks = NULL;
+  set->count = 0;
+  set->owned = false;
+}
+
+/*
+ * search_set_and : keep in set what's in other as well, other is freed.
+ *  set is left as it is if memory is short, i.e. it may hold too much.
+ */
+void
+search_set_and (struct search_set_t *set, struct search_set_t *other)
+{
+  int *ranks = set->ranks;
+  int i = 0, j = 0, n = 0;
+
+  if (!set->owned && set->count)
+  {
+    ranks = (int *) malloc (set->count * sizeof (int));
+    if (!ranks)
+    {
+      search_set_free (other);
+      return;
+    }
+  }
+
+  /* writing never gets ahead of reading, ranks may be set->ranks */
+  while (i < set->count && j < other->count)
+  {
+    if (set->ranks[i] < other->ranks[j])
+      i++;
+    else if (set->ranks[i] > other->ranks[j])
+      j++;
+    else
+    {
+      ranks[n++] = set->ranks[i];
+      i++;
+      j++;
+    }
+  }
+
+  if (!set->owned && set->count)
+    set->owned = true;
+  set->ranks = ranks;
+  set->count = n;
+
+  search_set_free (other);
+}
+
+/*
+ * search_set_or : add to set what's in other, other is freed.
+ *  Returns false if memory is short, both are freed then.
+ */
+bool
+search_set_or (struct search_set_t *set, struct search_set_t *other)
+{
+  int *ranks;
+  int i = 0, j = 0, n = 0;
+
+  if (!other->count)
+  {
+    search_set_free (other);
+    return true;
+  }
+
+  if (!set->count)
+  {
+    search_set_free (set);
+    *set = *other;
+    return true;
+  }
+
+  ranks = (int *) malloc ((set->count + other->count) * sizeof (int));
+  if (!ranks)
+  {
+    search_set_free (set);
+    search_set_free (other);
+    return false;
+  }
+
+  while (i < set->count || j < other->count)
+  {
+    if (j == other->count
+        || (i < set->count && set->ranks[i] < other->ranks[j]))
+      ranks[n++] = set->ranks[i++];
+    else if (i == set->count || set->ranks[i] > other->ranks[j])
+      ranks[n++] = other->ranks[j++];
+    else
+    {
+      ranks[n++] = set->ranks[i++];
+      j++;
+    }
+  }
+
+  search_set_free (set);
+  search_set_free (other);
+  set->ranks = ranks;
+  set->count = n;
+  set->owned = true;
+
+  return true;
+}
+
+/* Position of the first rank of set not below rank */
+int
+search_set_find (const struct search_set_t *set, int rank)
+{
+  int lo = 0, hi = set->count;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (set->ranks[mid] < rank)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
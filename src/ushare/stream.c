@@ -0,0 +1,739 @@
+/*
+ * stream.c : GeeXboX uShare media streaming, zero-copy HTTP server.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+
+#ifdef HAVE_SENDFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+
+#include "ushare.h"
+#include "metadata.h"
+#include "http.h"
+#include "gettext.h"
+#include "trace.h"
+#include "stream.h"
+#include "reader.h"
+
+#define PROTOCOL_TYPE_PRE_SZ  11   /* for the str length of "http-get:*:" */
+
+/* a connected client, served by its own thread */
+struct stream_client_t {
+  int sock;
+  char buf[STREAM_HEADER_SIZE + 1];
+  size_t len; /* bytes of buf received so far */
+  struct stream_client_t *next;
+};
+
+/* what a request asks for */
+struct stream_request_t {
+  bool head;
+  bool keep_alive;
+  bool features; /* getcontentFeatures.dlna.org: 1 */
+  int id;
+  const char *range; /* value of the Range header, if any */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t done; /* signaled as clients go away */
+  pthread_t thread;
+  bool started;
+  int listener;
+  int wakeup[2];
+  unsigned short port;
+  struct ushare_t *ut;
+  struct stream_client_t *clients;
+  int nr_clients;
+} stream = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * stream_send: send the whole of buf, return -1 if the client went away
+ */
+static int
+stream_send (int sock, const char *buf, size_t len)
+{
+  while (len)
+  {
+    ssize_t n = send (sock, buf, len, MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * stream_send_error: answer the request with an empty body
+ */
+static int
+stream_send_error (struct stream_client_t *client, const char *status,
+                   bool keep_alive)
+{
+  char buf[256];
+  int len;
+
+  len = snprintf (buf, sizeof (buf),
+                  "HTTP/1.1 %s\r\n"
+                  "Content-Length: 0\r\n"
+                  "Connection: %s\r\n"
+                  "\r\n", status, keep_alive ? "keep-alive" : "close");
+
+  return stream_send (client->sock, buf, len);
+}
+
+/*
+ * stream_send_file: send len bytes of the file from offset, straight
+ *  from the page cache to the socket when the kernel allows it
+ */
+static int
+stream_send_file (int sock, struct reader_t *reader, off_t offset, off_t len)
+{
+  bool copy = false;
+
+  while (len > 0 && !copy)
+  {
+    ssize_t n;
+
+    reader_advance (reader, offset);
+    n = sendfile (sock, reader->fd, &offset,
+                  len > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : len);
+
+    if (n < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      /* the file can't be mapped (e.g. some FUSE mounts), copy it */
+      if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+      copy = true;
+    }
+    else if (n == 0)
+      return -1; /* the file has been truncated */
+    else
+      len -= n;
+  }
+
+  while (len > 0)
+  {
+    char buf[65536];
+    ssize_t n;
+
+    reader_advance (reader, offset);
+    n = pread (reader->fd, buf, len > (off_t) sizeof (buf)
+               ? (off_t) sizeof (buf) : len, offset);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || stream_send (sock, buf, n) < 0)
+      return -1;
+    offset += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * stream_header: return the value of this header of the request, NULL
+ *  if it has none
+ */
+static const char *
+stream_header (const char *headers, const char *name, size_t *len)
+{
+  size_t name_len = strlen (name);
+  const char *line;
+
+  for (line = strstr (headers, "\r\n"); line && line[2] != '\r';
+       line = strstr (line + 2, "\r\n"))
+  {
+    const char *value = line + 2;
+
+    if (strncasecmp (value, name, name_len) || value[name_len] != ':')
+      continue;
+
+    value += name_len + 1;
+    while (*value == ' ' || *value == '\t')
+      value++;
+    *len = strcspn (value, "\r");
+    return value;
+  }
+
+  return NULL;
+}
+
+/*
+ * stream_parse_request: parse the request line and the headers we care
+ *  about, return the HTTP status to fail with, NULL if it can be served
+ */
+static const char *
+stream_parse_request (char *headers, struct stream_request_t *req)
+{
+  char *method, *path, *version, *end;
+  const char *value;
+  size_t len;
+
+  memset (req, 0, sizeof (struct stream_request_t));
+
+  method = headers;
+  path = strchr (method, ' ');
+  if (!path)
+    return "400 Bad Request";
+  version = strchr (path + 1, ' ');
+  if (!version || strncmp (version + 1, "HTTP/1.", 7))
+    return "400 Bad Request";
+
+  /* HTTP/1.1 connections persist unless told otherwise */
+  req->keep_alive = (version[8] != '0');
+  value = stream_header (headers, "Connection", &len);
+  if (value && len == 5 && !strncasecmp (value, "close", 5))
+    req->keep_alive = false;
+  else if (value && len == 10 && !strncasecmp (value, "keep-alive", 10))
+    req->keep_alive = true;
+
+  if (path - method == 4 && !strncmp (method, "HEAD", 4))
+    req->head = true;
+  else if (path - method != 3 || strncmp (method, "GET", 3))
+    return "501 Not Implemented";
+
+  path++;
+  if (strncmp (path, VIRTUAL_DIR "/", strlen (VIRTUAL_DIR) + 1))
+    return "404 Not Found";
+  req->id = strtol (path + strlen (VIRTUAL_DIR) + 1, &end, 10);
+  if (end == path + strlen (VIRTUAL_DIR) + 1)
+    return "404 Not Found";
+
+  value = stream_header (headers, "getcontentFeatures.dlna.org", &len);
+  req->features = (value && len == 1 && *value == '1');
+
+  req->range = stream_header (headers, "Range", &len);
+
+  return NULL;
+}
+
+/*
+ * stream_parse_range: turn the Range header into the bytes to send,
+ *  return -1 if none of them is in the file
+ */
+static int
+stream_parse_range (const char *range, off_t size, off_t *first, off_t *last)
+{
+  long long from, to = size - 1;
+  char *end;
+
+  *first = 0;
+  *last = size - 1;
+
+  /* only single ranges are served, anything else gets the whole file */
+  if (!range || strncmp (range, "bytes=", 6))
+    return 0;
+  range += 6;
+
+  if (*range == '-')
+  {
+    /* the last N bytes */
+    long long n = strtoll (range + 1, &end, 10);
+
+    if (end == range + 1 || (*end != '\r' && *end != '\0'))
+      return 0;
+    if (n <= 0 || size == 0)
+      return -1;
+    *first = n < size ? size - n : 0;
+    return 1;
+  }
+
+  from = strtoll (range, &end, 10);
+  if (end == range || *end != '-' || from < 0)
+    return 0;
+  range = end + 1;
+
+  if (*range != '\r' && *range != '\0')
+  {
+    to = strtoll (range, &end, 10);
+    if (end == range || (*end != '\r' && *end != '\0') || to < from)
+      return 0;
+    if (to >= size)
+      to = size - 1;
+  }
+
+  if (from >= size)
+    return -1;
+
+  *first = from;
+  *last = to;
+
+  return 1;
+}
+
+/*
+ * stream_serve: answer one request, return -1 if the connection must be
+ *  closed afterwards
+ */
+static int
+stream_serve (struct stream_client_t *client, char *headers)
+{
+  struct metadata_list_t *list;
+  struct upnp_entry_t *entry;
+  struct stream_request_t req;
+  const char *status;
+  char path[PATH_MAX], answer[1024];
+  char *protocol = NULL, *type, *features;
+  struct stat st;
+  off_t first, last;
+  struct reader_t reader;
+  int range, len, res;
+
+  status = stream_parse_request (headers, &req);
+  if (status)
+  {
+    stream_send_error (client, status, false);
+    return -1;
+  }
+
+  list = metadata_list_get (stream.ut);
+  entry = upnp_get_entry (list, req.id);
+  if (entry && upnp_entry_get_path (entry, path, sizeof (path)) >= 0)
+    protocol = http_get_protocol (entry);
+  /* the entry may go away, only its path and protocol are needed */
+  metadata_list_put (stream.ut, list);
+
+  if (!protocol)
+  {
+    res = stream_send_error (client, "404 Not Found", req.keep_alive);
+    return res < 0 || !req.keep_alive ? -1 : 0;
+  }
+
+  if (reader_open (&reader, req.id, path) < 0)
+    status = (errno == EACCES) ? "403 Forbidden" : "404 Not Found";
+  else if (fstat (reader.fd, &st) < 0 || !S_ISREG (st.st_mode))
+  {
+    status = "404 Not Found";
+    reader_close (&reader);
+  }
+  if (status)
+  {
+    free (protocol);
+    res = stream_send_error (client, status, req.keep_alive);
+    return res < 0 || !req.keep_alive ? -1 : 0;
+  }
+
+  /* "http-get:*:<content type>:<DLNA features>" */
+  type = protocol + PROTOCOL_TYPE_PRE_SZ;
+  features = strchr (type, ':');
+  if (features)
+    *features++ = '\0';
+
+  range = stream_parse_range (req.range, st.st_size, &first, &last);
+  if (range < 0)
+  {
+    len = snprintf (answer, sizeof (answer),
+                    "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                    "Content-Range: bytes */%lld\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: %s\r\n"
+                    "\r\n", (long long) st.st_size,
+                    req.keep_alive ? "keep-alive" : "close");
+    res = stream_send (client->sock, answer, len);
+    reader_close (&reader);
+    free (protocol);
+    return res < 0 || !req.keep_alive ? -1 : 0;
+  }
+
+  len = snprintf (answer, sizeof (answer),
+                  "HTTP/1.1 %s\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %lld\r\n"
+                  "Accept-Ranges: bytes\r\n"
+                  "transferMode.dlna.org: Streaming\r\n",
+                  range ? "206 Partial Content" : "200 OK", type,
+                  (long long) (last - first + 1));
+  if (range)
+    len += snprintf (answer + len, sizeof (answer) - len,
+                     "Content-Range: bytes %lld-%lld/%lld\r\n",
+                     (long long) first, (long long) last,
+                     (long long) st.st_size);
+  if (req.features && features && strcmp (features, "*"))
+    len += snprintf (answer + len, sizeof (answer) - len,
+                     "contentFeatures.dlna.org: %s\r\n", features);
+  len += snprintf (answer + len, sizeof (answer) - len,
+                   "Connection: %s\r\n\r\n",
+                   req.keep_alive ? "keep-alive" : "close");
+  free (protocol);
+
+  if (len >= (int) sizeof (answer))
+  {
+    reader_close (&reader);
+    stream_send_error (client, "500 Internal Server Error", false);
+    return -1;
+  }
+
+  if (!req.head && first == 0)
+  {
+    log_verbose ("Streaming File: %s\n", path);
+  }
+
+  res = stream_send (client->sock, answer, len);
+  if (res == 0 && !req.head && st.st_size > 0)
+  {
+    /* the range starts where the rate gets measured from */
+    reader_seek (&reader, first);
+    res = stream_send_file (client->sock, &reader, first, last - first + 1);
+  }
+  reader_close (&reader);
+
+  return res < 0 || !req.keep_alive ? -1 : 0;
+}
+
+/*
+ * stream_read_request: receive the headers of the next request, return
+ *  their length or -1 when the connection is done
+ */
+static int
+stream_read_request (struct stream_client_t *client)
+{
+  while (true)
+  {
+    char *end;
+    ssize_t n;
+
+    client->buf[client->len] = '\0';
+    end = strstr (client->buf, "\r\n\r\n");
+    if (end)
+      return end + 4 - client->buf;
+
+    if (client->len == STREAM_HEADER_SIZE)
+    {
+      stream_send_error (client, "400 Bad Request", false);
+      return -1;
+    }
+
+    n = recv (client->sock, client->buf + client->len,
+              STREAM_HEADER_SIZE - client->len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1; /* closed, or idle for too long */
+    client->len += n;
+  }
+}
+
+/*
+ * stream_client_thread: serve the requests of a client until it leaves
+ */
+static void *
+stream_client_thread (void *arg)
+{
+  struct stream_client_t *client = (struct stream_client_t *) arg;
+  struct stream_client_t **c;
+  sigset_t set;
+
+  /* sendfile () has no MSG_NOSIGNAL, a client going away mid-stream
+     must only fail the call */
+  sigemptyset (&set);
+  sigaddset (&set, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  while (true)
+  {
+    int len = stream_read_request (client);
+    char save;
+
+    if (len < 0)
+      break;
+
+    /* the headers are terminated in place, pipelined requests follow */
+    save = client->buf[len];
+    client->buf[len] = '\0';
+    if (stream_serve (client, client->buf) < 0)
+      break;
+    client->buf[len] = save;
+
+    client->len -= len;
+    memmove (client->buf, client->buf + len, client->len);
+  }
+
+  pthread_mutex_lock (&stream.lock);
+  for (c = &stream.clients; *c; c = &(*c)->next)
+    if (*c == client)
+    {
+      *c = client->next;
+      break;
+    }
+  stream.nr_clients--;
+  close (client->sock);
+  pthread_cond_signal (&stream.done);
+  pthread_mutex_unlock (&stream.lock);
+
+  free (client);
+
+  return NULL;
+}
+
+/*
+ * stream_accept: hand a new connection to a thread of its own
+ */
+static void
+stream_accept (void)
+{
+  struct stream_client_t *client;
+  struct timeval tv = { STREAM_IDLE_TIMEOUT, 0 };
+  pthread_attr_t attr;
+  pthread_t thread;
+  int sock;
+
+  sock = accept (stream.listener, NULL, NULL);
+  if (sock < 0)
+  {
+    if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+      perror ("accept");
+    return;
+  }
+
+  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+  client = malloc (sizeof (struct stream_client_t));
+  if (!client)
+  {
+    close (sock);
+    return;
+  }
+  client->sock = sock;
+  client->len = 0;
+
+  pthread_mutex_lock (&stream.lock);
+  if (stream.nr_clients >= STREAM_MAX_CLIENTS)
+  {
+    pthread_mutex_unlock (&stream.lock);
+    stream_send_error (client, "503 Service Unavailable", false);
+    close (sock);
+    free (client);
+    return;
+  }
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, stream_client_thread, client))
+  {
+    pthread_attr_destroy (&attr);
+    pthread_mutex_unlock (&stream.lock);
+    perror ("Failed to create thread");
+    close (sock);
+    free (client);
+    return;
+  }
+  pthread_attr_destroy (&attr);
+
+  client->next = stream.clients;
+  stream.clients = client;
+  stream.nr_clients++;
+  pthread_mutex_unlock (&stream.lock);
+}
+
+/*
+ * stream_thread: accept new connections until stream_stop ()
+ */
+static void *
+stream_thread (void *arg __attribute__ ((unused)))
+{
+  while (true)
+  {
+    struct pollfd fds[2];
+
+    fds[0].fd = stream.listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = stream.wakeup[0];
+    fds[1].events = POLLIN;
+
+    if (poll (fds, 2, -1) < 0 && errno != EINTR)
+    {
+      perror ("poll");
+      break;
+    }
+
+    if (fds[1].revents)
+      break;
+
+    if (fds[0].revents & POLLIN)
+      stream_accept ();
+  }
+
+  return NULL;
+}
+
+/*
+ * stream_start: listen for media requests on a port of our own
+ */
+int
+stream_start (struct ushare_t *ut)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  int on = 1;
+
+  if (!ut || !ut->ip || !ut->stream_port)
+    return -1;
+
+  pthread_mutex_lock (&stream.lock);
+  if (stream.started)
+  {
+    pthread_mutex_unlock (&stream.lock);
+    return 0;
+  }
+
+  stream.listener = socket (PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stream.listener < 0)
+  {
+    perror ("socket");
+    pthread_mutex_unlock (&stream.lock);
+    return -1;
+  }
+
+  /* the same interface as the UPnP server, media is served nowhere else */
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (ut->stream_port);
+  if (inet_pton (AF_INET, ut->ip, &addr.sin_addr) != 1)
+  {
+    log_error (_("Invalid stream server address %s\n"), ut->ip);
+    close (stream.listener);
+    pthread_mutex_unlock (&stream.lock);
+    return -1;
+  }
+
+  /* restart_upnp () binds it again right away */
+  setsockopt (stream.listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+  if (bind (stream.listener, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (stream.listener, STREAM_BACKLOG) < 0
+      || getsockname (stream.listener, (struct sockaddr *) &addr, &len) < 0)
+  {
+    perror ("stream");
+    close (stream.listener);
+    pthread_mutex_unlock (&stream.lock);
+    return -1;
+  }
+
+  if (pipe (stream.wakeup) < 0)
+  {
+    perror ("pipe");
+    close (stream.listener);
+    pthread_mutex_unlock (&stream.lock);
+    return -1;
+  }
+
+  stream.ut = ut;
+  if (pthread_create (&stream.thread, NULL, stream_thread, NULL))
+  {
+    perror ("Failed to create thread");
+    close (stream.wakeup[0]);
+    close (stream.wakeup[1]);
+    close (stream.listener);
+    pthread_mutex_unlock (&stream.lock);
+    return -1;
+  }
+
+  stream.port = ntohs (addr.sin_port);
+  stream.started = true;
+  pthread_mutex_unlock (&stream.lock);
+
+  log_info (_("Streaming media on %s:%u\n"), ut->ip, stream.port);
+
+  return 0;
+}
+
+/*
+ * stream_stop: stop accepting connections and wait for the clients
+ *  being served to go away
+ */
+void
+stream_stop (void)
+{
+  struct stream_client_t *client;
+
+  pthread_mutex_lock (&stream.lock);
+  if (!stream.started)
+  {
+    pthread_mutex_unlock (&stream.lock);
+    return;
+  }
+  stream.started = false;
+  stream.port = 0;
+  pthread_mutex_unlock (&stream.lock);
+
+  if (write (stream.wakeup[1], "", 1) < 0)
+    perror ("write");
+  pthread_join (stream.thread, NULL);
+
+  close (stream.listener);
+  close (stream.wakeup[0]);
+  close (stream.wakeup[1]);
+
+  /* wake up the clients blocked in recv () or sendfile () */
+  pthread_mutex_lock (&stream.lock);
+  for (client = stream.clients; client; client = client->next)
+    shutdown (client->sock, SHUT_RDWR);
+  while (stream.nr_clients)
+    pthread_cond_wait (&stream.done, &stream.lock);
+  pthread_mutex_unlock (&stream.lock);
+}
+
+/*
+ * stream_get_port: return the port media is streamed from, 0 if the
+ *  stream server isn't running
+ */
+unsigned short
+stream_get_port (void)
+{
+  unsigned short port;
+
+  pthread_mutex_lock (&stream.lock);
+  port = stream.port;
+  pthread_mutex_unlock (&stream.lock);
+
+  return port;
+}
+
+#endif /* HAVE_SENDFILE */
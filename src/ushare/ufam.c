@@ -25,7 +25,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#ifndef HAVE_INOTIFY
 #include <fam.h>
+#endif /* HAVE_INOTIFY */
 #include <sys/select.h>
 #include <pthread.h>
 
@@ -37,6 +42,130 @@
 #include "mime.h"
 #include "ufam.h"
 
+#define UFAM_BATCH_DEFAULT_SIZE 16
+
+static long long
+ufam_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * ufam_batch_add: remember that the directory with this ID has changed
+ */
+void
+ufam_batch_add (struct ufam_batch_t *batch, int id)
+{
+  int i;
+
+  batch->last = ufam_now ();
+  if (!batch->count && !batch->rebuild)
+    batch->first = batch->last;
+
+  for (i = 0; i < batch->count; i++)
+    if (batch->ids[i] == id)
+      return;
+
+  if (batch->count == batch->size)
+  {
+    int *ids;
+    int size = batch->size ? 2 * batch->size : UFAM_BATCH_DEFAULT_SIZE;
+
+    ids = (int *) realloc (batch->ids, size * sizeof (int));
+    if (!ids)
+    {
+      /* can't keep track of it, rescan everything instead */
+      batch->rebuild = true;
+      return;
+    }
+    batch->ids = ids;
+    batch->size = size;
+  }
+
+  batch->ids[batch->count++] = id;
+}
+
+/* time to rescan the directories of the batch at, -1 if there's none */
+static long long
+ufam_batch_due (struct ufam_batch_t *batch)
+{
+  long long quiet, delay;
+
+  if (!batch->count && !batch->rebuild)
+    return -1;
+
+  quiet = batch->last + UFAM_QUIET_PERIOD;
+  delay = batch->first + UFAM_MAX_DELAY;
+
+  return delay < quiet ? delay : quiet;
+}
+
+/*
+ * ufam_batch_timeout: return how long (in ms) to wait for more events
+ *  before flushing the batch, -1 if there's nothing to flush
+ */
+int
+ufam_batch_timeout (struct ufam_batch_t *batch)
+{
+  long long now, due;
+
+  due = ufam_batch_due (batch);
+  if (batch->save && (due < 0 || batch->save < due))
+    due = batch->save;
+  if (due < 0)
+    return -1;
+
+  now = ufam_now ();
+
+  return due > now ? (int) (due - now) : 0;
+}
+
+/*
+ * ufam_batch_flush: rescan every directory of the batch, once, then
+ *  save the metadata index when it's time to
+ */
+void
+ufam_batch_flush (struct ushare_t *ut, struct ufam_batch_t *batch)
+{
+  long long now = ufam_now (), due = ufam_batch_due (batch);
+
+  if (due >= 0 && due <= now)
+  {
+    if (batch->rebuild)
+    {
+      /* IDs are kept, unlike with a full rebuild */
+      log_verbose (_("ufam - too many changes, rescanning every directory\n"));
+      metadata_rescan_all (ut);
+    }
+    else
+    {
+      log_verbose (_("ufam - %d dirs have changed\n"), batch->count);
+      /* the directories are all updated at once, in a single new version */
+      metadata_rescan_containers (ut, batch->ids, batch->count);
+    }
+
+    batch->count = 0;
+    batch->rebuild = false;
+    if (!batch->save)
+      batch->save = now + UFAM_SAVE_DELAY;
+  }
+
+  if (batch->save && batch->save <= now)
+  {
+    /* nothing is written if no entry has changed */
+    metadata_save_index (ut);
+    batch->save = 0;
+  }
+}
+
+#ifndef HAVE_INOTIFY
+
+/* how often the thread checks whether it has been asked to stop (ms) */
+#define UFAM_POLL_TIMEOUT 1000
+
 
 /*
  * ufam_entry_new : return a malloc'd ufam_entry_t struct
@@ -76,13 +205,18 @@ ufam_entry_free (struct ufam_entry_t *ufam_entry)
 static void *
 ufam_thread (void *arg)
 {
-  int rc;
+  int rc, fd, timeout;
   FAMEvent fe;
-  struct upnp_entry_t *entry;
   struct ushare_t *ut = (struct ushare_t*) arg;
+  struct ufam_batch_t batch = { NULL, 0, 0, false, 0, 0, 0 };
+
+  fd = FAMCONNECTION_GETFD (&ut->ufam->fc);
 
   while (true)
   {
+    fd_set rfds;
+    struct timeval tv;
+
     pthread_mutex_lock (&ut->ufam->startstop_lock);
     if (ut->ufam->stop)
     {
@@ -92,11 +226,21 @@ ufam_thread (void *arg)
     }
     pthread_mutex_unlock (&ut->ufam->startstop_lock);
 
-    rc = FAMPending(&ut->ufam->fc);
-    if (rc == -1)
-      perror("FAMPending");
-
-    if (rc > 0)
+    /* block until FAM has something for us instead of spinning on
+       FAMPending (), wake up regularly to check for ufam_stop () */
+    timeout = ufam_batch_timeout (&batch);
+    if (timeout < 0 || timeout > UFAM_POLL_TIMEOUT)
+      timeout = UFAM_POLL_TIMEOUT;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    FD_ZERO (&rfds);
+    FD_SET (fd, &rfds);
+    if (select (fd + 1, &rfds, NULL, NULL, &tv) < 0 && errno != EINTR)
+      perror ("select");
+
+    /* gather every pending event, a directory is rescanned only once */
+    while ((rc = FAMPending(&ut->ufam->fc)) > 0)
     {
       if (FAMNextEvent(&ut->ufam->fc, &fe) < 0)
       {
@@ -109,17 +253,20 @@ ufam_thread (void *arg)
         case FAMDeleted:
         case FAMCreated:
         case FAMMoved:
-          entry = (struct upnp_entry_t *) fe.userdata;
-          if (entry)
-            log_verbose(_("ufam - dir %s has changed\n"), entry->fullpath);
-          /* TODO : rebuild metadat_list for this dir instead of rebuild from scratch */
-          free_metadata_list (ut);
-          build_metadata_list (ut);
+          ufam_batch_add (&batch, (int) (intptr_t) fe.userdata);
           break;
       }
     }
+    if (rc == -1)
+      perror("FAMPending");
+
+    if (ufam_batch_timeout (&batch) == 0)
+      ufam_batch_flush (ut, &batch);
   }
 
+  if (batch.ids)
+    free (batch.ids);
+
   pthread_exit (NULL);
   return NULL;
 }
@@ -222,16 +369,20 @@ struct ufam_entry_t *
 ufam_add_monitor(struct ufam_t *ufam, struct upnp_entry_t *entry)
 {
   struct ufam_entry_t *ufam_entry = NULL;
+  char path[PATH_MAX];
 
-  if (!entry->fullpath)
+  if (upnp_entry_get_path (entry, path, sizeof (path)) < 0)
     return NULL;
 
-  //log_verbose("ufam - new monitor for %s\n", entry->fullpath);
+  //log_verbose("ufam - new monitor for %s\n", path);
   pthread_mutex_lock (&ufam->add_monitor_lock);
 
   ufam_entry = ufam_entry_new (ufam, entry);
 
-  if (FAMMonitorDirectory(&ufam->fc, entry->fullpath, &ufam_entry->fr , (void*) entry ) < 0)
+  /* pass the ID rather than the entry itself, which may be freed
+     while some of its events are still pending */
+  if (FAMMonitorDirectory(&ufam->fc, path, &ufam_entry->fr,
+                          (void *) (intptr_t) entry->id) < 0)
   {
     perror("FAMMonitor failed");
     exit(1);
@@ -258,4 +409,6 @@ ufam_remove_monitor (struct ufam_entry_t *ufam_entry)
   ufam_entry_free (ufam_entry);
 }
 
+#endif /* HAVE_INOTIFY */
+
 #endif /* HAVE_FAM */
@@ -0,0 +1,375 @@
+/*
+ * ufam_inotify.c : GeeXboX uShare file alterative monitor, inotify backend
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdafx.h>
+
+
+#ifdef HAVE_INOTIFY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+
+#include "ushare.h"
+#include "metadata.h"
+#include "gettext.h"
+#include "trace.h"
+#include "ufam.h"
+
+#define UFAM_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                           | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+#define UFAM_EVENTS_BUFFER_SIZE 16384
+
+#define UFAM_HASH(wd) ((unsigned int) (wd) & (UFAM_HASH_SIZE - 1))
+
+/*
+ * ufam_find_watch: return the monitored entry with this watch descriptor
+ *  note: must be called with add_monitor_lock held
+ */
+static struct ufam_entry_t *
+ufam_find_watch (struct ufam_t *ufam, int wd)
+{
+  struct ufam_entry_t *ufam_entry;
+
+  for (ufam_entry = ufam->watches[UFAM_HASH (wd)]; ufam_entry;
+       ufam_entry = ufam_entry->next)
+    if (ufam_entry->wd == wd)
+      return ufam_entry;
+
+  return NULL;
+}
+
+/*
+ * ufam_read_events: read all available inotify events and add the
+ *  directories they belong to into batch
+ */
+static void
+ufam_read_events (struct ufam_t *ufam, struct ufam_batch_t *batch)
+{
+  char buf[UFAM_EVENTS_BUFFER_SIZE]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read (ufam->fd, buf, sizeof (buf))) > 0)
+  {
+    char *ptr;
+
+    for (ptr = buf; ptr < buf + len;
+         ptr += sizeof (struct inotify_event)
+           + ((struct inotify_event *) ptr)->len)
+    {
+      const struct inotify_event *ev = (const struct inotify_event *) ptr;
+      struct ufam_entry_t *ufam_entry;
+
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        /* events were dropped, we can't tell what has changed */
+        ufam_batch_add (batch, -1);
+        batch->rebuild = true;
+        continue;
+      }
+
+      if (ev->mask & IN_IGNORED)
+        continue;
+
+      pthread_mutex_lock (&ufam->add_monitor_lock);
+      ufam_entry = ufam_find_watch (ufam, ev->wd);
+      if (ufam_entry)
+        ufam_batch_add (batch, ufam_entry->id);
+      pthread_mutex_unlock (&ufam->add_monitor_lock);
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EINTR)
+    perror ("read");
+}
+
+/*
+ * ufam_thread: new thread to monitor changes in inotify events
+ *  @arg: is a struct ushare_t* var
+ */
+static void *
+ufam_thread (void *arg)
+{
+  struct ushare_t *ut = (struct ushare_t*) arg;
+  struct ufam_t *ufam = ut->ufam;
+  struct ufam_batch_t batch = { NULL, 0, 0, false, 0, 0, 0 };
+
+  while (true)
+  {
+    struct epoll_event events[2];
+    int i, n;
+
+    /* sleep until something happens, or until the batch is due */
+    n = epoll_wait (ufam->epfd, events, 2, ufam_batch_timeout (&batch));
+    if (n < 0 && errno != EINTR)
+    {
+      perror ("epoll_wait");
+      break;
+    }
+
+    pthread_mutex_lock (&ufam->startstop_lock);
+    if (ufam->stop)
+    {
+      pthread_mutex_unlock (&ufam->startstop_lock);
+      break;
+    }
+    pthread_mutex_unlock (&ufam->startstop_lock);
+
+    for (i = 0; i < n; i++)
+      if (events[i].data.fd == ufam->fd)
+        ufam_read_events (ufam, &batch);
+
+    if (ufam_batch_timeout (&batch) == 0)
+      ufam_batch_flush (ut, &batch);
+  }
+
+  if (batch.ids)
+    free (batch.ids);
+
+  pthread_exit (NULL);
+  return NULL;
+}
+
+
+/*
+ * ufam_init: initialize a new inotify instance
+ */
+struct ufam_t *
+ufam_init (void)
+{
+  struct ufam_t *ufam = NULL;
+  struct epoll_event ev;
+
+  ufam = (struct ufam_t *) malloc (sizeof (struct ufam_t));
+  if (!ufam)
+    return NULL;
+
+  memset (ufam->watches, 0, sizeof (ufam->watches));
+  ufam->stop = false;
+  ufam->epfd = -1;
+  ufam->wakeup[0] = -1;
+  ufam->wakeup[1] = -1;
+
+  ufam->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (ufam->fd < 0)
+  {
+    perror ("inotify_init");
+    free (ufam);
+    return NULL;
+  }
+
+  ufam->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (ufam->epfd < 0 || pipe (ufam->wakeup) < 0)
+  {
+    perror ("ufam");
+    goto err;
+  }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = ufam->fd;
+  if (epoll_ctl (ufam->epfd, EPOLL_CTL_ADD, ufam->fd, &ev) < 0)
+  {
+    perror ("epoll_ctl");
+    goto err;
+  }
+
+  ev.data.fd = ufam->wakeup[0];
+  if (epoll_ctl (ufam->epfd, EPOLL_CTL_ADD, ufam->wakeup[0], &ev) < 0)
+  {
+    perror ("epoll_ctl");
+    goto err;
+  }
+
+  pthread_mutex_init (&ufam->startstop_lock, NULL);
+  pthread_mutex_init (&ufam->add_monitor_lock, NULL);
+
+  return ufam;
+
+ err:
+  if (ufam->wakeup[0] >= 0)
+  {
+    close (ufam->wakeup[0]);
+    close (ufam->wakeup[1]);
+  }
+  if (ufam->epfd >= 0)
+    close (ufam->epfd);
+  close (ufam->fd);
+  free (ufam);
+
+  return NULL;
+}
+
+
+/*
+ * ufam_start: start the inotify instance - launch the new thread
+ */
+void
+ufam_start (struct ushare_t *ut)
+{
+  if (!ut->ufam)
+    return;
+
+  pthread_mutex_lock (&ut->ufam->startstop_lock);
+
+  if (pthread_create (&ut->ufam->thread, NULL, ufam_thread, (void*) ut))
+  {
+    perror ("Failed to create thread");
+    pthread_mutex_unlock (&ut->ufam->startstop_lock);
+    return;
+  }
+
+  pthread_mutex_unlock (&ut->ufam->startstop_lock);
+}
+
+/*
+ * ufam_stop: stop the inotify instance and wait thread to finish
+ */
+void
+ufam_stop (struct ufam_t *ufam)
+{
+  if (!ufam)
+    return;
+
+  pthread_mutex_lock (&ufam->startstop_lock);
+  ufam->stop = true;
+  pthread_mutex_unlock (&ufam->startstop_lock);
+
+  if (write (ufam->wakeup[1], "", 1) < 0)
+    perror ("write");
+
+  pthread_join (ufam->thread, NULL);
+}
+
+/*
+ * ufam_free: free and close the inotify instance
+ */
+void
+ufam_free (struct ufam_t *ufam)
+{
+  int i;
+
+  if (!ufam)
+    return;
+
+  for (i = 0; i < UFAM_HASH_SIZE; i++)
+    while (ufam->watches[i])
+    {
+      struct ufam_entry_t *next = ufam->watches[i]->next;
+
+      free (ufam->watches[i]);
+      ufam->watches[i] = next;
+    }
+
+  pthread_mutex_destroy (&ufam->add_monitor_lock);
+  pthread_mutex_destroy (&ufam->startstop_lock);
+
+  close (ufam->wakeup[0]);
+  close (ufam->wakeup[1]);
+  close (ufam->epfd);
+  close (ufam->fd);
+
+  free (ufam);
+}
+
+
+/*
+ * ufam_add_monitor: add a new watch for this entry
+ *  note: should only be a Directory to monitor
+ */
+struct ufam_entry_t *
+ufam_add_monitor (struct ufam_t *ufam, struct upnp_entry_t *entry)
+{
+  struct ufam_entry_t *ufam_entry = NULL;
+  char path[PATH_MAX];
+  int wd;
+
+  if (!ufam || upnp_entry_get_path (entry, path, sizeof (path)) < 0)
+    return NULL;
+
+  ufam_entry = (struct ufam_entry_t *) malloc (sizeof (struct ufam_entry_t));
+  if (!ufam_entry)
+    return NULL;
+
+  pthread_mutex_lock (&ufam->add_monitor_lock);
+
+  wd = inotify_add_watch (ufam->fd, path, UFAM_INOTIFY_MASK);
+  if (wd < 0)
+  {
+    /* most likely ENOSPC, see /proc/sys/fs/inotify/max_user_watches */
+    pthread_mutex_unlock (&ufam->add_monitor_lock);
+    log_error (_("Cannot monitor %s : %s\n"), path, strerror (errno));
+    free (ufam_entry);
+    return NULL;
+  }
+
+  ufam_entry->ufam = ufam;
+  ufam_entry->entry = entry;
+  ufam_entry->id = entry->id;
+  ufam_entry->wd = wd;
+  ufam_entry->next = ufam->watches[UFAM_HASH (wd)];
+  ufam->watches[UFAM_HASH (wd)] = ufam_entry;
+
+  pthread_mutex_unlock (&ufam->add_monitor_lock);
+
+  return ufam_entry;
+}
+
+/*
+ * ufam_remove_monitor: remove this entry from the inotify instance
+ */
+void
+ufam_remove_monitor (struct ufam_entry_t *ufam_entry)
+{
+  struct ufam_t *ufam;
+  struct ufam_entry_t **e;
+
+  if (!ufam_entry)
+    return;
+
+  ufam = ufam_entry->ufam;
+  pthread_mutex_lock (&ufam->add_monitor_lock);
+
+  for (e = &ufam->watches[UFAM_HASH (ufam_entry->wd)]; *e; e = &(*e)->next)
+    if (*e == ufam_entry)
+    {
+      *e = ufam_entry->next;
+      break;
+    }
+
+  /* the same directory may be shared twice, and inotify then
+     gives back the same watch : only drop it with its last user */
+  if (!ufam_find_watch (ufam, ufam_entry->wd))
+    inotify_rm_watch (ufam->fd, ufam_entry->wd);
+
+  pthread_mutex_unlock (&ufam->add_monitor_lock);
+
+  free (ufam_entry);
+}
+
+#endif /* HAVE_INOTIFY */
@@ -68,6 +68,7 @@
 #include "ushare_config.h"
 #include "ushare.h"
 #include "services.h"
+#include "cds.h"
 #include "http.h"
 #include "metadata.h"
 #include "util_iconv.h"
@@ -77,9 +78,15 @@
 #include "trace.h"
 #include "buffer.h"
 #include "ctrl_telnet.h"
+#include "scanner.h"
+#include "prefetch.h"
+#include "fdcache.h"
 #ifdef HAVE_FAM
 #include "ufam.h"
 #endif /* HAVE_FAM */
+#ifdef HAVE_SENDFILE
+#include "stream.h"
+#endif /* HAVE_SENDFILE */
 
 struct ushare_t *ut = NULL;
 
@@ -101,15 +108,22 @@ ushare_new (void)
   ut->interface = _strdup (DEFAULT_USHARE_IFACE);
   ut->model_name = _strdup (DEFAULT_USHARE_NAME);
   ut->contentlist = NULL;
-  ut->rb = rbinit (rb_compare, NULL);
-  ut->root_entry = NULL;
-  ut->nr_entries = 0;
+  ut->metadata = NULL;
+  ut->retired = NULL;
   ut->starting_id = STARTING_ENTRY_ID_DEFAULT;
+  ut->next_id = ut->starting_id;
   ut->init = 0;
+  ut->scan_threads = SCANNER_DEFAULT_THREADS;
+  ut->prefetch_size = PREFETCH_DEFAULT_SIZE;
+  ut->prefetch_max = PREFETCH_DEFAULT_MAX;
+  ut->index_file = NULL;
+  ut->index_next_id = 0;
+  ut->index_dirty = false;
   ut->dev = 0;
   ut->udn = NULL;
   ut->ip = NULL;
   ut->port = 0; /* Randomly attributed by libupnp */
+  ut->stream_port = 0;
   ut->telnet_port = CTRL_TELNET_PORT;
   ut->presentation = NULL;
   ut->use_presentation = true;
@@ -134,6 +148,8 @@ ushare_new (void)
 
   pthread_mutex_init (&ut->termination_mutex, NULL);
   pthread_cond_init (&ut->termination_cond, NULL);
+  pthread_mutex_init (&ut->metadata_lock, NULL);
+  pthread_mutex_init (&ut->update_lock, NULL);
 
   return ut;
 }
@@ -152,10 +168,8 @@ ushare_free (struct ushare_t *ut)
     free (ut->model_name);
   if (ut->contentlist)
     content_free (ut->contentlist);
-  if (ut->rb)
-    rbdestroy (ut->rb);
-  if (ut->root_entry)
-    upnp_entry_free (ut, ut->root_entry);
+  if (ut->metadata || ut->retired)
+    free_metadata_list (ut);
   if (ut->udn)
     free (ut->udn);
   if (ut->ip)
@@ -172,6 +186,8 @@ ushare_free (struct ushare_t *ut)
 #endif /* HAVE_DLNA */
   if (ut->cfg_file)
     free (ut->cfg_file);
+  if (ut->index_file)
+    free (ut->index_file);
 
 #ifdef HAVE_FAM
   if (ut->ufam)
@@ -180,6 +196,8 @@ ushare_free (struct ushare_t *ut)
 
   pthread_cond_destroy (&ut->termination_cond);
   pthread_mutex_destroy (&ut->termination_mutex);
+  pthread_mutex_destroy (&ut->update_lock);
+  pthread_mutex_destroy (&ut->metadata_lock);
 
   free (ut);
 }
@@ -269,6 +287,18 @@ handle_action_request (IN UpnpActionRequest *request)
   UpnpActionRequest_set_ErrCode(request,UPNP_SOAP_E_INVALID_ACTION);
 }
 
+static void
+handle_subscription_request (UpnpSubscriptionRequest *request)
+{
+  if (!request || !ut)
+    return;
+
+  if (strcmp (UpnpSubscriptionRequest_get_UDN_cstr (request) + 5, ut->udn))
+    return;
+
+  cds_subscribe (request);
+}
+
 int device_callback_event_handler(Upnp_EventType EventType, const void *Event, void *Cookie)
 {
   switch (EventType)
@@ -276,8 +306,10 @@ int device_callback_event_handler(Upnp_EventType EventType, const void *Event, v
     case UPNP_CONTROL_ACTION_REQUEST:
       handle_action_request ((UpnpActionRequest *) Event);
       break;
-    case UPNP_CONTROL_ACTION_COMPLETE:
     case UPNP_EVENT_SUBSCRIPTION_REQUEST:
+      handle_subscription_request ((UpnpSubscriptionRequest *) Event);
+      break;
+    case UPNP_CONTROL_ACTION_COMPLETE:
     case UPNP_CONTROL_GET_VAR_REQUEST:
       break;
     default:
@@ -297,8 +329,16 @@ finish_upnp (struct ushare_t *ut)
 #ifdef HAVE_FAM
   ufam_stop (ut->ufam);
 #endif /* HAVE_FAM */
+#ifdef HAVE_SENDFILE
+  stream_stop ();
+#endif /* HAVE_SENDFILE */
   UpnpUnRegisterRootDevice (ut->dev);
   UpnpFinish ();
+#ifndef _WIN32
+  /* the web server is gone, and so are the streams it read */
+  prefetch_stop ();
+  fdcache_stop ();
+#endif /* _WIN32 */
 
   return UPNP_E_SUCCESS;
 }
@@ -378,6 +418,21 @@ init_upnp (struct ushare_t *ut)
   log_info (_("UPnP MediaServer listening on %s:%d\n"),
             UpnpGetServerIpAddress(), ut->port);
 
+#ifndef _WIN32
+  /* not fatal either, streams are then read directly */
+  if (prefetch_start (ut->prefetch_size, ut->prefetch_max) < 0)
+    log_error (_("Cannot start the prefetch threads\n"));
+  /* idle descriptors then only expire as other files are opened */
+  if (fdcache_start () < 0)
+    log_error (_("Cannot start the descriptor cache thread\n"));
+#endif /* _WIN32 */
+
+#ifdef HAVE_SENDFILE
+  /* not fatal, media is then served by the libupnp web server */
+  if (ut->stream_port && stream_start (ut) < 0)
+    log_error (_("Cannot start the media stream server\n"));
+#endif /* HAVE_SENDFILE */
+
   UpnpEnableWebserver (TRUE);
 
   {
@@ -764,6 +819,12 @@ reload_config (int s __attribute__ ((unused)))
     reload = true;
   }
 
+  if (ut->stream_port != ut2->stream_port)
+  {
+    ut->stream_port = ut2->stream_port;
+    reload = true;
+  }
+
   if (reload)
   {
     if (restart_upnp (ut) < 0)
@@ -780,10 +841,7 @@ reload_config (int s __attribute__ ((unused)))
   ushare_free (ut2);
 
   if (ut->contentlist)
-  {
-    free_metadata_list (ut);
     build_metadata_list (ut);
-  }
   else
   {
     log_error (_("Error: no content directory to be shared.\n"));
@@ -836,6 +894,29 @@ ushare_kill (ctrl_telnet_client *client,
   ushare_signal_exit ();
 }
 
+#ifdef _MSC_VER
+static void
+ushare_stats (ctrl_telnet_client *client,
+              int argc,
+              char **argv)
+#else
+static void
+ushare_stats (ctrl_telnet_client *client,
+              int argc __attribute__((unused)),
+              char **argv __attribute__((unused)))
+#endif
+{
+  unsigned long hits, misses;
+  int answers;
+  size_t size;
+
+  cds_browse_cache_stats (&hits, &misses, &answers, &size);
+  ctrl_telnet_client_sendf (client,
+                            _("Browse cache: %lu hits, %lu misses, "
+                              "%d answers (%lu bytes)\n"),
+                            hits, misses, answers, (unsigned long) size);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -871,6 +952,7 @@ main (int argc, char **argv)
     free (name);
 
     ut->starting_id = STARTING_ENTRY_ID_XBOX360;
+    ut->next_id = ut->starting_id;
   }
 
   if (ut->daemon)
@@ -946,6 +1028,8 @@ main (int argc, char **argv)
     
     ctrl_telnet_register ("kill", ushare_kill,
                           _("Terminates the uShare server"));
+    ctrl_telnet_register ("stats", ushare_stats,
+                          _("Shows the Browse cache statistics"));
   }
   
   if (init_upnp (ut) < 0)
@@ -965,6 +1049,7 @@ main (int argc, char **argv)
   if (ut->use_telnet)
     ctrl_telnet_stop ();
   finish_upnp (ut);
+  cds_browse_cache_free ();
   free_metadata_list (ut);
   ushare_free (ut);
   finish_iconv ();